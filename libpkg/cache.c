@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2012 Julien Laffaye <jlaffaye@FreeBSD.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Index of the packages in the cache, <cachedir>/cache.sqlite, kept by
+ * pkg_repo_fetch() so that the cache can be cleaned without opening
+ * every package, and so that a package already in the cache under
+ * another path, e.g. for another repository, is linked instead of
+ * being downloaded again.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "pkg.h"
+#include "private/event.h"
+#include "private/pkg.h"
+#include "private/utils.h"
+
+#define CACHE_FILE "cache.sqlite"
+
+static const char cache_schema[] = ""
+	"CREATE TABLE IF NOT EXISTS packages ("
+		"repopath TEXT PRIMARY KEY,"
+		"cksum TEXT NOT NULL,"
+		"size INTEGER NOT NULL,"
+		"origin TEXT NOT NULL"
+	");"
+	"CREATE INDEX IF NOT EXISTS packages_cksum ON packages(cksum);";
+
+/* the fetch threads update the index one at a time */
+static pthread_mutex_t cache_m = PTHREAD_MUTEX_INITIALIZER;
+
+int
+pkg_cache_path(char *path, size_t size)
+{
+	const char *cachedir = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(path, size, "%s/%s", cachedir, CACHE_FILE);
+
+	return (EPKG_OK);
+}
+
+/*
+ * The connection is not kept open: pkgdb_close() shuts sqlite down
+ * and that is only allowed once all of them are closed.
+ */
+static sqlite3 *
+cache_open(void)
+{
+	sqlite3 *s = NULL;
+	char path[MAXPATHLEN + 1];
+
+	if (pkg_cache_path(path, sizeof(path)) != EPKG_OK)
+		return (NULL);
+
+	if (sqlite3_open(path, &s) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		sqlite3_close(s);
+		return (NULL);
+	}
+	sqlite3_busy_timeout(s, 5000);
+
+	if (sql_exec(s, cache_schema) != EPKG_OK) {
+		sqlite3_close(s);
+		return (NULL);
+	}
+
+	return (s);
+}
+
+static int
+cache_insert(sqlite3 *s, const char *repopath, const char *cksum,
+    int64_t size, const char *origin)
+{
+	sqlite3_stmt *stmt;
+	const char sql[] = ""
+		"INSERT OR REPLACE INTO packages (repopath, cksum, size, origin) "
+		"VALUES (?1, ?2, ?3, ?4);";
+	int ret;
+
+	if (sqlite3_prepare_v2(s, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		return (EPKG_FATAL);
+	}
+
+	sqlite3_bind_text(stmt, 1, repopath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, cksum, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, size);
+	sqlite3_bind_text(stmt, 4, origin, -1, SQLITE_STATIC);
+
+	ret = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(s);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Record a package of the cache which matches its checksum.  Failing
+ * to do so is not fatal, pkg_cache_sync() indexes it later on.
+ */
+void
+pkg_cache_add(struct pkg *pkg)
+{
+	struct stat st;
+	sqlite3 *s;
+	char path[MAXPATHLEN + 1];
+	const char *cachedir = NULL;
+	const char *repopath, *sum, *origin;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return;
+
+	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_CKSUM, &sum,
+	    PKG_ORIGIN, &origin);
+
+	snprintf(path, sizeof(path), "%s/%s", cachedir, repopath);
+	if (stat(path, &st) != 0)
+		return;
+
+	pthread_mutex_lock(&cache_m);
+	if ((s = cache_open()) != NULL) {
+		cache_insert(s, repopath, sum, st.st_size, origin);
+		sqlite3_close(s);
+	}
+	pthread_mutex_unlock(&cache_m);
+}
+
+/*
+ * Look for a package with the checksum `cksum' in the cache under
+ * another path than `repopath'.
+ */
+int
+pkg_cache_lookup(const char *cksum, const char *repopath, char *path,
+    size_t size)
+{
+	sqlite3 *s;
+	sqlite3_stmt *stmt = NULL;
+	const char *cachedir = NULL;
+	const char sql[] = ""
+		"SELECT repopath FROM packages "
+		"WHERE cksum = ?1 AND repopath != ?2;";
+	int ret = EPKG_END;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pthread_mutex_lock(&cache_m);
+	if ((s = cache_open()) == NULL) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if (sqlite3_prepare_v2(s, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	sqlite3_bind_text(stmt, 1, cksum, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, repopath, -1, SQLITE_STATIC);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		snprintf(path, size, "%s/%s", cachedir,
+		    sqlite3_column_text(stmt, 0));
+		if (access(path, F_OK) == 0) {
+			ret = EPKG_OK;
+			break;
+		}
+	}
+
+	cleanup:
+	if (stmt != NULL)
+		sqlite3_finalize(stmt);
+	if (s != NULL)
+		sqlite3_close(s);
+	pthread_mutex_unlock(&cache_m);
+
+	return (ret);
+}
+
+/*
+ * Index the packages put in the cache before the index existed, or
+ * by other means than pkg_repo_fetch(), and forget about the ones not
+ * in the cache anymore.  Only the packages not indexed yet are opened.
+ */
+int
+pkg_cache_sync(void)
+{
+	FTS *fts = NULL;
+	FTSENT *ent;
+	sqlite3 *s;
+	sqlite3_stmt *known = NULL;
+	sqlite3_stmt *seen = NULL;
+	struct pkg *pkg = NULL;
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char *paths[2];
+	const char *cachedir = NULL;
+	const char *repopath, *origin, *ext;
+	size_t len;
+	bool found;
+	int ret = EPKG_FATAL;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pthread_mutex_lock(&cache_m);
+	if ((s = cache_open()) == NULL)
+		goto cleanup;
+
+	if (sql_exec(s, "CREATE TEMP TABLE seen (repopath TEXT PRIMARY KEY);"
+	    "BEGIN;") != EPKG_OK)
+		goto cleanup;
+
+	if (sqlite3_prepare_v2(s, "SELECT 1 FROM packages WHERE repopath = ?1;",
+	    -1, &known, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(s, "INSERT OR IGNORE INTO seen VALUES (?1);",
+	    -1, &seen, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		goto cleanup;
+	}
+
+	paths[0] = __DECONST(char *, cachedir);
+	paths[1] = NULL;
+	if ((fts = fts_open(paths, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL) {
+		pkg_emit_errno("fts_open", cachedir);
+		goto cleanup;
+	}
+
+	len = strlen(cachedir);
+	while ((ent = fts_read(fts)) != NULL) {
+		if (ent->fts_info != FTS_F)
+			continue;
+		if (strncmp(ent->fts_name, CACHE_FILE,
+		    sizeof(CACHE_FILE) - 1) == 0)
+			continue;
+		/* downloads in progress or to resume */
+		if ((ext = strrchr(ent->fts_name, '.')) != NULL &&
+		    strcmp(ext, ".part") == 0)
+			continue;
+
+		repopath = ent->fts_path + len;
+		if (repopath[0] == '/')
+			repopath++;
+
+		sqlite3_bind_text(seen, 1, repopath, -1, SQLITE_STATIC);
+		sqlite3_step(seen);
+		sqlite3_reset(seen);
+
+		sqlite3_bind_text(known, 1, repopath, -1, SQLITE_STATIC);
+		found = (sqlite3_step(known) == SQLITE_ROW);
+		sqlite3_reset(known);
+		if (found)
+			continue;
+
+		if (pkg_open_cksum(&pkg, ent->fts_path, sum) != EPKG_OK)
+			continue;
+		pkg_get(pkg, PKG_ORIGIN, &origin);
+		cache_insert(s, repopath, sum, ent->fts_statp->st_size, origin);
+	}
+
+	ret = sql_exec(s, "DELETE FROM packages WHERE repopath NOT IN "
+	    "(SELECT repopath FROM temp.seen);"
+	    "COMMIT;");
+
+	cleanup:
+	if (fts != NULL)
+		fts_close(fts);
+	if (known != NULL)
+		sqlite3_finalize(known);
+	if (seen != NULL)
+		sqlite3_finalize(seen);
+	if (pkg != NULL)
+		pkg_free(pkg);
+	if (s != NULL)
+		sqlite3_close(s);
+	pthread_mutex_unlock(&cache_m);
+
+	return (ret);
+}
+
+int
+pkg_cache_delete(const char *repopath)
+{
+	sqlite3 *s;
+	char path[MAXPATHLEN + 1];
+	const char *cachedir = NULL;
+	int ret = EPKG_OK;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(path, sizeof(path), "%s/%s", cachedir, repopath);
+	if (unlink(path) != 0 && errno != ENOENT) {
+		pkg_emit_errno("unlink", path);
+		return (EPKG_FATAL);
+	}
+
+	pthread_mutex_lock(&cache_m);
+	if ((s = cache_open()) == NULL) {
+		ret = EPKG_FATAL;
+	} else {
+		ret = sql_exec(s, "DELETE FROM packages WHERE repopath = '%q';",
+		    repopath);
+		sqlite3_close(s);
+	}
+	pthread_mutex_unlock(&cache_m);
+
+	return (ret);
+}
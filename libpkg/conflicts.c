@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2012 Julien Laffaye <jlaffaye@FreeBSD.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * In-memory index of the paths owned by the installed packages and by
+ * the packages about to be installed, so that the paths claimed by
+ * several of them are found without a query per path.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h> /* for private/utils.h */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkg.h"
+#include "private/event.h"
+#include "private/pkg.h"
+
+/* the paths and owners are allocated by chunks, and freed at once */
+#define POOL_CHUNK (256 * 1024)
+#define TAB_SIZE 4096
+
+struct pool {
+	struct pool *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct strtab {
+	struct conflict_path **buckets;
+	size_t size;		/* a power of 2 */
+	size_t count;
+};
+
+struct pkg_conflicts {
+	struct pool *pool;
+	struct strtab paths;
+	struct strtab origins;
+	struct conflict_path **conflicts;
+	size_t num_conflicts;
+	size_t cap_conflicts;
+};
+
+static void *
+pool_alloc(struct pkg_conflicts *c, size_t size)
+{
+	struct pool *p = c->pool;
+	size_t chunk;
+	void *ret;
+
+	size = roundup(size, sizeof(void *));
+	if (p == NULL || p->used + size > p->size) {
+		chunk = MAX(size, POOL_CHUNK);
+		if ((p = malloc(sizeof(struct pool) + chunk)) == NULL) {
+			pkg_emit_errno("malloc", "pkg_conflicts");
+			return (NULL);
+		}
+		p->size = chunk;
+		p->used = 0;
+		p->next = c->pool;
+		c->pool = p;
+	}
+	ret = p->data + p->used;
+	p->used += size;
+
+	return (ret);
+}
+
+static const char *
+pool_strdup(struct pkg_conflicts *c, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *ret;
+
+	if ((ret = pool_alloc(c, len)) != NULL)
+		memcpy(ret, s, len);
+
+	return (ret);
+}
+
+/* FNV-1a */
+static uint32_t
+hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static int
+strtab_init(struct strtab *t)
+{
+	t->size = TAB_SIZE;
+	t->count = 0;
+	if ((t->buckets = calloc(t->size, sizeof(struct conflict_path *))) ==
+	    NULL) {
+		pkg_emit_errno("calloc", "pkg_conflicts");
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+strtab_grow(struct strtab *t)
+{
+	struct conflict_path **buckets, *e, *next;
+	size_t size = t->size * 2, i, h;
+
+	if ((buckets = calloc(size, sizeof(struct conflict_path *))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_conflicts");
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < t->size; i++) {
+		for (e = t->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			h = hash(e->path) & (size - 1);
+			e->next = buckets[h];
+			buckets[h] = e;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->size = size;
+
+	return (EPKG_OK);
+}
+
+static struct conflict_path *
+strtab_get(struct pkg_conflicts *c, struct strtab *t, const char *key,
+    bool create)
+{
+	struct conflict_path *e;
+	size_t h = hash(key);
+
+	for (e = t->buckets[h & (t->size - 1)]; e != NULL; e = e->next)
+		if (strcmp(e->path, key) == 0)
+			return (e);
+
+	if (!create)
+		return (NULL);
+
+	if (t->count >= t->size && strtab_grow(t) != EPKG_OK)
+		return (NULL);
+
+	if ((e = pool_alloc(c, sizeof(struct conflict_path))) == NULL ||
+	    (e->path = pool_strdup(c, key)) == NULL)
+		return (NULL);
+	e->owners = NULL;
+	e->next = t->buckets[h & (t->size - 1)];
+	t->buckets[h & (t->size - 1)] = e;
+	t->count++;
+
+	return (e);
+}
+
+static int
+ref_add(struct pkg_conflicts *c, struct conflict_ref **list,
+    struct conflict_owner *owner)
+{
+	struct conflict_ref *r;
+
+	if ((r = pool_alloc(c, sizeof(struct conflict_ref))) == NULL)
+		return (EPKG_FATAL);
+	r->owner = owner;
+	r->next = *list;
+	*list = r;
+
+	return (EPKG_OK);
+}
+
+struct pkg_conflicts *
+pkg_conflicts_new(void)
+{
+	struct pkg_conflicts *c;
+
+	if ((c = calloc(1, sizeof(struct pkg_conflicts))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_conflicts");
+		return (NULL);
+	}
+
+	if (strtab_init(&c->paths) != EPKG_OK ||
+	    strtab_init(&c->origins) != EPKG_OK) {
+		pkg_conflicts_free(c);
+		return (NULL);
+	}
+
+	return (c);
+}
+
+void
+pkg_conflicts_free(struct pkg_conflicts *c)
+{
+	struct pool *p, *next;
+
+	if (c == NULL)
+		return;
+
+	for (p = c->pool; p != NULL; p = next) {
+		next = p->next;
+		free(p);
+	}
+	free(c->paths.buckets);
+	free(c->origins.buckets);
+	free(c->conflicts);
+	free(c);
+}
+
+/*
+ * Add a package, installed if `id' is not 0.  The installed package
+ * with the same origin as a package to install is marked as replaced.
+ */
+struct conflict_owner *
+pkg_conflicts_owner(struct pkg_conflicts *c, int64_t id, const char *origin,
+    const char *name, const char *version)
+{
+	struct conflict_owner *owner;
+	struct conflict_path *e;
+	struct conflict_ref *r;
+
+	if ((owner = pool_alloc(c, sizeof(struct conflict_owner))) == NULL ||
+	    (owner->origin = pool_strdup(c, origin)) == NULL ||
+	    (owner->name = pool_strdup(c, name)) == NULL ||
+	    (owner->version = pool_strdup(c, version)) == NULL)
+		return (NULL);
+	owner->id = id;
+	owner->replaced = false;
+	owner->installed = NULL;
+
+	if ((e = strtab_get(c, &c->origins, origin, true)) == NULL)
+		return (NULL);
+	if (id == 0)
+		for (r = e->owners; r != NULL; r = r->next)
+			if (r->owner->id != 0)
+				r->owner->replaced = true;
+	if (ref_add(c, &e->owners, owner) != EPKG_OK)
+		return (NULL);
+
+	return (owner);
+}
+
+/* The package to install with the origin `origin', if any. */
+struct conflict_owner *
+pkg_conflicts_get(struct pkg_conflicts *c, const char *origin)
+{
+	struct conflict_path *e;
+	struct conflict_ref *r;
+
+	if ((e = strtab_get(c, &c->origins, origin, false)) == NULL)
+		return (NULL);
+
+	for (r = e->owners; r != NULL; r = r->next)
+		if (r->owner->id == 0)
+			return (r->owner);
+
+	return (NULL);
+}
+
+/*
+ * Record that `owner' owns `path'.  The paths with several owners are
+ * then listed by pkg_conflicts_next().
+ */
+struct conflict_path *
+pkg_conflicts_add(struct pkg_conflicts *c, const char *path,
+    struct conflict_owner *owner)
+{
+	struct conflict_path *e;
+	struct conflict_ref *r, *i;
+
+	if ((e = strtab_get(c, &c->paths, path, true)) == NULL)
+		return (NULL);
+
+	if (e->owners != NULL && e->owners->owner == owner)
+		return (e);
+
+	if (ref_add(c, &e->owners, owner) != EPKG_OK)
+		return (NULL);
+
+	if (owner->id == 0) {
+		for (r = e->owners->next; r != NULL; r = r->next) {
+			if (r->owner->id == 0)
+				continue;
+			for (i = owner->installed; i != NULL; i = i->next)
+				if (i->owner == r->owner)
+					break;
+			if (i == NULL && ref_add(c, &owner->installed,
+			    r->owner) != EPKG_OK)
+				return (NULL);
+		}
+	}
+
+	if (e->owners->next == NULL || e->owners->next->next != NULL)
+		return (e);
+
+	/* a second owner */
+	if (c->num_conflicts >= c->cap_conflicts) {
+		c->cap_conflicts |= 1;
+		c->cap_conflicts *= 2;
+		c->conflicts = reallocf(c->conflicts,
+		    c->cap_conflicts * sizeof(struct conflict_path *));
+		if (c->conflicts == NULL) {
+			pkg_emit_errno("realloc", "pkg_conflicts");
+			c->num_conflicts = c->cap_conflicts = 0;
+			return (NULL);
+		}
+	}
+	c->conflicts[c->num_conflicts++] = e;
+
+	return (e);
+}
+
+struct conflict_path *
+pkg_conflicts_next(struct pkg_conflicts *c, size_t *i)
+{
+	if (*i >= c->num_conflicts)
+		return (NULL);
+
+	return (c->conflicts[(*i)++]);
+}
@@ -27,6 +27,7 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -36,44 +37,59 @@
 
 #include "pkg.h"
 #include "private/event.h"
+#include "private/pkg.h"
 #include "private/utils.h"
 
-int
-pkg_fetch_file(const char *url, const char *dest, time_t t)
+/* period over which FETCH_MIN_RATE is checked, in seconds */
+#define FETCH_RATE_WINDOW 10
+
+static int64_t
+elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((now.tv_sec - since->tv_sec) * 1000 +
+	    (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+/*
+ * A probe is tried once, and a missing file is not an error.
+ */
+static int
+fetch_open(const char *url, time_t t, off_t *offset, FILE **remote,
+    off_t *size, char host[MAXHOSTNAMELEN], bool probe)
 {
-	int fd = -1;
-	FILE *remote = NULL;
 	struct url *u;
 	struct url_stat st;
-	off_t done = 0;
-	off_t r;
-
-	int64_t max_retry, retry;
-	time_t begin_dl;
-	time_t now;
-	time_t last = 0;
-	char buf[10240];
+	struct fetch_error err;
+	struct timespec begin;
+	int64_t max_retry, retry, min_rate = 0;
+	int timeout = 30;
 	int retcode = EPKG_OK;
 	bool srv = false;
 	char zone[MAXHOSTNAMELEN + 12];
 	struct dns_srvinfo *mirrors, *current;
 
 	current = mirrors = NULL;
+	*remote = NULL;
 
-	fetchTimeout = 30;
+	/* a stalled connection should not hold the transfer for longer */
+	pkg_config_int64(PKG_CONFIG_FETCH_MIN_RATE, &min_rate);
+	if (min_rate > 0)
+		timeout = FETCH_RATE_WINDOW;
 
-	if (pkg_config_int64(PKG_CONFIG_FETCH_RETRY, &max_retry) == EPKG_FATAL)
+	if (probe)
+		max_retry = 1;
+	else if (pkg_config_int64(PKG_CONFIG_FETCH_RETRY, &max_retry) ==
+	    EPKG_FATAL)
 		max_retry = 3;
 
 	retry = max_retry;
 
-	if ((fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600)) == -1) {
-		pkg_emit_errno("open", dest);
-		return(EPKG_FATAL);
-	}
-
 	u = fetchParseURL(url);
-	while (remote == NULL) {
+	while (*remote == NULL) {
 		if (retry == max_retry) {
 			pkg_config_bool(PKG_CONFIG_SRV_MIRROR, &srv);
 			if (srv) {
@@ -81,6 +97,7 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 					snprintf(zone, sizeof(zone),
 					    "_%s._tcp.%s", u->scheme, u->host);
 					mirrors = dns_getsrvinfo(zone);
+					mirrors = mirror_sort(mirrors);
 					current = mirrors;
 				}
 			}
@@ -89,12 +106,20 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 		if (mirrors != NULL)
 			strlcpy(u->host, current->host, sizeof(u->host));
 
-		remote = fetchXGet(u, &st, "");
-		if (remote == NULL) {
+		if (offset != NULL)
+			u->offset = *offset;
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		*remote = http_get(u, &st, timeout, &err);
+		/* a missing file is not the fault of the mirror */
+		mirror_connect(u->host, elapsed_ms(&begin), *remote == NULL &&
+		    err.code != FETCH_UNAVAIL);
+		if (*remote == NULL) {
 			--retry;
 			if (retry <= 0) {
-				pkg_emit_error("%s: %s", url,
-				    fetchLastErrString);
+				if (!probe || err.code != FETCH_UNAVAIL)
+					pkg_emit_error("%s: %s", url,
+					    err.string);
 				retcode = EPKG_FATAL;
 				goto cleanup;
 			}
@@ -109,15 +134,165 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 	}
 	if (t != 0) {
 		if (st.mtime <= t) {
+			fclose(*remote);
+			*remote = NULL;
 			retcode = EPKG_UPTODATE;
 			goto cleanup;
 		}
 	}
 
+	*size = st.size;
+	if (offset != NULL)
+		*offset = u->offset;
+	if (host != NULL)
+		strlcpy(host, u->host, MAXHOSTNAMELEN);
+
+	cleanup:
+	fetchFreeURL(u);
+
+	return (retcode);
+}
+
+/*
+ * Connect to `url', going through the SRV mirrors if enabled, and
+ * return the stream to read it from along with its size.  Returns
+ * EPKG_UPTODATE if the remote file is not newer than `t'.
+ *
+ * If `offset' is set, the transfer starts at that offset if the server
+ * supports it, and `offset' is updated to where the stream really
+ * starts.  If `host' is set, it receives the host really used.
+ */
+int
+pkg_fetch_open(const char *url, time_t t, off_t *offset, FILE **remote,
+    off_t *size, char host[MAXHOSTNAMELEN])
+{
+	return (fetch_open(url, t, offset, remote, size, host, false));
+}
+
+/*
+ * Same as pkg_fetch_open() for a file which may not exist: it is
+ * tried only once, and EPKG_FATAL is returned without any error
+ * emitted if the server does not have it.
+ */
+int
+pkg_fetch_probe(const char *url, FILE **remote, off_t *size)
+{
+	return (fetch_open(url, 0, NULL, remote, size, NULL, true));
+}
+
+int
+pkg_fetch_file(const char *url, const char *dest, time_t t)
+{
+	return (pkg_fetch_file2(url, dest, t, false, NULL, NULL));
+}
+
+/*
+ * When `resume' is set, `dest' is appended to rather than created, the
+ * transfer starting where it was left, and it is kept if the fetch
+ * fails.  An interrupted transfer is then resumed up to FETCH_RETRY
+ * times in a row.  A transfer slower than FETCH_MIN_RATE is restarted,
+ * from another mirror if possible.
+ *
+ * When `done' is set, the progress is reported there instead of
+ * through events, for downloads running in parallel.  When `cksum' is
+ * set, it receives the sha256 of the whole file.
+ */
+int
+pkg_fetch_file2(const char *url, const char *dest, time_t t, bool resume,
+    volatile off_t *done_p, char cksum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	SHA256_CTX sha256;
+	struct stat st;
+	int fd = -1;
+	FILE *remote = NULL;
+	off_t size = 0;
+	off_t pos = 0;
+	off_t start;
+	off_t done = 0;
+	off_t r;
+	off_t window_pos;
+	int64_t max_retry, retry, min_rate = 0;
+	bool stalled;
+	int read_errno = 0;
+	char host[MAXHOSTNAMELEN];
+	struct timespec begin_conn;
+
+	time_t begin_dl;
+	time_t now;
+	time_t last = 0;
+	time_t window;
+	char buf[10240];
+	int retcode = EPKG_OK;
+
+	if (resume)
+		fd = open(dest, O_RDWR|O_CREAT, 0600);
+	else
+		fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600);
+	if (fd == -1) {
+		pkg_emit_errno("open", dest);
+		return(EPKG_FATAL);
+	}
+
+	if (pkg_config_int64(PKG_CONFIG_FETCH_RETRY, &max_retry) == EPKG_FATAL)
+		max_retry = 3;
+	retry = max_retry;
+	pkg_config_int64(PKG_CONFIG_FETCH_MIN_RATE, &min_rate);
+
+	if (cksum != NULL)
+		SHA256_Init(&sha256);
+
+	if (resume) {
+		if (fstat(fd, &st) == -1) {
+			pkg_emit_errno("fstat", dest);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		pos = st.st_size;
+		/* hash what is already there */
+		while (cksum != NULL && (r = read(fd, buf, sizeof(buf))) > 0)
+			SHA256_Update(&sha256, buf, r);
+		if (lseek(fd, pos, SEEK_SET) == -1) {
+			pkg_emit_errno("lseek", dest);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
 	begin_dl = time(NULL);
-	while (done < st.size) {
-		if ((r = fread(buf, 1, sizeof(buf), remote)) < 1)
+
+	reconnect:
+	start = resume ? pos : 0;
+	if ((retcode = pkg_fetch_open(url, t, &start, &remote, &size,
+	    host)) != EPKG_OK)
+		goto cleanup;
+
+	if (start != pos) {
+		if (start != 0) {
+			pkg_emit_error("%s: unexpected offset", url);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		/* no range support, start over */
+		if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+			pkg_emit_errno("ftruncate", dest);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (cksum != NULL)
+			SHA256_Init(&sha256);
+		pos = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin_conn);
+	window = time(NULL);
+	window_pos = pos;
+	stalled = false;
+
+	while (pos < size) {
+		if ((r = fread(buf, 1, sizeof(buf), remote)) < 1) {
+			read_errno = errno;
 			break;
+		}
 
 		if (write(fd, buf, r) != r) {
 			pkg_emit_errno("write", dest);
@@ -125,21 +300,59 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 			goto cleanup;
 		}
 
+		if (cksum != NULL)
+			SHA256_Update(&sha256, buf, r);
+
+		pos += r;
 		done += r;
 		now = time(NULL);
+		if (min_rate > 0 && now - window >= FETCH_RATE_WINDOW) {
+			if ((pos - window_pos) / (now - window) < min_rate) {
+				stalled = true;
+				break;
+			}
+			window = now;
+			window_pos = pos;
+		}
+		if (done_p != NULL) {
+			*done_p = done;
+			continue;
+		}
 		/* Only call the callback every second */
-		if (now > last || done == st.size) {
-			pkg_emit_fetching(url, st.size, done, (now - begin_dl));
+		if (now > last || pos == size) {
+			pkg_emit_fetching(url, size, pos, (now - begin_dl));
 			last = now;
 		}
 	}
 
-	if (ferror(remote)) {
-		pkg_emit_error("%s: %s", url, fetchLastErrString);
+	if (stalled || ferror(remote) || (resume && pos < size)) {
+		mirror_transfer(host, pos - start, elapsed_ms(&begin_conn),
+		    true);
+		/* only give up after FETCH_RETRY attempts without progress */
+		if (resume && pos > start)
+			retry = max_retry;
+		if ((resume || stalled) && --retry > 0) {
+			fclose(remote);
+			remote = NULL;
+			if (!stalled)
+				sleep(1);
+			goto reconnect;
+		}
+		if (stalled)
+			pkg_emit_error("%s: transfer too slow", url);
+		else if (ferror(remote))
+			pkg_emit_error("%s: %s", url, strerror(read_errno));
+		else
+			pkg_emit_error("%s: transfer interrupted", url);
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
 
+	mirror_transfer(host, pos - start, elapsed_ms(&begin_conn), false);
+
+	if (cksum != NULL)
+		sha256_final(&sha256, cksum);
+
 	cleanup:
 
 	if (fd > 0)
@@ -148,10 +361,8 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 	if (remote != NULL)
 		fclose(remote);
 
-	fetchFreeURL(u);
-
 	/* Remove local file if fetch failed */
-	if (retcode != EPKG_OK)
+	if (retcode != EPKG_OK && !resume)
 		unlink(dest);
 
 	return (retcode);
@@ -0,0 +1,582 @@
+/*
+ * Copyright (c) 2012 Julien Laffaye <jlaffaye@FreeBSD.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Minimal HTTP/1.1 client keeping the connections to the package sites
+ * open from one request to the next.  Whatever it does not handle
+ * (proxies, authentication, redirects, other schemes such as https) is
+ * left to libfetch.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fetch.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "private/pkg.h"
+
+/* idle connections kept around, all hosts together */
+#define HTTP_MAX_IDLE 8
+/* the body of an error is read to reuse the connection up to this size */
+#define HTTP_MAX_DRAIN (64 * 1024)
+
+struct http_conn {
+	int fd;
+	char host[MAXHOSTNAMELEN + 1];
+	int port;
+	bool reused;
+	bool keepalive;
+	bool chunked;
+	bool inchunk;
+	bool eof;
+	off_t left;		/* in the body or the chunk, -1 if unknown */
+	char reason[64];	/* of the status line */
+	char buf[BUFSIZ];
+	size_t pos;
+	size_t len;
+	SLIST_ENTRY(http_conn) next;
+};
+
+static SLIST_HEAD(, http_conn) idle = SLIST_HEAD_INITIALIZER(idle);
+static int num_idle = 0;
+static int64_t opened = 0;
+static int64_t reused = 0;
+static pthread_mutex_t pool_m = PTHREAD_MUTEX_INITIALIZER;
+/* held around the calls to libfetch, which reports errors in globals */
+static pthread_mutex_t libfetch_m = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+conn_close(struct http_conn *c)
+{
+	close(c->fd);
+	free(c);
+}
+
+static void
+http_seterr(struct fetch_error *err, int code, const char *msg)
+{
+	err->code = code;
+	strlcpy(err->string, msg, sizeof(err->string));
+}
+
+/* connect(), giving up after `timeout' seconds */
+static int
+conn_connect(int fd, const struct sockaddr *sa, socklen_t salen, int timeout)
+{
+	struct pollfd pfd;
+	socklen_t len = sizeof(int);
+	int flags, error = 0, r;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return (-1);
+
+	if (connect(fd, sa, salen) != 0) {
+		if (errno != EINPROGRESS)
+			return (-1);
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		do {
+			r = poll(&pfd, 1, timeout > 0 ? timeout * 1000 : -1);
+		} while (r == -1 && errno == EINTR);
+		if (r == 0)
+			errno = ETIMEDOUT;
+		if (r <= 0)
+			return (-1);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+			return (-1);
+		if (error != 0) {
+			errno = error;
+			return (-1);
+		}
+	}
+
+	return (fcntl(fd, F_SETFL, flags));
+}
+
+static struct http_conn *
+conn_open(const char *host, int port, int timeout, struct fetch_error *err)
+{
+	struct http_conn *c;
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	char service[8];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
+		http_seterr(err, FETCH_RESOLV, "No address record");
+		return (NULL);
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (conn_connect(fd, ai->ai_addr, ai->ai_addrlen, timeout) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		http_seterr(err, errno == ETIMEDOUT ? FETCH_TIMEOUT :
+		    FETCH_DOWN, strerror(errno));
+		return (NULL);
+	}
+
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if ((c = calloc(1, sizeof(struct http_conn))) == NULL) {
+		http_seterr(err, FETCH_MEMORY, strerror(errno));
+		close(fd);
+		return (NULL);
+	}
+	c->fd = fd;
+	strlcpy(c->host, host, sizeof(c->host));
+	c->port = port;
+
+	pthread_mutex_lock(&pool_m);
+	opened++;
+	pthread_mutex_unlock(&pool_m);
+
+	return (c);
+}
+
+static struct http_conn *
+conn_get(const char *host, int port, int timeout, struct fetch_error *err)
+{
+	struct http_conn *c;
+
+	pthread_mutex_lock(&pool_m);
+	SLIST_FOREACH(c, &idle, next) {
+		if (c->port == port && strcmp(c->host, host) == 0)
+			break;
+	}
+	if (c != NULL) {
+		SLIST_REMOVE(&idle, c, http_conn, next);
+		num_idle--;
+		reused++;
+	}
+	pthread_mutex_unlock(&pool_m);
+
+	if (c != NULL) {
+		c->reused = true;
+		return (c);
+	}
+
+	return (conn_open(host, port, timeout, err));
+}
+
+static void
+conn_put(struct http_conn *c)
+{
+	bool done = c->chunked ? c->eof : c->left == 0;
+
+	/* only a connection with nothing left to read can be reused */
+	if (!c->keepalive || !done || c->pos != c->len) {
+		conn_close(c);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_m);
+	if (num_idle < HTTP_MAX_IDLE) {
+		SLIST_INSERT_HEAD(&idle, c, next);
+		num_idle++;
+		c = NULL;
+	}
+	pthread_mutex_unlock(&pool_m);
+
+	if (c != NULL)
+		conn_close(c);
+}
+
+static ssize_t
+conn_fill(struct http_conn *c)
+{
+	ssize_t r;
+
+	if (c->pos < c->len)
+		return (c->len - c->pos);
+
+	c->pos = c->len = 0;
+	do {
+		r = read(c->fd, c->buf, sizeof(c->buf));
+	} while (r == -1 && errno == EINTR);
+
+	if (r > 0)
+		c->len = r;
+
+	return (r);
+}
+
+/* read a line, without its CRLF */
+static int
+conn_getline(struct http_conn *c, char *line, size_t size)
+{
+	size_t i = 0;
+
+	for (;;) {
+		if (conn_fill(c) <= 0)
+			return (-1);
+		if (c->buf[c->pos] == '\n')
+			break;
+		if (i + 1 >= size)
+			return (-1);
+		line[i++] = c->buf[c->pos++];
+	}
+	c->pos++;
+
+	if (i > 0 && line[i - 1] == '\r')
+		i--;
+	line[i] = '\0';
+
+	return (0);
+}
+
+static int
+http_read(void *cookie, char *buf, int len)
+{
+	struct http_conn *c = cookie;
+	char line[128];
+	ssize_t r;
+	size_t n;
+
+	if (c->chunked && c->left == 0 && !c->eof) {
+		/* the CRLF ending the previous chunk */
+		if (c->inchunk && conn_getline(c, line, sizeof(line)) != 0)
+			return (-1);
+		c->inchunk = true;
+		if (conn_getline(c, line, sizeof(line)) != 0)
+			return (-1);
+		c->left = strtoll(line, NULL, 16);
+		if (c->left == 0) {
+			/* trailer */
+			do {
+				if (conn_getline(c, line, sizeof(line)) != 0)
+					return (-1);
+			} while (line[0] != '\0');
+			c->eof = true;
+		}
+	}
+
+	if (c->left == 0)
+		return (0);
+
+	if ((r = conn_fill(c)) <= 0)
+		/* the end of a body without length */
+		return (r == 0 && c->left == -1 ? 0 : -1);
+
+	n = MIN((size_t)len, c->len - c->pos);
+	if (c->left > 0)
+		n = MIN(n, (size_t)c->left);
+	memcpy(buf, c->buf + c->pos, n);
+	c->pos += n;
+	if (c->left > 0)
+		c->left -= n;
+
+	return (n);
+}
+
+/*
+ * Read what is left of the body of a response not handed out, so that
+ * the connection can be reused.
+ */
+static void
+conn_drain(struct http_conn *c)
+{
+	char buf[BUFSIZ];
+	size_t total = 0;
+	int r;
+
+	if (c->keepalive) {
+		while (total < HTTP_MAX_DRAIN &&
+		    (r = http_read(c, buf, sizeof(buf))) > 0)
+			total += r;
+	}
+	conn_put(c);
+}
+
+static int
+http_close(void *cookie)
+{
+	conn_put(cookie);
+
+	return (0);
+}
+
+static int
+http_request(struct http_conn *c, struct url *u)
+{
+	char req[MAXPATHLEN + MAXHOSTNAMELEN + 128];
+	const char *doc = u->doc[0] != '\0' ? u->doc : "/";
+	size_t len, done = 0;
+	ssize_t r;
+
+	len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s", doc,
+	    u->host);
+	if (u->port != 0 && u->port != 80)
+		len += snprintf(req + len, sizeof(req) - len, ":%d", u->port);
+	len += snprintf(req + len, sizeof(req) - len, "\r\nUser-Agent: pkg\r\n");
+	if (u->offset > 0)
+		len += snprintf(req + len, sizeof(req) - len,
+		    "Range: bytes=%jd-\r\n", (intmax_t)u->offset);
+	len += snprintf(req + len, sizeof(req) - len, "\r\n");
+	if (len >= sizeof(req))
+		return (EPKG_FATAL);
+
+	while (done < len) {
+		r = send(c->fd, req + done, len - done, MSG_NOSIGNAL);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (EPKG_FATAL);
+		done += r;
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Parse the response headers.  Returns the status, or -1 if the
+ * connection is not usable.
+ */
+static int
+http_response(struct http_conn *c, struct url *u, struct url_stat *st)
+{
+	char line[1024];
+	char *p;
+	struct tm tm;
+	off_t length = -1, first = 0, total = -1;
+	int status;
+
+	if (conn_getline(c, line, sizeof(line)) != 0)
+		return (-1);
+	if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12)
+		return (-1);
+	c->keepalive = (line[7] == '1');
+	status = strtol(line + 9, NULL, 10);
+	strlcpy(c->reason, line[12] == ' ' ? line + 13 : line + 9,
+	    sizeof(c->reason));
+
+	c->chunked = c->inchunk = c->eof = false;
+	st->size = -1;
+	st->mtime = 0;
+
+	for (;;) {
+		if (conn_getline(c, line, sizeof(line)) != 0)
+			return (-1);
+		if (line[0] == '\0')
+			break;
+		if ((p = strchr(line, ':')) == NULL)
+			continue;
+		*p++ = '\0';
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (strcasecmp(line, "Content-Length") == 0) {
+			length = strtoll(p, NULL, 10);
+		} else if (strcasecmp(line, "Content-Range") == 0) {
+			if (strncasecmp(p, "bytes ", 6) == 0) {
+				first = strtoll(p + 6, NULL, 10);
+				if ((p = strchr(p, '/')) != NULL && p[1] != '*')
+					total = strtoll(p + 1, NULL, 10);
+			}
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+			c->chunked = (strcasecmp(p, "chunked") == 0);
+		} else if (strcasecmp(line, "Connection") == 0) {
+			if (strcasecmp(p, "close") == 0)
+				c->keepalive = false;
+			else if (strcasecmp(p, "keep-alive") == 0)
+				c->keepalive = true;
+		} else if (strcasecmp(line, "Last-Modified") == 0) {
+			memset(&tm, 0, sizeof(tm));
+			if (strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+				st->mtime = timegm(&tm);
+		}
+	}
+
+	if (c->chunked) {
+		c->left = 0;
+		length = -1;
+	} else {
+		c->left = length;
+		/* the body ends when the server closes the connection */
+		if (length == -1)
+			c->keepalive = false;
+	}
+
+	if (status == 206) {
+		u->offset = first;
+		st->size = total != -1 ? total :
+		    (length != -1 ? first + length : -1);
+	} else {
+		u->offset = 0;
+		st->size = length;
+	}
+	st->atime = st->mtime;
+
+	return (status);
+}
+
+/*
+ * Like fetchXGet() with fetchTimeout set to `timeout', reusing an idle
+ * connection to the same server when possible.  On failure, the error
+ * is returned in `err'.
+ */
+FILE *
+http_get(struct url *u, struct url_stat *st, int timeout,
+    struct fetch_error *err)
+{
+	struct http_conn *c;
+	FILE *f;
+	int port, status;
+
+	if (strcmp(u->scheme, SCHEME_HTTP) != 0 || u->user[0] != '\0' ||
+	    getenv("HTTP_PROXY") != NULL || getenv("http_proxy") != NULL ||
+	    getenv("HTTP_AUTH") != NULL)
+		goto libfetch;
+
+	port = u->port != 0 ? u->port : 80;
+
+	for (;;) {
+		if ((c = conn_get(u->host, port, timeout, err)) == NULL)
+			return (NULL);
+
+		errno = 0;
+		if (http_request(c, u) == EPKG_OK &&
+		    (status = http_response(c, u, st)) != -1)
+			break;
+
+		/* the server may have closed an idle connection */
+		if (!c->reused) {
+			http_seterr(err, errno == EAGAIN || errno == ETIMEDOUT ?
+			    FETCH_TIMEOUT : FETCH_NETWORK, "Invalid response");
+			conn_close(c);
+			return (NULL);
+		}
+		conn_close(c);
+	}
+
+	/* redirects are followed by libfetch, on its own connection */
+	if (status >= 300 && status < 400) {
+		conn_drain(c);
+		goto libfetch;
+	}
+
+	if (status != 200 && status != 206) {
+		switch (status) {
+		case 401:
+		case 403:
+		case 407:
+			err->code = FETCH_AUTH;
+			break;
+		case 404:
+		case 410:
+			err->code = FETCH_UNAVAIL;
+			break;
+		case 408:
+		case 504:
+			err->code = FETCH_TIMEOUT;
+			break;
+		case 503:
+			err->code = FETCH_TEMP;
+			break;
+		default:
+			err->code = status >= 500 ? FETCH_SERVER : FETCH_PROTO;
+			break;
+		}
+		strlcpy(err->string, c->reason, sizeof(err->string));
+		conn_drain(c);
+		return (NULL);
+	}
+
+	if ((f = funopen(c, http_read, NULL, NULL, http_close)) == NULL) {
+		http_seterr(err, FETCH_MEMORY, strerror(errno));
+		conn_close(c);
+		return (NULL);
+	}
+
+	return (f);
+
+	libfetch:
+	pthread_mutex_lock(&pool_m);
+	opened++;
+	pthread_mutex_unlock(&pool_m);
+
+	pthread_mutex_lock(&libfetch_m);
+	fetchTimeout = timeout;
+	if ((f = fetchXGet(u, st, "")) == NULL)
+		http_seterr(err, fetchLastErrCode, fetchLastErrString);
+	pthread_mutex_unlock(&libfetch_m);
+
+	return (f);
+}
+
+void
+http_cleanup(void)
+{
+	struct http_conn *c;
+
+	pthread_mutex_lock(&pool_m);
+	while ((c = SLIST_FIRST(&idle)) != NULL) {
+		SLIST_REMOVE_HEAD(&idle, next);
+		conn_close(c);
+	}
+	num_idle = 0;
+	pthread_mutex_unlock(&pool_m);
+}
+
+void
+pkg_fetch_connections(int64_t *o, int64_t *r)
+{
+	pthread_mutex_lock(&pool_m);
+	*o = opened;
+	*r = reused;
+	pthread_mutex_unlock(&pool_m);
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2012 Julien Laffaye <jlaffaye@FreeBSD.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Scoreboard of the hosts files are fetched from, kept in
+ * <dbdir>/mirrors, so that the fastest healthy SRV mirrors are tried
+ * first, and the mirrors never measured get a chance.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h> /* for private/utils.h */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "private/pkg.h"
+#include "private/utils.h"
+
+#define MIRRORS_FILE "mirrors"
+#define MIRRORS_MAX 64
+/* weight of a new measure in the averages, in percents */
+#define MIRRORS_DECAY 30
+/* transfers smaller than that only measure the latency */
+#define MIRRORS_MIN_BYTES (64 * 1024)
+/* a mirror failing more often than that, in percents, is avoided */
+#define MIRRORS_UNHEALTHY 50
+/* the failure rate is halved for each that many seconds without use */
+#define MIRRORS_FORGET 3600
+
+struct mirror {
+	char host[MAXHOSTNAMELEN];
+	int64_t ttfb;		/* milliseconds */
+	int64_t speed;		/* bytes per second, 0 if unknown */
+	int64_t failures;	/* percents */
+	int64_t last;
+};
+
+static struct mirror mirrors[MIRRORS_MAX];
+static size_t num_mirrors = 0;
+static bool loaded = false;
+static bool dirty = false;
+static pthread_mutex_t mirrors_m = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+mirrors_path(char *path, size_t size)
+{
+	const char *dbdir = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK ||
+	    dbdir == NULL)
+		dbdir = "/var/db/pkg";
+	snprintf(path, size, "%s/%s", dbdir, MIRRORS_FILE);
+}
+
+static void
+mirrors_load(void)
+{
+	char path[MAXPATHLEN];
+	struct mirror *m;
+	long long ttfb, speed, failures, last;
+	FILE *fp;
+
+	loaded = true;
+
+	mirrors_path(path, sizeof(path));
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+
+	while (num_mirrors < MIRRORS_MAX) {
+		m = &mirrors[num_mirrors];
+		if (fscanf(fp, "%255s %lld %lld %lld %lld\n", m->host, &ttfb,
+		    &speed, &failures, &last) != 5)
+			break;
+		m->ttfb = ttfb;
+		m->speed = speed;
+		m->failures = failures;
+		m->last = last;
+		num_mirrors++;
+	}
+	fclose(fp);
+}
+
+/* must be called with mirrors_m held */
+static struct mirror *
+mirror_get(const char *host, bool create)
+{
+	struct mirror *m = NULL;
+	size_t i;
+
+	if (!loaded)
+		mirrors_load();
+
+	for (i = 0; i < num_mirrors; i++)
+		if (strcmp(mirrors[i].host, host) == 0)
+			return (&mirrors[i]);
+
+	if (!create)
+		return (NULL);
+
+	if (num_mirrors < MIRRORS_MAX) {
+		m = &mirrors[num_mirrors++];
+	} else {
+		/* forget about the one not used for the longest time */
+		m = &mirrors[0];
+		for (i = 1; i < num_mirrors; i++)
+			if (mirrors[i].last < m->last)
+				m = &mirrors[i];
+	}
+	memset(m, 0, sizeof(struct mirror));
+	strlcpy(m->host, host, sizeof(m->host));
+
+	return (m);
+}
+
+static int64_t
+average(int64_t old, int64_t val, bool first)
+{
+	if (first)
+		return (val);
+
+	return ((old * (100 - MIRRORS_DECAY) + val * MIRRORS_DECAY) / 100);
+}
+
+/* the failure rate of `m' as of `now', so that a bad run is forgotten */
+static int64_t
+mirror_failures(struct mirror *m, int64_t now)
+{
+	int64_t halvings;
+
+	if (m->last <= 0 || now <= m->last)
+		return (m->failures);
+
+	halvings = (now - m->last) / MIRRORS_FORGET;
+
+	return (halvings >= 7 ? 0 : m->failures >> halvings);
+}
+
+/*
+ * Record a connection to `host', which took `ms' milliseconds to get
+ * the response headers.
+ */
+void
+mirror_connect(const char *host, int64_t ms, bool failed)
+{
+	struct mirror *m;
+	int64_t now = time(NULL);
+
+	pthread_mutex_lock(&mirrors_m);
+	m = mirror_get(host, true);
+	if (!failed)
+		m->ttfb = average(m->ttfb, ms, m->ttfb == 0);
+	/* a single failure does not make a mirror unhealthy */
+	m->failures = average(mirror_failures(m, now), failed ? 100 : 0,
+	    false);
+	m->last = now;
+	dirty = true;
+	pthread_mutex_unlock(&mirrors_m);
+}
+
+/*
+ * Record a transfer of `bytes' from `host' in `ms' milliseconds.  A
+ * failed transfer was interrupted or too slow.
+ */
+void
+mirror_transfer(const char *host, off_t bytes, int64_t ms, bool failed)
+{
+	struct mirror *m;
+	int64_t now = time(NULL);
+
+	pthread_mutex_lock(&mirrors_m);
+	m = mirror_get(host, true);
+	if (ms > 0 && (bytes >= MIRRORS_MIN_BYTES || failed))
+		m->speed = average(m->speed, bytes * 1000 / ms, m->speed == 0);
+	m->failures = mirror_failures(m, now);
+	if (failed)
+		m->failures = average(m->failures, 100, false);
+	m->last = now;
+	dirty = true;
+	pthread_mutex_unlock(&mirrors_m);
+}
+
+struct mirror_rank {
+	struct dns_srvinfo *srv;
+	int rank;
+	int64_t cost;
+};
+
+static int
+mirror_cmp(const void *a, const void *b)
+{
+	const struct mirror_rank *ra = a, *rb = b;
+
+	if (ra->srv->priority != rb->srv->priority)
+		return (ra->srv->priority < rb->srv->priority ? -1 : 1);
+	if (ra->rank != rb->rank)
+		return (ra->rank - rb->rank);
+	if (ra->cost != rb->cost)
+		return (ra->cost < rb->cost ? -1 : 1);
+	if (ra->srv->weight != rb->srv->weight)
+		return (ra->srv->weight > rb->srv->weight ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * Sort the SRV records by priority, then the healthy mirrors by the
+ * time they take to send a megabyte, and last the unhealthy ones.  A
+ * mirror never measured counts as the fastest, so that it is tried,
+ * and the weight orders the mirrors which cannot be told apart.
+ */
+struct dns_srvinfo *
+mirror_sort(struct dns_srvinfo *list)
+{
+	struct mirror_rank *r;
+	struct dns_srvinfo *srv;
+	struct mirror *m;
+	int64_t now = time(NULL), failures;
+	size_t n = 0, i;
+
+	for (srv = list; srv != NULL; srv = srv->next)
+		n++;
+	if (n < 2)
+		return (list);
+
+	if ((r = calloc(n, sizeof(struct mirror_rank))) == NULL)
+		return (list);
+
+	pthread_mutex_lock(&mirrors_m);
+	for (srv = list, i = 0; srv != NULL; srv = srv->next, i++) {
+		r[i].srv = srv;
+		m = mirror_get(srv->host, false);
+		failures = m != NULL ? mirror_failures(m, now) : 0;
+		if (m != NULL && failures >= MIRRORS_UNHEALTHY) {
+			r[i].rank = 1;
+			r[i].cost = failures;
+		} else if (m != NULL && m->ttfb > 0) {
+			r[i].cost = m->ttfb;
+			if (m->speed > 0)
+				r[i].cost += 1024 * 1024 * 1000 / m->speed;
+		}
+	}
+	pthread_mutex_unlock(&mirrors_m);
+
+	qsort(r, n, sizeof(struct mirror_rank), mirror_cmp);
+
+	for (i = 0; i < n - 1; i++)
+		r[i].srv->next = r[i + 1].srv;
+	r[n - 1].srv->next = NULL;
+	list = r[0].srv;
+	free(r);
+
+	return (list);
+}
+
+void
+mirror_save(void)
+{
+	char path[MAXPATHLEN];
+	char tmp[MAXPATHLEN];
+	FILE *fp;
+	size_t i;
+
+	pthread_mutex_lock(&mirrors_m);
+	if (!dirty)
+		goto cleanup;
+
+	mirrors_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	/* not being able to save it, e.g. as a user, is not an error */
+	if ((fp = fopen(tmp, "w")) == NULL)
+		goto cleanup;
+
+	for (i = 0; i < num_mirrors; i++)
+		fprintf(fp, "%s %lld %lld %lld %lld\n", mirrors[i].host,
+		    (long long)mirrors[i].ttfb, (long long)mirrors[i].speed,
+		    (long long)mirrors[i].failures, (long long)mirrors[i].last);
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+	dirty = false;
+
+	cleanup:
+	pthread_mutex_unlock(&mirrors_m);
+}
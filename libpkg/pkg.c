@@ -29,8 +29,11 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -963,8 +966,13 @@ pkg_open(struct pkg **pkg_p, const char *path)
 	return (EPKG_OK);
 }
 
-int
-pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, const char *path)
+/*
+ * Read the metadata (+MANIFEST and friends) at the beginning of an
+ * already opened package archive.
+ */
+static int
+pkg_read_metadata(struct pkg **pkg_p, struct archive *a,
+    struct archive_entry **ae, const char *path)
 {
 	struct pkg *pkg;
 	pkg_error_t retcode = EPKG_OK;
@@ -984,21 +992,8 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 		{ NULL, 0 }
 	};
 
-	assert(path != NULL && path[0] != '\0');
-
 	manifest = sbuf_new_auto();
 
-	*a = archive_read_new();
-	archive_read_support_compression_all(*a);
-	archive_read_support_format_tar(*a);
-
-	if (archive_read_open_filename(*a, path, 4096) != ARCHIVE_OK) {
-		pkg_emit_error("archive_read_open_filename(%s): %s", path,
-					   archive_error_string(*a));
-		retcode = EPKG_FATAL;
-		goto cleanup;
-	}
-
 	if (*pkg_p == NULL)
 		pkg_new(pkg_p, PKG_FILE);
 	else
@@ -1007,7 +1002,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 	pkg = *pkg_p;
 	pkg->type = PKG_FILE;
 
-	while ((ret = archive_read_next_header(*a, ae)) == ARCHIVE_OK) {
+	while ((ret = archive_read_next_header(a, ae)) == ARCHIVE_OK) {
 		fpath = archive_entry_pathname(*ae);
 		if (fpath[0] != '+')
 			break;
@@ -1020,7 +1015,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 				goto cleanup;
 			}
 
-			while ((size = archive_read_data(*a, buf, sizeof(buf))) > 0) {
+			while ((size = archive_read_data(a, buf, sizeof(buf))) > 0) {
 				sbuf_bcat(manifest, buf, size);
 			}
 
@@ -1037,7 +1032,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 			if (strcmp(fpath, files[i].name) == 0) {
 				sbuf = &pkg->fields[files[i].attr];
 				sbuf_init(sbuf);
-				while ((size = archive_read_data(*a, buf, sizeof(buf))) > 0) {
+				while ((size = archive_read_data(a, buf, sizeof(buf))) > 0) {
 					sbuf_bcat(*sbuf, buf, size);
 				}
 				sbuf_finish(*sbuf);
@@ -1047,7 +1042,7 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 
 	if (ret != ARCHIVE_OK && ret != ARCHIVE_EOF) {
 		pkg_emit_error("archive_read_next_header(): %s",
-					   archive_error_string(*a));
+					   archive_error_string(a));
 		retcode = EPKG_FATAL;
 	}
 
@@ -1062,6 +1057,30 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 	cleanup:
 	sbuf_delete(manifest);
 
+	return (retcode);
+}
+
+int
+pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, const char *path)
+{
+	pkg_error_t retcode = EPKG_OK;
+
+	assert(path != NULL && path[0] != '\0');
+
+	*a = archive_read_new();
+	archive_read_support_compression_all(*a);
+	archive_read_support_format_tar(*a);
+
+	if (archive_read_open_filename(*a, path, 4096) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open_filename(%s): %s", path,
+					   archive_error_string(*a));
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	retcode = pkg_read_metadata(pkg_p, *a, ae, path);
+
+	cleanup:
 	if (retcode != EPKG_OK && retcode != EPKG_END) {
 		if (*a != NULL)
 			archive_read_finish(*a);
@@ -1072,6 +1091,89 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 	return (retcode);
 }
 
+struct cksum_reader {
+	int fd;
+	SHA256_CTX sha256;
+	char buf[HASH_BUFSIZ];
+};
+
+static ssize_t
+cksum_reader_read(struct archive *a, void *data, const void **buf)
+{
+	struct cksum_reader *r = data;
+	ssize_t len;
+
+	*buf = r->buf;
+	if ((len = read(r->fd, r->buf, sizeof(r->buf))) == -1) {
+		archive_set_error(a, errno, "read failed");
+		return (-1);
+	}
+	SHA256_Update(&r->sha256, r->buf, len);
+
+	return (len);
+}
+
+/*
+ * Same as pkg_open() but also compute the sha256 of the package file
+ * in the same pass: every block handed to libarchive is hashed, and
+ * once the metadata is read the rest of the file is hashed directly
+ * without being decompressed.
+ */
+int
+pkg_open_cksum(struct pkg **pkg_p, const char *path,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	struct cksum_reader *r;
+	struct archive *a;
+	struct archive_entry *ae;
+	int retcode;
+
+	assert(path != NULL && path[0] != '\0');
+
+	cksum[0] = '\0';
+
+	if ((r = malloc(sizeof(struct cksum_reader))) == NULL) {
+		pkg_emit_errno("malloc", "cksum_reader");
+		return (EPKG_FATAL);
+	}
+
+	if ((r->fd = open(path, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", path);
+		free(r);
+		return (EPKG_FATAL);
+	}
+	SHA256_Init(&r->sha256);
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	/* no skip callback: libarchive must see, and hash, every byte */
+	if (archive_read_open(a, r, NULL, cksum_reader_read, NULL) !=
+	    ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open(%s): %s", path,
+		    archive_error_string(a));
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	retcode = pkg_read_metadata(pkg_p, a, &ae, path);
+	if (retcode != EPKG_OK && retcode != EPKG_END) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if ((retcode = sha256_fd(r->fd, &r->sha256, path)) == EPKG_OK)
+		sha256_final(&r->sha256, cksum);
+
+	cleanup:
+	archive_read_finish(a);
+	close(r->fd);
+	free(r);
+
+	return (retcode);
+}
+
 int
 pkg_copy_tree(struct pkg *pkg, const char *src, const char *dest)
 {
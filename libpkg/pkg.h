@@ -258,6 +258,20 @@ typedef enum _pkg_config_key {
 	PKG_CONFIG_PORTAUDIT_SITE = 15,
 	PKG_CONFIG_SRV_MIRROR = 16,
 	PKG_CONFIG_FETCH_RETRY = 17,
+	PKG_CONFIG_REPO_WORKERS = 18,
+	PKG_CONFIG_REPO_QUEUE_DEPTH = 19,
+	PKG_CONFIG_REPO_DELTAS = 20,
+	PKG_CONFIG_FETCH_JOBS = 21,
+	PKG_CONFIG_FETCH_JOBS_PER_MIRROR = 22,
+	PKG_CONFIG_FETCH_MIN_RATE = 23,
+	PKG_CONFIG_FETCH_PIPELINE = 24,
+	PKG_CONFIG_EXTRACT_WORKERS = 25,
+	PKG_CONFIG_INSTALL_SYNC = 26,
+	PKG_CONFIG_EXTRACT_VERIFY = 27,
+	PKG_CONFIG_UPGRADE_SKIP_UNCHANGED = 28,
+	PKG_CONFIG_DB_WAL = 29,
+	PKG_CONFIG_DB_WAL_CHECKPOINT = 30,
+	PKG_CONFIG_DB_CACHE_SIZE = 31,
 } pkg_config_key;
 
 typedef enum {
@@ -684,6 +698,14 @@ int pkg_finish_repo(char *path, pem_password_cb *cb, char *rsa_key_path);
  */
 int pkgdb_open(struct pkgdb **db, pkgdb_t type);
 
+/**
+ * Open the local package database for reading only: it is not created,
+ * and is only opened for writing when outdated, to be upgraded.
+ * The db must be free'ed with pkgdb_close().
+ * @return An error code.
+ */
+int pkgdb_open_readonly(struct pkgdb **db, pkgdb_t type);
+
 /**
  * Close and free the struct pkgdb.
  */
@@ -744,6 +766,20 @@ struct pkgdb_it * pkgdb_query_which(struct pkgdb *db, const char *path);
 
 struct pkgdb_it * pkgdb_query_shlib(struct pkgdb *db, const char *shlib);
 
+/**
+ * Query the packages of the cache which the repositories do not provide
+ * anymore.  PKG_NEWVERSION is the version provided now, if any.
+ * @param db A database opened with PKGDB_REMOTE
+ * @warning Returns NULL on failure.
+ */
+struct pkgdb_it * pkgdb_cache_stale(struct pkgdb *db);
+
+/**
+ * Remove a package from the cache.
+ * @param repopath The path of the package relative to the cache
+ */
+int pkg_cache_delete(const char *repopath);
+
 #define PKG_LOAD_BASIC 0
 #define PKG_LOAD_DEPS (1<<0)
 #define PKG_LOAD_RDEPS (1<<1)
@@ -879,6 +915,17 @@ int pkg_version_cmp(const char * const , const char * const);
  */
 int pkg_fetch_file(const char *url, const char *dest, time_t t);
 
+/**
+ * Get the number of connections opened and reused by the fetches so far.
+ */
+void pkg_fetch_connections(int64_t *opened, int64_t *reused);
+
+/**
+ * Get the number of statements found prepared, and prepared, by the
+ * queries on db so far.
+ */
+void pkgdb_stmt_stats(struct pkgdb *db, int64_t *hits, int64_t *misses);
+
 /* glue to deal with ports */
 int ports_parse_plist(struct pkg *, char *, const char *);
 
@@ -25,6 +25,8 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/sysctl.h>
 #include <sys/utsname.h>
 
 #include <archive.h>
@@ -36,6 +38,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <pthread.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -58,67 +61,659 @@ dep_installed(struct pkg_dep *dep, struct pkgdb *db) {
 	return (ret);
 }
 
+/* files bigger than that are written by the reading thread */
+#define EXTRACT_MAX_FILE (4 * 1024 * 1024)
+/* data read ahead of the writer threads */
+#define EXTRACT_MAX_QUEUED (32 * 1024 * 1024)
+
+struct extract_job {
+	struct archive_entry *ae;
+	const char *sum;	/* expected, if any */
+	char *buf;
+	size_t size;
+	TAILQ_ENTRY(extract_job) next;
+};
+
+struct extract_data {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	TAILQ_HEAD(, extract_job) jobs;
+	TAILQ_HEAD(, extract_job) running;
+	size_t queued;		/* bytes read and not written yet */
+	int pending;		/* jobs queued or being written */
+	bool done;		/* no more jobs to come */
+	char *error;		/* the first error of the writers */
+};
+
+/* the checksums of the manifest, sorted by path */
+struct extract_sum {
+	const char *path;
+	const char *sum;
+};
+
 static int
-do_extract(struct archive *a, struct archive_entry *ae)
+extract_sum_cmp(const void *a, const void *b)
 {
-	int retcode = EPKG_OK;
-	int ret = 0;
-	char path[MAXPATHLEN + 1];
+	const struct extract_sum *sa = a, *sb = b;
+
+	return (strcmp(sa->path, sb->path));
+}
+
+static struct extract_sum *
+extract_sums(struct pkg *pkg, size_t *n)
+{
+	struct extract_sum *sums = NULL;
+	struct pkg_file *f = NULL;
+	const char *sum;
+	size_t cap = 0;
+
+	*n = 0;
+	while (pkg_files(pkg, &f) == EPKG_OK) {
+		sum = pkg_file_cksum(f);
+		if (sum == NULL || sum[0] == '\0')
+			continue;
+		if (*n >= cap) {
+			cap |= 1;
+			cap *= 2;
+			sums = reallocf(sums, cap * sizeof(struct extract_sum));
+			if (sums == NULL) {
+				*n = 0;
+				return (NULL);
+			}
+		}
+		sums[*n].path = pkg_file_path(f);
+		/* the archive may or may not have the leading / */
+		while (sums[*n].path[0] == '/')
+			sums[*n].path++;
+		sums[*n].sum = sum;
+		(*n)++;
+	}
+
+	if (*n > 0)
+		qsort(sums, *n, sizeof(struct extract_sum), extract_sum_cmp);
+
+	return (sums);
+}
+
+static const char *
+extract_sum_get(struct extract_sum *sums, size_t n, struct archive_entry *ae)
+{
+	struct extract_sum key, *found;
+
+	/* hardlinks have no data, their target is checked */
+	if (n == 0 || archive_entry_filetype(ae) != AE_IFREG ||
+	    archive_entry_hardlink(ae) != NULL)
+		return (NULL);
+
+	key.path = archive_entry_pathname(ae);
+	while (key.path[0] == '/')
+		key.path++;
+	found = bsearch(&key, sums, n, sizeof(struct extract_sum),
+	    extract_sum_cmp);
+
+	return (found != NULL ? found->sum : NULL);
+}
+
+static int
+delta_cmp(const void *key, const void *e)
+{
+	const struct pkg_delta_file *df = e;
+	const char *path = key;
+	const char *other = df->new != NULL ? df->new->path : df->old->path;
+
+	while (*path == '/')
+		path++;
+	while (*other == '/')
+		other++;
+
+	return (strcmp(path, other));
+}
+
+/*
+ * A file of the upgraded package with the same checksum as the one
+ * installed, which is still there with the same size and mode, needs
+ * not be written again.
+ */
+static bool
+extract_unchanged(struct pkg_delta *delta, struct archive_entry *ae)
+{
+	struct pkg_delta_file *df;
 	struct stat st;
+	const char *pathname = archive_entry_pathname(ae);
 
-	do {
-		const char *pathname = archive_entry_pathname(ae);
+	if (delta == NULL || archive_entry_filetype(ae) != AE_IFREG ||
+	    archive_entry_hardlink(ae) != NULL)
+		return (false);
+
+	df = bsearch(pathname, delta->files, delta->num_files,
+	    sizeof(struct pkg_delta_file), delta_cmp);
+	if (df == NULL || df->type != PKG_DELTA_UNCHANGED)
+		return (false);
+
+	if (lstat(pathname, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size != archive_entry_size(ae) ||
+	    (st.st_mode & ALLPERMS) != (archive_entry_perm(ae) & ALLPERMS))
+		return (false);
+
+	return (true);
+}
+
+/*
+ * Write a regular file as archive_read_extract() would, hashing the
+ * blocks on the way.
+ */
+static int
+extract_verify(struct archive *a, struct archive *w, struct archive_entry *ae,
+    const char *sum)
+{
+	SHA256_CTX sha256;
+	char zeros[BUFSIZ];
+	char out[SHA256_DIGEST_LENGTH * 2 + 1];
+	const void *buf;
+	size_t size;
+	off_t offset, pos = 0;
+	int ret;
+
+	if (archive_write_header(w, ae) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_extract(): %s",
+		    archive_error_string(w));
+		return (EPKG_FATAL);
+	}
+
+	SHA256_Init(&sha256);
+	memset(zeros, 0, sizeof(zeros));
+	while ((ret = archive_read_data_block(a, &buf, &size, &offset)) ==
+	    ARCHIVE_OK) {
+		/* the holes of sparse files */
+		for (; pos < offset; pos += MIN(offset - pos, BUFSIZ))
+			SHA256_Update(&sha256, zeros, MIN(offset - pos, BUFSIZ));
+		SHA256_Update(&sha256, buf, size);
+		pos = offset + size;
+		if (archive_write_data_block(w, buf, size, offset) !=
+		    ARCHIVE_OK) {
+			pkg_emit_error("archive_read_extract(): %s",
+			    archive_error_string(w));
+			return (EPKG_FATAL);
+		}
+	}
+	if (ret != ARCHIVE_EOF) {
+		pkg_emit_error("archive_read_extract(): %s",
+		    archive_error_string(a));
+		return (EPKG_FATAL);
+	}
+	for (; pos < archive_entry_size(ae);
+	    pos += MIN(archive_entry_size(ae) - pos, BUFSIZ))
+		SHA256_Update(&sha256, zeros,
+		    MIN(archive_entry_size(ae) - pos, BUFSIZ));
+
+	if (archive_write_finish_entry(w) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_extract(): %s",
+		    archive_error_string(w));
+		return (EPKG_FATAL);
+	}
 
+	sha256_final(&sha256, out);
+	if (strcmp(out, sum) != 0) {
+		pkg_emit_error("%s: checksum mismatch",
+		    archive_entry_pathname(ae));
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+extract_entry(struct archive *a, struct archive *w, struct archive_entry *ae,
+    const char *sum)
+{
+	char path[MAXPATHLEN + 1];
+	struct stat st;
+	const char *pathname = archive_entry_pathname(ae);
+	int ret;
+
+	if (sum != NULL) {
+		if (extract_verify(a, w, ae, sum) != EPKG_OK)
+			return (EPKG_FATAL);
+		ret = ARCHIVE_OK;
+	} else
 		ret = archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS);
+	if (ret != ARCHIVE_OK) {
+		/*
+		 * show error except when the failure is during
+		 * extracting a directory and that the directory already
+		 * exists.
+		 * this allow to install packages linux_base from
+		 * package for example
+		 */
+		if (archive_entry_filetype(ae) != AE_IFDIR ||
+		    !is_dir(pathname)) {
+			pkg_emit_error("archive_read_extract(): %s",
+			    archive_error_string(a));
+			return (EPKG_FATAL);
+		}
+	}
+	pkg_sync_file(pathname);
+
+	/*
+	 * if the file is a configuration file and the configuration
+	 * file does not already exist on the file system, then
+	 * extract it
+	 * ex: conf1.cfg.pkgconf:
+	 * if conf1.cfg doesn't exists create it based on
+	 * conf1.cfg.pkgconf
+	 */
+	if (is_conf_file(pathname, path, sizeof(path))
+	    && lstat(path, &st) == ENOENT) {
+		archive_entry_set_pathname(ae, path);
+		ret = archive_read_extract(a,ae, EXTRACT_ARCHIVE_FLAGS);
 		if (ret != ARCHIVE_OK) {
-			/*
-			 * show error except when the failure is during
-			 * extracting a directory and that the directory already
-			 * exists.
-			 * this allow to install packages linux_base from
-			 * package for example
-			 */
-			if (archive_entry_filetype(ae) != AE_IFDIR ||
-			    !is_dir(pathname)) {
-				pkg_emit_error("archive_read_extract(): %s",
-				    archive_error_string(a));
-				retcode = EPKG_FATAL;
+			pkg_emit_error("archive_read_extract(): %s",
+			    archive_error_string(a));
+			return (EPKG_FATAL);
+		}
+		pkg_sync_file(path);
+	}
+
+	return (EPKG_OK);
+}
+
+/* same as extract_entry(), from the data read by the reading thread */
+static int
+extract_write(struct archive *w, struct extract_job *job, char *error,
+    size_t len)
+{
+	SHA256_CTX sha256;
+	char out[SHA256_DIGEST_LENGTH * 2 + 1];
+	char path[MAXPATHLEN + 1];
+	struct stat st;
+	const char *pathname = archive_entry_pathname(job->ae);
+	const char *err;
+	bool conf = false;
+
+	/* nothing is written if it does not match */
+	if (job->sum != NULL) {
+		SHA256_Init(&sha256);
+		SHA256_Update(&sha256, job->buf, job->size);
+		sha256_final(&sha256, out);
+		if (strcmp(out, job->sum) != 0) {
+			snprintf(error, len, "%s: checksum mismatch", pathname);
+			return (EPKG_FATAL);
+		}
+	}
+
+	for (;;) {
+		if (archive_write_header(w, job->ae) != ARCHIVE_OK ||
+		    (job->size > 0 && archive_write_data(w, job->buf,
+		    job->size) != (ssize_t)job->size) ||
+		    archive_write_finish_entry(w) != ARCHIVE_OK) {
+			err = archive_error_string(w);
+			snprintf(error, len, "archive_read_extract(): %s",
+			    err != NULL ? err : "write error");
+			return (EPKG_FATAL);
+		}
+		pkg_sync_file(archive_entry_pathname(job->ae));
+
+		if (conf || !is_conf_file(pathname, path, sizeof(path)) ||
+		    lstat(path, &st) != ENOENT)
+			break;
+		archive_entry_set_pathname(job->ae, path);
+		conf = true;
+	}
+
+	return (EPKG_OK);
+}
+
+static void *
+extract_worker(void *arg)
+{
+	struct extract_data *d = arg;
+	struct extract_job *job;
+	struct archive *w;
+	char error[MAXPATHLEN + 128];
+	bool failed;
+
+	w = archive_write_disk_new();
+	archive_write_disk_set_options(w, EXTRACT_ARCHIVE_FLAGS);
+	archive_write_disk_set_standard_lookup(w);
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&d->jobs) && !d->done)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if ((job = TAILQ_FIRST(&d->jobs)) == NULL)
+			break;
+		TAILQ_REMOVE(&d->jobs, job, next);
+		TAILQ_INSERT_TAIL(&d->running, job, next);
+
+		/* once something failed, the rest is only dropped */
+		failed = (d->error != NULL);
+		pthread_mutex_unlock(&d->lock);
+
+		if (!failed)
+			failed = (extract_write(w, job, error,
+			    sizeof(error)) != EPKG_OK);
+
+		pthread_mutex_lock(&d->lock);
+		if (failed && d->error == NULL)
+			d->error = strdup(error);
+		TAILQ_REMOVE(&d->running, job, next);
+		d->queued -= job->size;
+		d->pending--;
+		pthread_cond_broadcast(&d->cond);
+
+		archive_entry_free(job->ae);
+		free(job->buf);
+		free(job);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	archive_write_finish(w);
+
+	return (NULL);
+}
+
+/* wait for the writers to be done with what is queued */
+static bool
+extract_wait(struct extract_data *d)
+{
+	bool ok;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->pending > 0)
+		pthread_cond_wait(&d->cond, &d->lock);
+	ok = (d->error == NULL);
+	pthread_mutex_unlock(&d->lock);
+
+	return (ok);
+}
+
+static bool
+extract_below(struct extract_job *job, const char *path, size_t len)
+{
+	const char *p = archive_entry_pathname(job->ae);
+
+	return (strncmp(p, path, len) == 0 && (p[len] == '\0' || p[len] == '/'));
+}
+
+/* whether `path' is, or is a directory above, a file not written yet */
+static bool
+extract_pending(struct extract_data *d, const char *path)
+{
+	struct extract_job *job;
+	size_t len = strlen(path);
+	bool found = false;
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	pthread_mutex_lock(&d->lock);
+	TAILQ_FOREACH(job, &d->jobs, next)
+		if ((found = extract_below(job, path, len)))
+			break;
+	if (!found) {
+		TAILQ_FOREACH(job, &d->running, next)
+			if ((found = extract_below(job, path, len)))
 				break;
-			}
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return (found);
+}
+
+/*
+ * Restore the metadata of the directories once nothing is written in
+ * them anymore: their times would otherwise be changed by the writers,
+ * and their mode or flags could prevent them from creating files.
+ */
+static int
+extract_dirs(struct archive_entry **dirs, size_t n)
+{
+	struct archive *w;
+	const char *pathname;
+	size_t i;
+	int retcode = EPKG_OK;
+
+	w = archive_write_disk_new();
+	archive_write_disk_set_options(w, EXTRACT_ARCHIVE_FLAGS);
+	archive_write_disk_set_standard_lookup(w);
+
+	for (i = 0; i < n; i++) {
+		pathname = archive_entry_pathname(dirs[i]);
+		if ((archive_write_header(w, dirs[i]) != ARCHIVE_OK ||
+		    archive_write_finish_entry(w) != ARCHIVE_OK) &&
+		    !is_dir(pathname)) {
+			pkg_emit_error("archive_read_extract(): %s",
+			    archive_error_string(w));
+			retcode = EPKG_FATAL;
+			break;
 		}
+		pkg_sync_file(pathname);
+	}
 
-		/*
-		 * if the file is a configuration file and the configuration
-		 * file does not already exist on the file system, then
-		 * extract it
-		 * ex: conf1.cfg.pkgconf:
-		 * if conf1.cfg doesn't exists create it based on
-		 * conf1.cfg.pkgconf
-		 */
-		if (is_conf_file(pathname, path, sizeof(path))
-		    && lstat(path, &st) == ENOENT) {
-			archive_entry_set_pathname(ae, path);
-			ret = archive_read_extract(a,ae, EXTRACT_ARCHIVE_FLAGS);
-			if (ret != ARCHIVE_OK) {
-				pkg_emit_error("archive_read_extract(): %s",
-				    archive_error_string(a));
-				retcode = EPKG_FATAL;
+	/* the times and modes of the directories are set on close */
+	if (archive_write_close(w) != ARCHIVE_OK && retcode == EPKG_OK) {
+		pkg_emit_error("archive_read_extract(): %s",
+		    archive_error_string(w));
+		retcode = EPKG_FATAL;
+	}
+	archive_write_finish(w);
+
+	return (retcode);
+}
+
+static int
+extract_queue(struct extract_data *d, struct archive *a,
+    struct archive_entry *ae, const char *sum)
+{
+	struct extract_job *job;
+	size_t size = archive_entry_size(ae);
+	ssize_t r;
+	size_t done = 0;
+	bool ok;
+
+	if ((job = calloc(1, sizeof(struct extract_job))) == NULL ||
+	    (size > 0 && (job->buf = malloc(size)) == NULL)) {
+		pkg_emit_errno("malloc", "extract_job");
+		free(job);
+		return (EPKG_FATAL);
+	}
+	job->size = size;
+
+	/* decompress the file while the writers are busy */
+	while (done < size) {
+		if ((r = archive_read_data(a, job->buf + done,
+		    size - done)) <= 0) {
+			pkg_emit_error("archive_read_data(): %s",
+			    archive_error_string(a));
+			free(job->buf);
+			free(job);
+			return (EPKG_FATAL);
+		}
+		done += r;
+	}
+	job->ae = archive_entry_clone(ae);
+	job->sum = sum;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->queued > 0 && d->queued + size > EXTRACT_MAX_QUEUED &&
+	    d->error == NULL)
+		pthread_cond_wait(&d->cond, &d->lock);
+	TAILQ_INSERT_TAIL(&d->jobs, job, next);
+	d->queued += size;
+	d->pending++;
+	ok = (d->error == NULL);
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+
+	return (ok ? EPKG_OK : EPKG_FATAL);
+}
+
+static int
+extract_workers(void)
+{
+	int64_t workers = 0;
+	size_t len;
+	int ncpu;
+
+	pkg_config_int64(PKG_CONFIG_EXTRACT_WORKERS, &workers);
+	if (workers > 0)
+		return (workers);
+
+	len = sizeof(ncpu);
+	if (sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0) == -1)
+		ncpu = 1;
+
+	return (ncpu);
+}
+
+/*
+ * The regular files are decompressed by the calling thread, and
+ * written by a pool of threads with their own archive_write_disk, so
+ * that the ownership, permissions, times, ACLs, flags and extended
+ * attributes are restored as by archive_read_extract().  Everything
+ * else, as well as the big files, is extracted in order by the calling
+ * thread; hardlinks once their target is written, and any other entry
+ * once the files queued at or below its path are written.  The
+ * directories are created as the files need them, and get their own
+ * metadata once all the files are written.
+ *
+ * With EXTRACT_VERIFY, the regular files are checked against the
+ * checksums of the manifest as they are written.  On upgrade, the files
+ * which `delta' reports unchanged are not written at all.
+ */
+static int
+do_extract(struct archive *a, struct archive_entry *ae, struct pkg *pkg,
+    struct pkg_delta *delta)
+{
+	struct extract_data d;
+	struct extract_sum *sums = NULL;
+	struct archive_entry **dirs = NULL;
+	struct archive *w = NULL;
+	pthread_t *tids = NULL;
+	const char *sum;
+	size_t num_sums = 0, num_dirs = 0, cap_dirs = 0, j;
+	bool verify = false;
+	int num_workers, i;
+	int retcode = EPKG_OK;
+	int ret = 0;
+
+	pkg_config_bool(PKG_CONFIG_EXTRACT_VERIFY, &verify);
+	if (verify) {
+		sums = extract_sums(pkg, &num_sums);
+		w = archive_write_disk_new();
+		archive_write_disk_set_options(w, EXTRACT_ARCHIVE_FLAGS);
+		archive_write_disk_set_standard_lookup(w);
+	}
+
+	num_workers = extract_workers();
+	if (num_workers > 1 &&
+	    (tids = calloc(num_workers, sizeof(pthread_t))) == NULL)
+		num_workers = 1;
+
+	memset(&d, 0, sizeof(d));
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.cond, NULL);
+	TAILQ_INIT(&d.jobs);
+	TAILQ_INIT(&d.running);
+	for (i = 0; i < num_workers && tids != NULL; i++) {
+		if (pthread_create(&tids[i], NULL, extract_worker, &d) != 0)
+			break;
+	}
+	num_workers = tids != NULL ? i : 0;
+
+	do {
+		/* the data is skipped by archive_read_next_header() */
+		if (extract_unchanged(delta, ae))
+			continue;
+
+		sum = extract_sum_get(sums, num_sums, ae);
+		if (num_workers > 0 &&
+		    archive_entry_filetype(ae) == AE_IFREG &&
+		    archive_entry_hardlink(ae) == NULL &&
+		    archive_entry_size(ae) >= 0 &&
+		    archive_entry_size(ae) <= EXTRACT_MAX_FILE) {
+			if ((retcode = extract_queue(&d, a, ae, sum)) !=
+			    EPKG_OK)
 				break;
+			continue;
+		}
+
+		if (num_workers > 0 && archive_entry_filetype(ae) == AE_IFDIR) {
+			if (num_dirs >= cap_dirs) {
+				cap_dirs |= 1;
+				cap_dirs *= 2;
+				dirs = reallocf(dirs,
+				    cap_dirs * sizeof(struct archive_entry *));
+				if (dirs == NULL) {
+					pkg_emit_errno("realloc", "dirs");
+					num_dirs = 0;
+					retcode = EPKG_FATAL;
+					break;
+				}
 			}
+			dirs[num_dirs++] = archive_entry_clone(ae);
+			continue;
 		}
+
+		if (num_workers > 0 && (archive_entry_hardlink(ae) != NULL ||
+		    extract_pending(&d, archive_entry_pathname(ae))) &&
+		    !extract_wait(&d)) {
+			retcode = EPKG_FATAL;
+			break;
+		}
+
+		if ((retcode = extract_entry(a, w, ae, sum)) != EPKG_OK)
+			break;
 	} while ((ret = archive_read_next_header(a, &ae)) == ARCHIVE_OK);
 
-	if (ret != ARCHIVE_EOF) {
+	if (retcode == EPKG_OK && ret != ARCHIVE_EOF) {
 		pkg_emit_error("archive_read_next_header(): %s",
 		    archive_error_string(a));
 		retcode = EPKG_FATAL;
 	}
 
+	pthread_mutex_lock(&d.lock);
+	d.done = true;
+	pthread_cond_broadcast(&d.cond);
+	pthread_mutex_unlock(&d.lock);
+	for (i = 0; i < num_workers; i++)
+		pthread_join(tids[i], NULL);
+
+	if (d.error != NULL) {
+		pkg_emit_error("%s", d.error);
+		retcode = EPKG_FATAL;
+		free(d.error);
+	}
+
+	if (retcode == EPKG_OK && num_dirs > 0)
+		retcode = extract_dirs(dirs, num_dirs);
+	for (j = 0; j < num_dirs; j++)
+		archive_entry_free(dirs[j]);
+	free(dirs);
+
+	pthread_cond_destroy(&d.cond);
+	pthread_mutex_destroy(&d.lock);
+	free(tids);
+	free(sums);
+	if (w != NULL)
+		archive_write_finish(w);
+
 	return (retcode);
 }
 
 int
 pkg_add(struct pkgdb *db, const char *path, int flags)
+{
+	return (pkg_add2(db, path, flags, NULL));
+}
+
+/*
+ * Same as pkg_add(), `delta' being the difference with the version of
+ * the package being upgraded, if any.
+ */
+int
+pkg_add2(struct pkgdb *db, const char *path, int flags,
+    struct pkg_delta *delta)
 {
 	const char *arch;
 	const char *myarch;
@@ -247,7 +842,7 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	/*
 	 * Extract the files on disk.
 	 */
-	if (extract == true && (retcode = do_extract(a, ae)) != EPKG_OK) {
+	if (extract == true && (retcode = do_extract(a, ae, pkg, delta)) != EPKG_OK) {
 		/* If the add failed, clean up */
 		pkg_delete_files(pkg, 1);
 		pkg_delete_dirs(db, pkg, 1);
@@ -272,6 +867,10 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 		pkg_start_stop_rc_scripts(pkg, PKG_RC_START);
 
 	cleanup_reg:
+	/* the files must be on disk before the package is registered */
+	if (retcode == EPKG_OK && (flags & PKG_ADD_UPGRADE) == 0 &&
+	    pkg_sync_commit() != EPKG_OK)
+		retcode = EPKG_FATAL;
 	if ((flags & PKG_ADD_UPGRADE) == 0)
 		pkgdb_register_finale(db, retcode);
 
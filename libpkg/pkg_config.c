@@ -171,6 +171,90 @@ static struct config_entry c[] = {
 		"3",
 		{ NULL }
 	},
+	[PKG_CONFIG_REPO_WORKERS] = {
+		INTEGER,
+		"REPO_WORKERS",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_REPO_QUEUE_DEPTH] = {
+		INTEGER,
+		"REPO_QUEUE_DEPTH",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_REPO_DELTAS] = {
+		INTEGER,
+		"REPO_DELTAS",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_FETCH_JOBS] = {
+		INTEGER,
+		"FETCH_JOBS",
+		"4",
+		{ NULL }
+	},
+	[PKG_CONFIG_FETCH_JOBS_PER_MIRROR] = {
+		INTEGER,
+		"FETCH_JOBS_PER_MIRROR",
+		"4",
+		{ NULL }
+	},
+	[PKG_CONFIG_FETCH_MIN_RATE] = {
+		INTEGER,
+		"FETCH_MIN_RATE",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_FETCH_PIPELINE] = {
+		BOOL,
+		"FETCH_PIPELINE",
+		"NO",
+		{ NULL }
+	},
+	[PKG_CONFIG_EXTRACT_WORKERS] = {
+		INTEGER,
+		"EXTRACT_WORKERS",
+		"0",
+		{ NULL }
+	},
+	[PKG_CONFIG_INSTALL_SYNC] = {
+		STRING,
+		"INSTALL_SYNC",
+		"batch",
+		{ NULL }
+	},
+	[PKG_CONFIG_EXTRACT_VERIFY] = {
+		BOOL,
+		"EXTRACT_VERIFY",
+		"YES",
+		{ NULL }
+	},
+	[PKG_CONFIG_UPGRADE_SKIP_UNCHANGED] = {
+		BOOL,
+		"UPGRADE_SKIP_UNCHANGED",
+		"YES",
+		{ NULL }
+	},
+	[PKG_CONFIG_DB_WAL] = {
+		BOOL,
+		"DB_WAL",
+		"NO",
+		{ NULL }
+	},
+	[PKG_CONFIG_DB_WAL_CHECKPOINT] = {
+		INTEGER,
+		"DB_WAL_CHECKPOINT",
+		"1000",
+		{ NULL }
+	},
+	[PKG_CONFIG_DB_CACHE_SIZE] = {
+		INTEGER,
+		"DB_CACHE_SIZE",
+		"0",
+		{ NULL }
+	},
 };
 
 static bool parsed = false;
@@ -447,6 +531,7 @@ pkg_shutdown(void)
 	size_t i;
 
 	if (parsed == true) {
+		mirror_save();
 		for (i = 0; i < c_size; i++) {
 			switch (c[i].type) {
 			case STRING:
@@ -466,6 +551,7 @@ pkg_shutdown(void)
 		return (EPKG_FATAL);
 	}
 
+	http_cleanup();
 	parsed = false;
 
 	return (EPKG_OK);
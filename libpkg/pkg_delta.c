@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2012 Julien Laffaye <jlaffaye@FreeBSD.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Difference between the files and directories of two versions of a
+ * package, computed by merging the lists sorted by path.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h> /* for private/utils.h */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkg.h"
+#include "private/event.h"
+#include "private/pkg.h"
+
+static int
+file_cmp(const void *a, const void *b)
+{
+	struct pkg_file * const *fa = a, * const *fb = b;
+
+	return (strcmp((*fa)->path, (*fb)->path));
+}
+
+static int
+dir_cmp(const void *a, const void *b)
+{
+	struct pkg_dir * const *da = a, * const *db = b;
+
+	return (strcmp((*da)->path, (*db)->path));
+}
+
+static struct pkg_file **
+sorted_files(struct pkg *pkg, size_t *n)
+{
+	struct pkg_file **files;
+	struct pkg_file *f = NULL;
+	size_t i = 0;
+
+	*n = 0;
+	while (pkg_files(pkg, &f) == EPKG_OK)
+		(*n)++;
+
+	if ((files = malloc(MAX(*n, 1) * sizeof(struct pkg_file *))) == NULL)
+		return (NULL);
+
+	f = NULL;
+	while (pkg_files(pkg, &f) == EPKG_OK)
+		files[i++] = f;
+	qsort(files, *n, sizeof(struct pkg_file *), file_cmp);
+
+	return (files);
+}
+
+static struct pkg_dir **
+sorted_dirs(struct pkg *pkg, size_t *n)
+{
+	struct pkg_dir **dirs;
+	struct pkg_dir *d = NULL;
+	size_t i = 0;
+
+	*n = 0;
+	while (pkg_dirs(pkg, &d) == EPKG_OK)
+		(*n)++;
+
+	if ((dirs = malloc(MAX(*n, 1) * sizeof(struct pkg_dir *))) == NULL)
+		return (NULL);
+
+	d = NULL;
+	while (pkg_dirs(pkg, &d) == EPKG_OK)
+		dirs[i++] = d;
+	qsort(dirs, *n, sizeof(struct pkg_dir *), dir_cmp);
+
+	return (dirs);
+}
+
+static pkg_delta_t
+file_delta(struct pkg_file *old, struct pkg_file *new)
+{
+	/* without checksums, nothing says it is the same */
+	if (old->sum[0] == '\0' || strcmp(old->sum, new->sum) != 0)
+		return (PKG_DELTA_CHANGED);
+
+	return (PKG_DELTA_UNCHANGED);
+}
+
+/*
+ * Compare the files and directories of `old' and `new'.  The entries
+ * of the delta are sorted by path and point to the pkg_file and
+ * pkg_dir of the packages, which must outlive it.
+ */
+int
+pkg_delta_new(struct pkg_delta **delta, struct pkg *old, struct pkg *new)
+{
+	struct pkg_delta *dl;
+	struct pkg_delta_file *df;
+	struct pkg_delta_dir *dd;
+	struct pkg_file **of = NULL, **nf = NULL;
+	struct pkg_dir **od = NULL, **nd = NULL;
+	size_t no, nn, i, j;
+	int c;
+
+	if ((dl = calloc(1, sizeof(struct pkg_delta))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_delta");
+		return (EPKG_FATAL);
+	}
+
+	if ((of = sorted_files(old, &no)) == NULL ||
+	    (nf = sorted_files(new, &nn)) == NULL ||
+	    (dl->files = calloc(MAX(no + nn, 1),
+	    sizeof(struct pkg_delta_file))) == NULL)
+		goto fatal;
+
+	for (i = j = 0; i < no || j < nn; ) {
+		if (j == nn)
+			c = -1;
+		else if (i == no)
+			c = 1;
+		else
+			c = strcmp(of[i]->path, nf[j]->path);
+
+		df = &dl->files[dl->num_files++];
+		if (c < 0) {
+			df->old = of[i++];
+			df->type = PKG_DELTA_REMOVED;
+		} else if (c > 0) {
+			df->new = nf[j++];
+			df->type = PKG_DELTA_ADDED;
+		} else {
+			df->old = of[i++];
+			df->new = nf[j++];
+			df->type = file_delta(df->old, df->new);
+		}
+	}
+
+	if ((od = sorted_dirs(old, &no)) == NULL ||
+	    (nd = sorted_dirs(new, &nn)) == NULL ||
+	    (dl->dirs = calloc(MAX(no + nn, 1),
+	    sizeof(struct pkg_delta_dir))) == NULL)
+		goto fatal;
+
+	for (i = j = 0; i < no || j < nn; ) {
+		if (j == nn)
+			c = -1;
+		else if (i == no)
+			c = 1;
+		else
+			c = strcmp(od[i]->path, nd[j]->path);
+
+		dd = &dl->dirs[dl->num_dirs++];
+		if (c < 0) {
+			dd->old = od[i++];
+			dd->type = PKG_DELTA_REMOVED;
+		} else if (c > 0) {
+			dd->new = nd[j++];
+			dd->type = PKG_DELTA_ADDED;
+		} else {
+			dd->old = od[i++];
+			dd->new = nd[j++];
+			dd->type = PKG_DELTA_UNCHANGED;
+		}
+	}
+
+	free(of);
+	free(nf);
+	free(od);
+	free(nd);
+	*delta = dl;
+
+	return (EPKG_OK);
+
+	fatal:
+	pkg_emit_errno("malloc", "pkg_delta");
+	free(of);
+	free(nf);
+	free(od);
+	free(nd);
+	pkg_delta_free(dl);
+
+	return (EPKG_FATAL);
+}
+
+void
+pkg_delta_free(struct pkg_delta *delta)
+{
+	if (delta == NULL)
+		return;
+
+	free(delta->files);
+	free(delta->dirs);
+	free(delta);
+}
@@ -25,6 +25,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
 #include <syslog.h>
 
 #include "pkg.h"
@@ -32,6 +33,8 @@
 
 static pkg_event_cb _cb = NULL;
 static void *_data = NULL;
+/* events may come from the pkg repo or download threads */
+static pthread_mutex_t _cb_m = PTHREAD_MUTEX_INITIALIZER;
 
 void
 pkg_event_register(pkg_event_cb cb, void *data)
@@ -43,8 +46,11 @@ pkg_event_register(pkg_event_cb cb, void *data)
 static void
 pkg_emit_event(struct pkg_event *ev)
 {
-	if (_cb != NULL)
+	if (_cb != NULL) {
+		pthread_mutex_lock(&_cb_m);
 		_cb(_data, ev);
+		pthread_mutex_unlock(&_cb_m);
+	}
 }
 
 void
@@ -28,13 +28,18 @@
 
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <libutil.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -42,6 +47,50 @@
 #include "private/pkgdb.h"
 
 static int pkg_jobs_fetch(struct pkg_jobs *j);
+static int pkg_jobs_fetch_parallel(struct pkg_jobs *j);
+
+/* A repository, the downloads from it are limited to `per_site' */
+struct fetch_site {
+	const char *url;
+	int active;
+};
+
+struct fetch_job {
+	struct pkg *pkg;
+	struct pkg *manifest;	/* read ahead when pipelined */
+	struct fetch_site *site;
+	volatile off_t done;
+	bool head_started;
+	bool head_done;
+	bool started;
+	bool finished;
+};
+
+/* Shared by the download threads, protected by `m' */
+struct fetch_data {
+	struct fetch_job *jobs;
+	size_t num_jobs;
+	struct fetch_site *sites;
+	size_t num_sites;
+	pthread_t *tids;
+	int num_threads;
+	int per_site;
+	int workers;
+	bool heads;
+	size_t heads_done;
+	bool failed;
+	bool reported;
+	off_t total;
+	time_t begin;
+	char label[32];
+	pthread_mutex_t m;
+	pthread_cond_t cond;
+};
+
+static int pkg_jobs_fetch_pipeline(struct pkg_jobs *j, struct fetch_data *d);
+static int pkg_jobs_fetch_wait(struct fetch_data *d, struct fetch_job *upto,
+    bool heads);
+static void pkg_jobs_fetch_finish(struct fetch_data *d, bool abort);
 
 int
 pkg_jobs_new(struct pkg_jobs **j, pkg_jobs_t t, struct pkgdb *db)
@@ -117,37 +166,35 @@ pkg_jobs(struct pkg_jobs *j, struct pkg **pkg)
 		return (EPKG_OK);
 }
 
+/*
+ * Mark the files and directories of p1 which p2 also has, not to
+ * delete them.  If `deltap' is set, the delta is returned there.
+ */
 static int
-pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg *p2)
+pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg *p2,
+    struct pkg_delta **deltap)
 {
-	struct pkg_file *f1 = NULL, *f2 = NULL;
-	struct pkg_dir *d1 = NULL, *d2 = NULL;
+	struct pkg_delta *delta;
+	size_t i;
 
-	while (pkg_files(p1, &f1) == EPKG_OK) {
-		if (f1->keep == 1)
-			continue;
+	if (pkg_delta_new(&delta, p1, p2) != EPKG_OK)
+		return (EPKG_FATAL);
 
-		f2 = NULL;
-		while (pkg_files(p2, &f2) == EPKG_OK) {
-			if (strcmp(pkg_file_path(f1), pkg_file_path(f2)) == 0) {
-				f1->keep = 1;
-				break;
-			}
-		}
+	for (i = 0; i < delta->num_files; i++) {
+		if (delta->files[i].old != NULL && delta->files[i].new != NULL)
+			delta->files[i].old->keep = 1;
 	}
 
-	while (pkg_dirs(p1, &d1) == EPKG_OK) {
-		if (d1->keep == 1)
-			continue;
-		d2 = NULL;
-		while (pkg_dirs(p2, &d2) == EPKG_OK) {
-			if (strcmp(pkg_dir_path(d1), pkg_dir_path(d2)) == 0) {
-				d1->keep = 1;
-				break;
-			}
-		}
+	for (i = 0; i < delta->num_dirs; i++) {
+		if (delta->dirs[i].old != NULL && delta->dirs[i].new != NULL)
+			delta->dirs[i].old->keep = 1;
 	}
 
+	if (deltap != NULL)
+		*deltap = delta;
+	else
+		pkg_delta_free(delta);
+
 	return (EPKG_OK);
 }
 
@@ -158,23 +205,36 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 	struct pkg *pkg = NULL;
 	struct pkg *newpkg = NULL;
 	struct pkg *pkg_temp = NULL;
+	struct pkg *old = NULL;
 	struct pkgdb_it *it = NULL;
+	struct pkg_delta *delta = NULL;
 	STAILQ_HEAD(,pkg) pkg_queue;
 	char path[MAXPATHLEN + 1];
 	const char *cachedir = NULL;
 	int flags = 0;
 	int retcode = EPKG_FATAL;
+	int ret;
 	int lflags = PKG_LOAD_BASIC | PKG_LOAD_FILES | PKG_LOAD_SCRIPTS |
 	    PKG_LOAD_DIRS;
 	bool handle_rc = false;
+	bool pipeline = false;
+	bool skip = false;
+	struct fetch_data d;
+	size_t n = 0;
 
 	STAILQ_INIT(&pkg_queue);
 
-	/* Fetch */
-	if (pkg_jobs_fetch(j) != EPKG_OK)
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
 		return (EPKG_FATAL);
 
-	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+	pkg_config_bool(PKG_CONFIG_FETCH_PIPELINE, &pipeline);
+	pkg_config_bool(PKG_CONFIG_UPGRADE_SKIP_UNCHANGED, &skip);
+
+	/* Fetch */
+	if (pipeline) {
+		if (pkg_jobs_fetch_pipeline(j, &d) != EPKG_OK)
+			return (EPKG_FATAL);
+	} else if (pkg_jobs_fetch(j) != EPKG_OK)
 		return (EPKG_FATAL);
 	
 	pkg_config_bool(PKG_CONFIG_HANDLE_RC_SCRIPTS, &handle_rc);
@@ -187,6 +247,13 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 		bool automatic;
 		flags = 0;
 
+		/* the next packages keep downloading meanwhile */
+		if (pipeline &&
+		    pkg_jobs_fetch_wait(&d, &d.jobs[n++], false) != EPKG_OK) {
+			sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
+			goto cleanup;
+		}
+
 		pkg_get(p, PKG_ORIGIN, &pkgorigin, PKG_REPOPATH, &pkgrepopath,
 		    PKG_NEWVERSION, &newversion, PKG_AUTOMATIC, &automatic);
 
@@ -242,8 +309,13 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 		} else {
 			pkg_emit_install_begin(newpkg);
 		}
-		STAILQ_FOREACH(pkg, &pkg_queue, next)
-			pkg_jobs_keep_files_to_del(pkg, newpkg);
+		STAILQ_FOREACH(pkg, &pkg_queue, next) {
+			pkg_get(pkg, PKG_ORIGIN, &origin);
+			/* what did not change is not extracted again */
+			pkg_jobs_keep_files_to_del(pkg, newpkg,
+			    skip && strcmp(pkgorigin, origin) == 0 ?
+			    &delta : NULL);
+		}
 
 		STAILQ_FOREACH_SAFE(pkg, &pkg_queue, next, pkg_temp) {
 			pkg_get(pkg, PKG_ORIGIN, &origin);
@@ -252,7 +324,8 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 				pkg_delete_files(pkg, 1);
 				pkg_script_run(pkg, PKG_SCRIPT_POST_DEINSTALL);
 				pkg_delete_dirs(j->db, pkg, 0);
-				pkg_free(pkg);
+				/* the delta points to its files */
+				old = pkg;
 				break;
 			}
 		}
@@ -263,7 +336,12 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 		if (automatic)
 			flags |= PKG_ADD_AUTOMATIC;
 
-		if (pkg_add(j->db, path, flags) != EPKG_OK) {
+		ret = pkg_add2(j->db, path, flags, delta);
+		pkg_delta_free(delta);
+		delta = NULL;
+		pkg_free(old);
+		old = NULL;
+		if (ret != EPKG_OK) {
 			sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
 			goto cleanup;
 		}
@@ -274,16 +352,26 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 			pkg_emit_install_finished(newpkg);
 
 		if (STAILQ_EMPTY(&pkg_queue)) {
+			/* the files before the packages which own them */
+			if (pkg_sync_commit() != EPKG_OK) {
+				sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
+				goto cleanup;
+			}
 			sql_exec(j->db->sqlite, "RELEASE upgrade;");
 			sql_exec(j->db->sqlite, "SAVEPOINT upgrade;");
 		}
 	}
 
-	retcode = EPKG_OK;
+	if (pkg_sync_commit() != EPKG_OK)
+		sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
+	else
+		retcode = EPKG_OK;
 
 	cleanup:
 	sql_exec(j->db->sqlite, "RELEASE upgrade;");
 	pkg_free(newpkg);
+	if (pipeline)
+		pkg_jobs_fetch_finish(&d, retcode != EPKG_OK);
 
 	return (retcode);
 }
@@ -329,20 +417,317 @@ pkg_jobs_apply(struct pkg_jobs *j, int force)
 	return (rc);
 }
 
+/* first job whose manifest or package is not fetched yet, and has room */
+static struct fetch_job *
+pkg_jobs_fetch_next(struct fetch_data *d, bool *head, bool *pending)
+{
+	struct fetch_job *job;
+
+	*pending = false;
+	if (d->failed)
+		return (NULL);
+
+	/* the manifests come first */
+	for (*head = d->heads; ; *head = false) {
+		for (size_t i = 0; i < d->num_jobs; i++) {
+			job = &d->jobs[i];
+			if (*head ? job->head_started : job->started)
+				continue;
+			*pending = true;
+			/* both would write to the same .part file */
+			if (!*head && d->heads && !job->head_done)
+				continue;
+			if (d->per_site > 0 && job->site->active >= d->per_site)
+				continue;
+			return (job);
+		}
+		if (!*head || *pending)
+			break;
+	}
+
+	return (NULL);
+}
+
+static void *
+pkg_jobs_fetch_thread(void *arg)
+{
+	struct fetch_data *d = arg;
+	struct fetch_job *job;
+	bool head, pending;
+	int ret;
+
+	pthread_mutex_lock(&d->m);
+	for (;;) {
+		job = pkg_jobs_fetch_next(d, &head, &pending);
+		if (job == NULL) {
+			if (!pending)
+				break;
+			pthread_cond_wait(&d->cond, &d->m);
+			continue;
+		}
+
+		if (head)
+			job->head_started = true;
+		else
+			job->started = true;
+		job->site->active++;
+		pthread_mutex_unlock(&d->m);
+
+		if (head)
+			ret = pkg_repo_fetch_manifest(job->pkg, &job->manifest);
+		else
+			ret = pkg_repo_fetch2(job->pkg, &job->done);
+
+		pthread_mutex_lock(&d->m);
+		job->site->active--;
+		if (head) {
+			job->head_done = true;
+			d->heads_done++;
+		} else
+			job->finished = true;
+		if (ret != EPKG_OK)
+			d->failed = true;
+		pthread_cond_broadcast(&d->cond);
+	}
+	d->workers--;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->m);
+
+	return (NULL);
+}
+
+/*
+ * Start downloading the packages using up to FETCH_JOBS connections,
+ * and no more than FETCH_JOBS_PER_MIRROR to the same repository.  If
+ * `heads' is set, the manifests of all the packages are read first.
+ */
 static int
-pkg_jobs_fetch(struct pkg_jobs *j)
+pkg_jobs_fetch_start(struct pkg_jobs *j, struct fetch_data *d, bool heads)
+{
+	struct pkg *p = NULL;
+	struct stat st;
+	int64_t max_jobs = 1, per_site = 0;
+	int64_t pkgsize;
+	const char *cachedir, *repopath;
+	char cachedpath[MAXPATHLEN];
+	size_t i;
+
+	memset(d, 0, sizeof(struct fetch_data));
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pkg_config_int64(PKG_CONFIG_FETCH_JOBS, &max_jobs);
+	pkg_config_int64(PKG_CONFIG_FETCH_JOBS_PER_MIRROR, &per_site);
+
+	while (pkg_jobs(j, &p) == EPKG_OK)
+		d->num_jobs++;
+
+	d->jobs = calloc(d->num_jobs, sizeof(struct fetch_job));
+	d->sites = calloc(d->num_jobs, sizeof(struct fetch_site));
+	if (d->jobs == NULL || d->sites == NULL) {
+		pkg_emit_errno("calloc", "fetch_job");
+		goto error;
+	}
+
+	p = NULL;
+	i = 0;
+	while (pkg_jobs(j, &p) == EPKG_OK) {
+		const char *url = pkg_repo_site(p);
+		size_t s;
+
+		if (url == NULL)
+			url = "";
+		for (s = 0; s < d->num_sites; s++)
+			if (strcmp(d->sites[s].url, url) == 0)
+				break;
+		if (s == d->num_sites)
+			d->sites[d->num_sites++].url = url;
+
+		d->jobs[i].pkg = p;
+		d->jobs[i].site = &d->sites[s];
+		i++;
+
+		pkg_get(p, PKG_NEW_PKGSIZE, &pkgsize, PKG_REPOPATH, &repopath);
+		snprintf(cachedpath, sizeof(cachedpath), "%s/%s", cachedir,
+		    repopath);
+		if (access(cachedpath, F_OK) == 0)
+			continue;
+		d->total += pkgsize;
+		/* resumed downloads */
+		strlcat(cachedpath, ".part", sizeof(cachedpath));
+		if (stat(cachedpath, &st) == 0 && st.st_size < pkgsize)
+			d->total -= st.st_size;
+	}
+
+	if ((d->tids = calloc(d->num_jobs, sizeof(pthread_t))) == NULL) {
+		pkg_emit_errno("calloc", "pthread_t");
+		goto error;
+	}
+
+	d->heads = heads;
+	d->per_site = per_site;
+	pthread_mutex_init(&d->m, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	snprintf(d->label, sizeof(d->label), "%zu packages", d->num_jobs);
+	d->begin = time(NULL);
+
+	pthread_mutex_lock(&d->m);
+	for (int t = 0; t < MAX(1, MIN(max_jobs, (int64_t)d->num_jobs)); t++) {
+		if (pthread_create(&d->tids[t], NULL, pkg_jobs_fetch_thread,
+		    d) != 0) {
+			pkg_emit_errno("pthread_create", "fetch");
+			d->failed = true;
+			break;
+		}
+		d->num_threads++;
+		d->workers++;
+	}
+	pthread_mutex_unlock(&d->m);
+
+	return (d->failed ? EPKG_FATAL : EPKG_OK);
+
+	error:
+	free(d->jobs);
+	free(d->sites);
+	d->jobs = NULL;
+	d->sites = NULL;
+
+	return (EPKG_FATAL);
+}
+
+/*
+ * Wait until all the manifests are read if `heads' is set, or until
+ * the package of `upto' is downloaded, or all of them if it is NULL.
+ * The progress of the downloads is reported as a whole meanwhile.
+ */
+static int
+pkg_jobs_fetch_wait(struct fetch_data *d, struct fetch_job *upto, bool heads)
+{
+	struct timespec ts;
+	off_t done;
+	size_t finished;
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock(&d->m);
+	for (;;) {
+		done = 0;
+		finished = 0;
+		for (i = 0; i < d->num_jobs; i++) {
+			done += d->jobs[i].done;
+			if (d->jobs[i].finished)
+				finished++;
+		}
+
+		if (finished == d->num_jobs && !d->reported) {
+			d->reported = true;
+			if (d->total > 0) {
+				pthread_mutex_unlock(&d->m);
+				pkg_emit_fetching(d->label, d->total, d->total,
+				    time(NULL) - d->begin);
+				pthread_mutex_lock(&d->m);
+			}
+		}
+
+		if (d->failed || d->workers == 0)
+			break;
+		if (heads && d->heads_done == d->num_jobs)
+			break;
+		if (!heads && upto != NULL && upto->finished)
+			break;
+
+		if (!heads && d->total > 0 && !d->reported) {
+			/* the meter stops once `total' is reached */
+			if (done >= d->total)
+				done = d->total - 1;
+			pthread_mutex_unlock(&d->m);
+			pkg_emit_fetching(d->label, d->total, done,
+			    time(NULL) - d->begin);
+			pthread_mutex_lock(&d->m);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&d->cond, &d->m, &ts);
+	}
+	ret = d->failed ? EPKG_FATAL : EPKG_OK;
+	pthread_mutex_unlock(&d->m);
+
+	return (ret);
+}
+
+/* Stop the downloads, before they are over if `abort' is set */
+static void
+pkg_jobs_fetch_finish(struct fetch_data *d, bool abort)
+{
+	if (d->jobs == NULL)
+		return;
+
+	pthread_mutex_lock(&d->m);
+	if (abort)
+		d->failed = true;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->m);
+
+	for (int t = 0; t < d->num_threads; t++)
+		pthread_join(d->tids[t], NULL);
+
+	for (size_t i = 0; i < d->num_jobs; i++)
+		pkg_free(d->jobs[i].manifest);
+
+	pthread_mutex_destroy(&d->m);
+	pthread_cond_destroy(&d->cond);
+	free(d->tids);
+	free(d->sites);
+	free(d->jobs);
+	d->jobs = NULL;
+}
+
+/*
+ * Download the packages, in parallel unless FETCH_JOBS is 1.
+ */
+static int
+pkg_jobs_fetch_parallel(struct pkg_jobs *j)
+{
+	struct pkg *p = NULL;
+	struct fetch_data d;
+	int64_t max_jobs = 1;
+	size_t num_jobs = 0;
+	int ret;
+
+	pkg_config_int64(PKG_CONFIG_FETCH_JOBS, &max_jobs);
+
+	while (pkg_jobs(j, &p) == EPKG_OK)
+		num_jobs++;
+
+	if (max_jobs <= 1 || num_jobs <= 1) {
+		p = NULL;
+		while (pkg_jobs(j, &p) == EPKG_OK) {
+			if (pkg_repo_fetch(p) != EPKG_OK)
+				return (EPKG_FATAL);
+		}
+		return (EPKG_OK);
+	}
+
+	if ((ret = pkg_jobs_fetch_start(j, &d, false)) == EPKG_OK)
+		ret = pkg_jobs_fetch_wait(&d, NULL, false);
+	pkg_jobs_fetch_finish(&d, ret != EPKG_OK);
+
+	return (ret);
+}
+
+static int
+pkg_jobs_check_space(struct pkg_jobs *j)
 {
 	struct pkg *p = NULL;
-	struct pkg *pkg = NULL;
 	struct statfs fs;
 	struct stat st;
-	char path[MAXPATHLEN + 1];
 	int64_t dlsize = 0;
 	const char *cachedir = NULL;
 	const char *repopath = NULL;
 	char cachedpath[MAXPATHLEN];
-	int ret = EPKG_OK;
-	
+
 	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
 		return (EPKG_FATAL);
 
@@ -351,10 +736,13 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 		int64_t pkgsize;
 		pkg_get(p, PKG_NEW_PKGSIZE, &pkgsize, PKG_REPOPATH, &repopath);
 		snprintf(cachedpath, MAXPATHLEN, "%s/%s", cachedir, repopath);
-		if (stat(cachedpath, &st) == -1)
-			dlsize += pkgsize;
-		else
-			dlsize += pkgsize - st.st_size;
+		if (stat(cachedpath, &st) == 0)
+			continue;
+		dlsize += pkgsize;
+		/* only the rest of an interrupted download is needed */
+		strlcat(cachedpath, ".part", MAXPATHLEN);
+		if (stat(cachedpath, &st) == 0 && st.st_size < pkgsize)
+			dlsize -= st.st_size;
 	}
 
 	while (statfs(cachedir, &fs) == -1) {
@@ -377,13 +765,28 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 		    cachedir, dlsz, fsz);
 		return (EPKG_FATAL);
 	}
-		
+
+	return (EPKG_OK);
+}
+
+static int
+pkg_jobs_fetch(struct pkg_jobs *j)
+{
+	struct pkg *p = NULL;
+	struct pkg *pkg = NULL;
+	char path[MAXPATHLEN + 1];
+	const char *cachedir = NULL;
+	int ret = EPKG_OK;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (pkg_jobs_check_space(j) != EPKG_OK)
+		return (EPKG_FATAL);
+
 	/* Fetch */
-	p = NULL;
-	while (pkg_jobs(j, &p) == EPKG_OK) {
-		if (pkg_repo_fetch(p) != EPKG_OK)
-			return (EPKG_FATAL);
-	}
+	if (pkg_jobs_fetch_parallel(j) != EPKG_OK)
+		return (EPKG_FATAL);
 
 	p = NULL;
 	/* integrity checking */
@@ -412,3 +815,41 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 
 	return (EPKG_OK);
 }
+
+/*
+ * Start downloading the packages and check them for conflicts as soon
+ * as their manifests are read, before any of them is installed.  Then
+ * pkg_jobs_install() installs each package once it is downloaded while
+ * the next ones are still downloading.
+ */
+static int
+pkg_jobs_fetch_pipeline(struct pkg_jobs *j, struct fetch_data *d)
+{
+	int ret = EPKG_OK;
+
+	if (pkg_jobs_check_space(j) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (pkg_jobs_fetch_start(j, d, true) != EPKG_OK ||
+	    pkg_jobs_fetch_wait(d, NULL, true) != EPKG_OK) {
+		pkg_jobs_fetch_finish(d, true);
+		return (EPKG_FATAL);
+	}
+
+	pkg_emit_integritycheck_begin();
+
+	for (size_t i = 0; i < d->num_jobs; i++) {
+		if (pkgdb_integrity_append(j->db, d->jobs[i].manifest) !=
+		    EPKG_OK)
+			ret = EPKG_FATAL;
+	}
+
+	if (pkgdb_integrity_check(j->db) != EPKG_OK || ret != EPKG_OK) {
+		pkg_jobs_fetch_finish(d, true);
+		return (EPKG_FATAL);
+	}
+
+	pkg_emit_integritycheck_finished();
+
+	return (EPKG_OK);
+}
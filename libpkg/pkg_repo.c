@@ -33,11 +33,15 @@
 
 #include <archive_entry.h>
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <fts.h>
 #include <libgen.h>
 #include <sqlite3.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pkg.h"
@@ -47,6 +51,9 @@
 #include "private/pkgdb.h"
 #include "private/thd_repo.h"
 
+/* how much of a package is fetched at first to read its manifest */
+#define MANIFEST_HEAD (64 * 1024)
+
 /* The package repo schema major revision */
 #define REPO_SCHEMA_MAJOR 2
 
@@ -70,6 +77,8 @@ typedef enum _sql_prstmt_index {
 	EXISTS,
 	VERSION,
 	DELETE,
+	STAT,
+	SERIAL,
 	PRSTMT_LAST,
 } sql_prstmt_index;
 
@@ -143,61 +152,129 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		"DELETE FROM packages WHERE origin=?1",
 		"T",
 	},
+	[STAT] = {
+		NULL,
+		"INSERT OR REPLACE INTO repo_stat "
+		"(path, size, mtime, inode, cksum) VALUES (?1, ?2, ?3, ?4, ?5)",
+		"TIIIT",
+	},
+	[SERIAL] = {
+		NULL,
+		"INSERT OR REPLACE INTO pkg_serial (package_id, serial) "
+		"SELECT ?1, serial FROM repo_meta",
+		"I",
+	},
 	/* PRSTMT_LAST */
 };
 
+static uint64_t
+repo_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * In multi-repos the remote URL is stored in pkg[PKG_REPOURL]
+ * For a single attached database the repository URL should be
+ * defined by PACKAGESITE.
+ */
+const char *
+pkg_repo_site(struct pkg *pkg)
+{
+	const char *packagesite = NULL;
+	bool multirepos_enabled = false;
+
+	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
+
+	if (multirepos_enabled) {
+		pkg_get(pkg, PKG_REPOURL, &packagesite);
+	} else {
+		pkg_config_string(PKG_CONFIG_REPO, &packagesite);
+	}
+
+	return (packagesite);
+}
+
 int
 pkg_repo_fetch(struct pkg *pkg)
 {
+	return (pkg_repo_fetch2(pkg, NULL));
+}
+
+/*
+ * When `done' is set, the download progress is reported there instead
+ * of through events, see pkg_jobs_fetch().  Once the package in the
+ * cache matches its checksum, it is flagged PKG_CKSUM_VERIFIED and not
+ * hashed again, and recorded in the cache index.
+ *
+ * The package is downloaded to a .part file next to its final path,
+ * and an interrupted download is resumed from there the next time.
+ */
+int
+pkg_repo_fetch2(struct pkg *pkg, volatile off_t *done)
+{
+	struct stat st;
 	char dest[MAXPATHLEN + 1];
+	char part[MAXPATHLEN + 1];
+	char dir[MAXPATHLEN + 1];
 	char url[MAXPATHLEN + 1];
+	char other[MAXPATHLEN + 1];
 	int fetched = 0;
+	bool resumed = false;
+	bool linked = false;
 	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
 	char *path = NULL;
 	const char *packagesite = NULL;
 	const char *cachedir = NULL;
-	bool multirepos_enabled = false;
 	int retcode = EPKG_OK;
-	const char *repopath, *repourl, *sum, *name, *version;
+	int64_t pkgsize;
+	const char *repopath, *sum, *name, *version;
 
 	assert((pkg->type & PKG_REMOTE) == PKG_REMOTE);
 
 	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
 		return (EPKG_FATAL);
 
-	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_REPOURL, &repourl,
-	    PKG_CKSUM, &sum, PKG_NAME, &name, PKG_VERSION, &version);
+	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_CKSUM, &sum,
+	    PKG_NAME, &name, PKG_VERSION, &version,
+	    PKG_NEW_PKGSIZE, &pkgsize);
 
 	snprintf(dest, sizeof(dest), "%s/%s", cachedir, repopath);
+	snprintf(part, sizeof(part), "%s.part", dest);
 
 	/* If it is already in the local cachedir, dont bother to
 	 * download it */
-	if (access(dest, F_OK) == 0)
+	if (access(dest, F_OK) == 0) {
+		/* nor to hash it again if that was done already */
+		if (pkg->flags & PKG_CKSUM_VERIFIED)
+			return (EPKG_OK);
 		goto checksum;
-
-	/* Create the dirs in cachedir */
-	if ((path = dirname(dest)) == NULL) {
-		pkg_emit_errno("dirname", dest);
-		retcode = EPKG_FATAL;
-		goto cleanup;
 	}
 
-	if ((retcode = mkdirs(path)) != EPKG_OK)
-		goto cleanup;
-
 	/*
-	 * In multi-repos the remote URL is stored in pkg[PKG_REPOURL]
-	 * For a single attached database the repository URL should be
-	 * defined by PACKAGESITE.
+	 * Create the dirs in cachedir.  Not using dirname(3), its
+	 * buffer is shared by the parallel downloads.
 	 */
-	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
+	strlcpy(dir, dest, sizeof(dir));
+	if ((path = strrchr(dir, '/')) != NULL)
+		*path = '\0';
 
-	if (multirepos_enabled) {
-		packagesite = repourl;
-	} else {
-		pkg_config_string(PKG_CONFIG_REPO, &packagesite);
+	if ((retcode = mkdirs(dir)) != EPKG_OK)
+		goto cleanup;
+
+	/* the same package may be in the cache for another repository */
+	if (pkg_cache_lookup(sum, repopath, other, sizeof(other)) == EPKG_OK &&
+	    link(other, dest) == 0) {
+		linked = true;
+		goto checksum;
 	}
 
+	packagesite = pkg_repo_site(pkg);
+
 	if (packagesite == NULL || packagesite[0] == '\0') {
 		pkg_emit_error("PACKAGESITE is not defined");
 		retcode = 1;
@@ -209,28 +286,56 @@ pkg_repo_fetch(struct pkg *pkg)
 	else
 		snprintf(url, sizeof(url), "%s/%s", packagesite, repopath);
 
-	retcode = pkg_fetch_file(url, dest, 0);
+	if (stat(part, &st) == 0) {
+		/* nothing left to resume from */
+		if (pkgsize > 0 && st.st_size >= pkgsize)
+			unlink(part);
+		else
+			resumed = (st.st_size > 0);
+	}
+
+	/* hashed while written */
+	retcode = pkg_fetch_file2(url, part, 0, true, done, cksum);
 	fetched = 1;
 
 	if (retcode != EPKG_OK)
 		goto cleanup;
 
 	checksum:
-	retcode = sha256_file(dest, cksum);
-	if (retcode == EPKG_OK)
+	if (fetched == 0)
+		retcode = sha256_file(dest, cksum);
+	if (retcode == EPKG_OK) {
 		if (strcmp(cksum, sum)) {
-			if (fetched == 1) {
+			if (fetched == 1 && resumed) {
+				pkg_emit_error("partial download of %s-%s: "
+				    "checksum mismatch, fetching it again",
+				    name, version);
+				unlink(part);
+				return (pkg_repo_fetch2(pkg, done));
+			} else if (fetched == 1) {
 				pkg_emit_error("%s-%s failed checksum "
 				    "from repository", name, version);
+				unlink(part);
 				retcode = EPKG_FATAL;
 			} else {
 				pkg_emit_error("cached package %s-%s: "
 				    "checksum mismatch, fetching from remote",
 				    name, version);
 				unlink(dest);
-				return (pkg_repo_fetch(pkg));
+				/* not to be linked again */
+				if (linked)
+					pkg_cache_delete(other +
+					    strlen(cachedir) + 1);
+				return (pkg_repo_fetch2(pkg, done));
 			}
+		} else if (fetched == 1 && rename(part, dest) != 0) {
+			pkg_emit_errno("rename", dest);
+			retcode = EPKG_FATAL;
+		} else {
+			pkg->flags |= PKG_CKSUM_VERIFIED;
+			pkg_cache_add(pkg);
 		}
+	}
 
 	cleanup:
 	if (retcode != EPKG_OK)
@@ -239,6 +344,191 @@ pkg_repo_fetch(struct pkg *pkg)
 	return (retcode);
 }
 
+/*
+ * Read the manifest at the beginning of a possibly partial package.
+ * Returns EPKG_END if more of the package is needed.
+ */
+static int
+read_manifest(const char *path, struct pkg **m)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	struct sbuf *manifest = NULL;
+	const char *fpath;
+	char buf[BUFSIZ];
+	ssize_t size = 0;
+	int ret = EPKG_END;
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_filename(a, path, 4096) != ARCHIVE_OK)
+		goto cleanup;
+
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		fpath = archive_entry_pathname(ae);
+		if (fpath[0] != '+') {
+			pkg_emit_error("%s is not a valid package: "
+			    "no +MANIFEST found", path);
+			ret = EPKG_FATAL;
+			break;
+		}
+		if (strcmp(fpath, "+MANIFEST") != 0)
+			continue;
+
+		manifest = sbuf_new_auto();
+		while ((size = archive_read_data(a, buf, sizeof(buf))) > 0)
+			sbuf_bcat(manifest, buf, size);
+		if (size < 0 || sbuf_len(manifest) != archive_entry_size(ae))
+			break;
+		sbuf_finish(manifest);
+
+		if (*m == NULL)
+			pkg_new(m, PKG_FILE);
+		else
+			pkg_reset(*m, PKG_FILE);
+		ret = pkg_parse_manifest(*m, sbuf_data(manifest));
+		break;
+	}
+
+	cleanup:
+	if (manifest != NULL)
+		sbuf_delete(manifest);
+	archive_read_finish(a);
+
+	return (ret);
+}
+
+/*
+ * Read the manifest of a remote package, fetching only the beginning
+ * of the package, in steps growing from MANIFEST_HEAD, if it is not in
+ * the cache yet.  The download of the package later resumes from
+ * what was fetched.
+ */
+int
+pkg_repo_fetch_manifest(struct pkg *pkg, struct pkg **m)
+{
+	struct stat st;
+	FILE *remote = NULL;
+	char dest[MAXPATHLEN + 1];
+	char part[MAXPATHLEN + 1];
+	char url[MAXPATHLEN + 1];
+	char dir[MAXPATHLEN + 1];
+	char buf[BUFSIZ];
+	char *p;
+	const char *packagesite = NULL;
+	const char *cachedir = NULL;
+	const char *repopath, *name, *version;
+	int64_t pkgsize;
+	off_t want = MANIFEST_HEAD;
+	off_t have, offset, size;
+	size_t r;
+	int fd = -1;
+	int retcode;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_NAME, &name,
+	    PKG_VERSION, &version, PKG_NEW_PKGSIZE, &pkgsize);
+
+	snprintf(dest, sizeof(dest), "%s/%s", cachedir, repopath);
+	snprintf(part, sizeof(part), "%s.part", dest);
+
+	/* already there, check it right away */
+	if (access(dest, F_OK) == 0) {
+		if ((retcode = pkg_repo_fetch2(pkg, NULL)) != EPKG_OK)
+			return (retcode);
+		return (pkg_open(m, dest));
+	}
+
+	/* small enough to be fetched whole */
+	if (pkgsize > 0 && pkgsize <= want)
+		return (pkg_repo_fetch2(pkg, NULL) == EPKG_OK ?
+		    pkg_open(m, dest) : EPKG_FATAL);
+
+	packagesite = pkg_repo_site(pkg);
+	if (packagesite == NULL || packagesite[0] == '\0') {
+		pkg_emit_error("PACKAGESITE is not defined");
+		return (EPKG_FATAL);
+	}
+
+	if (packagesite[strlen(packagesite) - 1] == '/')
+		snprintf(url, sizeof(url), "%s%s", packagesite, repopath);
+	else
+		snprintf(url, sizeof(url), "%s/%s", packagesite, repopath);
+
+	for (;;) {
+		have = stat(part, &st) == 0 ? st.st_size : 0;
+		if (have > 0 && (retcode = read_manifest(part, m)) != EPKG_END)
+			break;
+
+		if (pkgsize > 0 && have >= pkgsize) {
+			pkg_emit_error("%s-%s: truncated package", name,
+			    version);
+			unlink(part);
+			retcode = EPKG_FATAL;
+			break;
+		}
+
+		while (want <= have)
+			want *= 4;
+
+		strlcpy(dir, part, sizeof(dir));
+		if ((p = strrchr(dir, '/')) != NULL)
+			*p = '\0';
+		if ((retcode = mkdirs(dir)) != EPKG_OK)
+			break;
+		if ((fd = open(part, O_WRONLY|O_APPEND|O_CREAT, 0600)) == -1) {
+			pkg_emit_errno("open", part);
+			retcode = EPKG_FATAL;
+			break;
+		}
+
+		offset = have;
+		retcode = pkg_fetch_open(url, 0, &offset, &remote, &size, NULL);
+		if (retcode != EPKG_OK)
+			break;
+
+		/* no range support */
+		if (offset != have && ftruncate(fd, offset) == -1) {
+			pkg_emit_errno("ftruncate", part);
+			retcode = EPKG_FATAL;
+			break;
+		}
+
+		while (offset < want &&
+		    (r = fread(buf, 1, sizeof(buf), remote)) > 0) {
+			if (write(fd, buf, r) != (ssize_t)r) {
+				pkg_emit_errno("write", part);
+				retcode = EPKG_FATAL;
+				break;
+			}
+			offset += r;
+		}
+		fclose(remote);
+		remote = NULL;
+		close(fd);
+		fd = -1;
+
+		if (retcode != EPKG_OK)
+			break;
+		if (offset < want && offset < size) {
+			pkg_emit_error("%s: transfer interrupted", url);
+			retcode = EPKG_FATAL;
+			break;
+		}
+	}
+
+	if (remote != NULL)
+		fclose(remote);
+	if (fd != -1)
+		close(fd);
+
+	return (retcode);
+}
+
 static void
 file_exists(sqlite3_context *ctx, int argc, __unused sqlite3_value **argv)
 {
@@ -292,6 +582,8 @@ initialize_repo(const char *repodb, bool force, sqlite3 **sqlite)
 	bool incremental = false;
 	bool db_not_open;
 	int reposcver;
+	int64_t deltas = 0;
+	int removed;
 	int retcode = EPKG_OK;
 
 	const char initsql[] = ""
@@ -419,9 +711,71 @@ initialize_repo(const char *repodb, bool force, sqlite3 **sqlite)
 			return (retcode);
 	}
 
+	/*
+	 * repo_stat only matters to pkg repo itself: older pkgng just
+	 * ignore it, so no need to bump the schema version for it.  It
+	 * has every file read, also those left out of the catalogue, and
+	 * replaces pkg_stat, which only had the packages.
+	 */
+	retcode = sql_exec(*sqlite, ""
+		"DROP TABLE IF EXISTS pkg_stat;"
+		"CREATE TABLE IF NOT EXISTS repo_stat ("
+			"path TEXT PRIMARY KEY,"
+			"size INTEGER NOT NULL,"
+			"mtime INTEGER NOT NULL,"
+			"inode INTEGER NOT NULL,"
+			"cksum TEXT NOT NULL"
+		");");
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	/*
+	 * Same for the summary of the catalogue checked by pkg update,
+	 * and the bookkeeping of the changesets published for it, see
+	 * pkg_finish_repo().
+	 */
+	retcode = sql_exec(*sqlite, ""
+		"CREATE TABLE IF NOT EXISTS repo_meta ("
+			"epoch INTEGER NOT NULL,"
+			"serial INTEGER NOT NULL,"
+			"deltas INTEGER NOT NULL,"
+			"schema INTEGER NOT NULL DEFAULT 0,"
+			"packages INTEGER NOT NULL DEFAULT 0,"
+			"digest TEXT NOT NULL DEFAULT ''"
+		");"
+		"CREATE TABLE IF NOT EXISTS repo_abi ("
+			"abi TEXT NOT NULL UNIQUE"
+		");"
+		"CREATE TABLE IF NOT EXISTS pkg_serial ("
+			"package_id INTEGER PRIMARY KEY REFERENCES packages(id)"
+			"  ON DELETE CASCADE ON UPDATE CASCADE,"
+			"serial INTEGER NOT NULL"
+		");"
+		"CREATE TABLE IF NOT EXISTS pkg_removed ("
+			"origin TEXT NOT NULL,"
+			"serial INTEGER NOT NULL"
+		");");
+	if (retcode != EPKG_OK)
+		return (retcode);
+
 	if ((retcode = sql_exec(*sqlite, "BEGIN TRANSACTION")) != EPKG_OK)
 		return (retcode);
 
+	/*
+	 * Each run gets the next serial, a new catalogue starts a new
+	 * epoch at serial 0.  finish_meta() gives the serial back if
+	 * nothing changed.
+	 */
+	pkg_config_int64(PKG_CONFIG_REPO_DELTAS, &deltas);
+	retcode = sql_exec(*sqlite, ""
+		"UPDATE repo_meta SET serial = serial + 1, deltas = %lld;"
+		"INSERT INTO repo_meta (epoch, serial, deltas) "
+		"SELECT %lld, 0, %lld "
+		"WHERE NOT EXISTS (SELECT * FROM repo_meta);",
+		(long long)deltas, (long long)time(NULL), (long long)deltas);
+	if (retcode != EPKG_OK)
+		return (retcode);
+
 	/* remove anything that is no longer in the repository. */
 	if (incremental) {
 		const char *obsolete[] = {
@@ -434,13 +788,87 @@ initialize_repo(const char *repodb, bool force, sqlite3 **sqlite)
 				"(SELECT shlib_id FROM pkg_shlibs)"
 		};
 		size_t num_objs = sizeof(obsolete) / sizeof(*obsolete);
+
+		sql_exec(*sqlite, "INSERT INTO pkg_removed (origin, serial) "
+		    "SELECT origin, serial FROM packages, repo_meta "
+		    "WHERE NOT FILE_EXISTS(path);");
+		removed = sqlite3_changes(*sqlite);
 		for (size_t obj = 0; obj < num_objs; obj++)
 			sql_exec(*sqlite, "DELETE FROM %s;", obsolete[obj]);
+
+		/*
+		 * A file left out of the catalogue, e.g. an older version,
+		 * may now replace a package which is gone: read them again.
+		 */
+		sql_exec(*sqlite, "DELETE FROM repo_stat WHERE "
+		    "NOT FILE_EXISTS(path) OR "
+		    "(%d AND path NOT IN (SELECT path FROM packages));",
+		    removed > 0);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Digest of what pkg update relies on in the catalogue, so that a copy
+ * maintained from the changesets can be checked against the original.
+ */
+int
+pkg_repo_digest(sqlite3 *sqlite, char digest[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	sqlite3_stmt *stmt;
+	SHA256_CTX ctx;
+	int ret;
+	const char sql[] = ""
+		"SELECT origin, cksum, path FROM packages ORDER BY origin";
+
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		return (EPKG_FATAL);
+	}
+
+	SHA256_Init(&ctx);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		for (int i = 0; i < 3; i++) {
+			SHA256_Update(&ctx, sqlite3_column_text(stmt, i),
+			    sqlite3_column_bytes(stmt, i));
+			SHA256_Update(&ctx, "\n", 1);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(sqlite);
+		return (EPKG_FATAL);
 	}
 
+	sha256_final(&ctx, digest);
+
 	return (EPKG_OK);
 }
 
+static int
+finish_meta(sqlite3 *sqlite)
+{
+	char digest[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	if (pkg_repo_digest(sqlite, digest) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (sql_exec(sqlite, ""
+	    "UPDATE repo_meta SET serial = serial - 1 "
+	    "WHERE serial > 0 "
+	    "AND serial NOT IN (SELECT serial FROM pkg_serial) "
+	    "AND serial NOT IN (SELECT serial FROM pkg_removed);"
+	    "DELETE FROM pkg_removed "
+	    "WHERE serial <= (SELECT serial - deltas FROM repo_meta);"
+	    "DELETE FROM repo_abi;"
+	    "INSERT INTO repo_abi (abi) SELECT DISTINCT arch FROM packages;"
+	    "UPDATE repo_meta SET schema = %d, digest = %Q, "
+	    "packages = (SELECT count(*) FROM packages);",
+	    REPO_SCHEMA_VERSION, digest));
+}
+
 static int
 initialize_prepared_statements(sqlite3 *sqlite)
 {
@@ -541,272 +969,636 @@ maybe_delete_conflicting(const char *origin, const char *version,
 	return (ret);	
 }
 
-int
-pkg_create_repo(char *path, bool force,
-    void (progress)(struct pkg *pkg, void *data), void *data)
+static int
+repo_stat_cmp(const void *a, const void *b)
 {
-	FTS *fts = NULL;
-	struct thd_data thd_data;
-	int num_workers;
-	size_t len;
-	pthread_t *tids = NULL;
-
-	struct pkg_dep *dep = NULL;
-	struct pkg_category *category = NULL;
-	struct pkg_license *license = NULL;
-	struct pkg_option *option = NULL;
-	struct pkg_shlib *shlib = NULL;
+	const struct repo_stat *sa = a;
+	const struct repo_stat *sb = b;
 
-	sqlite3 *sqlite = NULL;
+	return (strcmp(sa->path, sb->path));
+}
 
-	int64_t package_id;
-	char *errmsg = NULL;
-	int retcode = EPKG_OK;
+static int
+load_repo_stats(sqlite3 *sqlite, struct repo_stat **stats, size_t *num_stats)
+{
+	sqlite3_stmt *stmt;
+	struct repo_stat *s = NULL;
+	size_t len = 0;
+	size_t cap = 0;
 	int ret;
+	const char sql[] = ""
+		"SELECT path, size, mtime, inode FROM repo_stat";
 
-	char *repopath[2];
-	char repodb[MAXPATHLEN + 1];
-	char repopack[MAXPATHLEN + 1];
-
-	struct archive *a = NULL;
-	struct archive_entry *ae = NULL;
+	*stats = NULL;
+	*num_stats = 0;
 
-	if (!is_dir(path)) {
-		pkg_emit_error("%s is not a directory", path);
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
 		return (EPKG_FATAL);
 	}
 
-	repopath[0] = path;
-	repopath[1] = NULL;
-
-	len = sizeof(num_workers);
-	if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
-		num_workers = 6;
-
-	if ((fts = fts_open(repopath, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL) {
-		pkg_emit_errno("fts_open", path);
-		retcode = EPKG_FATAL;
-		goto cleanup;
-	}
-
-	snprintf(repodb, sizeof(repodb), "%s/repo.sqlite", path);
-	snprintf(repopack, sizeof(repopack), "%s/repo.txz", path);
-
-	if (access(repopack, F_OK) == 0) {
-		a = archive_read_new();
-		archive_read_support_compression_all(a);
-		archive_read_support_format_tar(a);
-		ret = archive_read_open_filename(a, repopack, 4096);
-		if (ret != ARCHIVE_OK) {
-			/* if we can't unpack it it won't be useful for us */
-			unlink(repopack);
-		} else {
-			while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
-				if (!strcmp(archive_entry_pathname(ae),
-				    "repo.sqlite")) {
-					archive_entry_set_pathname(ae, repodb);
-					archive_read_extract(a, ae,
-					    EXTRACT_ARCHIVE_FLAGS);
-					break;
-				}
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (len >= cap) {
+			cap |= 1;
+			cap *= 2;
+			s = reallocf(s, cap * sizeof(struct repo_stat));
+			if (s == NULL) {
+				pkg_emit_errno("reallocf", "repo_stat");
+				sqlite3_finalize(stmt);
+				return (EPKG_FATAL);
 			}
 		}
-		if (a != NULL)
-			archive_read_finish(a);
+		s[len].path = strdup(sqlite3_column_text(stmt, 0));
+		s[len].size = sqlite3_column_int64(stmt, 1);
+		s[len].mtime = sqlite3_column_int64(stmt, 2);
+		s[len].inode = sqlite3_column_int64(stmt, 3);
+		len++;
 	}
+	sqlite3_finalize(stmt);
 
-	if ((retcode = initialize_repo(repodb, force, &sqlite)) != EPKG_OK)
-		goto cleanup;
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(sqlite);
+		for (size_t i = 0; i < len; i++)
+			free(s[i].path);
+		free(s);
+		return (EPKG_FATAL);
+	}
 
-	if ((retcode = initialize_prepared_statements(sqlite)) != EPKG_OK)
-		goto cleanup;
+	qsort(s, len, sizeof(struct repo_stat), repo_stat_cmp);
+	*stats = s;
+	*num_stats = len;
 
-	thd_data.root_path = path;
-	thd_data.max_results = num_workers;
-	thd_data.num_results = 0;
-	thd_data.stop = false;
-	thd_data.fts = fts;
-	pthread_mutex_init(&thd_data.fts_m, NULL);
-	STAILQ_INIT(&thd_data.results);
-	thd_data.thd_finished = 0;
-	pthread_mutex_init(&thd_data.results_m, NULL);
-	pthread_cond_init(&thd_data.has_result, NULL);
-	pthread_cond_init(&thd_data.has_room, NULL);
+	return (EPKG_OK);
+}
 
-	/* Launch workers */
-	tids = calloc(num_workers, sizeof(pthread_t));
-	for (int i = 0; i < num_workers; i++) {
-		pthread_create(&tids[i], NULL, (void *)&read_pkg_file, &thd_data);
+static void
+free_repo_stats(struct repo_stat *stats, size_t num_stats)
+{
+	for (size_t i = 0; i < num_stats; i++)
+		free(stats[i].path);
+	free(stats);
+}
+
+/*
+ * A package file is considered unchanged, and is neither hashed nor
+ * opened again, if its path, size, mtime and inode all match what was
+ * recorded when it was last read, whether it made it to the catalogue
+ * or not.
+ */
+static bool
+repo_stat_unchanged(struct repo_stat *stats, size_t num_stats,
+    const char *path, off_t size, time_t mtime, ino_t inode)
+{
+	struct repo_stat key, *s;
+
+	if (num_stats == 0)
+		return (false);
+
+	key.path = __DECONST(char *, path);
+	s = bsearch(&key, stats, num_stats, sizeof(struct repo_stat),
+	    repo_stat_cmp);
+	if (s == NULL)
+		return (false);
+
+	return (s->size == size && s->mtime == mtime && s->inode == inode);
+}
+
+static int
+repo_file_cmp(const void *a, const void *b)
+{
+	const struct repo_file *fa = a;
+	const struct repo_file *fb = b;
+
+	/* biggest first */
+	if (fa->size > fb->size)
+		return (-1);
+	if (fa->size < fb->size)
+		return (1);
+	return (0);
+}
+
+static void
+free_repo_files(struct repo_file *files, size_t num_files)
+{
+	for (size_t i = 0; i < num_files; i++)
+		free(files[i].path);
+	free(files);
+}
+
+/*
+ * Walk the repository and collect every package file which needs to be
+ * read, sorted by decreasing size so that the biggest packages are not
+ * left for last when handed out to the workers.
+ */
+static int
+scan_repo(char *path, struct repo_stat *stats, size_t num_stats,
+    struct repo_file **files, size_t *num_files)
+{
+	FTS *fts;
+	FTSENT *fts_ent;
+	struct repo_file *f = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	char *repopath[2];
+	char *ext;
+	const char *pkg_path;
+
+	*files = NULL;
+	*num_files = 0;
+
+	repopath[0] = path;
+	repopath[1] = NULL;
+
+	if ((fts = fts_open(repopath, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL) {
+		pkg_emit_errno("fts_open", path);
+		return (EPKG_FATAL);
 	}
 
-	for (;;) {
-		struct pkg_result *r;
+	while ((fts_ent = fts_read(fts)) != NULL) {
+		/* the changesets are not packages */
+		if (fts_ent->fts_info == FTS_D && fts_ent->fts_level == 1 &&
+		    strcmp(fts_ent->fts_name, "deltas") == 0) {
+			fts_set(fts, fts_ent, FTS_SKIP);
+			continue;
+		}
 
-		const char *name, *version, *origin, *comment, *desc;
-		const char *arch, *maintainer, *www, *prefix;
-		int64_t flatsize;
-		lic_t licenselogic;
+		/* skip everything that is not a file */
+		if (fts_ent->fts_info != FTS_F)
+			continue;
 
-		pthread_mutex_lock(&thd_data.results_m);
-		while ((r = STAILQ_FIRST(&thd_data.results)) == NULL) {
-			if (thd_data.thd_finished == num_workers) {
-				break;
+		ext = strrchr(fts_ent->fts_name, '.');
+
+		if (ext == NULL)
+			continue;
+
+		if (strcmp(ext, ".tgz") != 0 &&
+				strcmp(ext, ".tbz") != 0 &&
+				strcmp(ext, ".txz") != 0 &&
+				strcmp(ext, ".tar") != 0)
+			continue;
+
+		if (strcmp(fts_ent->fts_name, "repo.txz") == 0)
+			continue;
+
+		pkg_path = fts_ent->fts_path + strlen(path);
+		while (pkg_path[0] == '/')
+			pkg_path++;
+
+		if (repo_stat_unchanged(stats, num_stats, pkg_path,
+		    fts_ent->fts_statp->st_size, fts_ent->fts_statp->st_mtime,
+		    fts_ent->fts_statp->st_ino))
+			continue;
+
+		if (len >= cap) {
+			cap |= 1;
+			cap *= 2;
+			f = reallocf(f, cap * sizeof(struct repo_file));
+			if (f == NULL) {
+				pkg_emit_errno("reallocf", "repo_file");
+				fts_close(fts);
+				return (EPKG_FATAL);
 			}
-			pthread_cond_wait(&thd_data.has_result, &thd_data.results_m);
-		}
-		if (r != NULL) {
-			STAILQ_REMOVE_HEAD(&thd_data.results, next);
-			thd_data.num_results--;
-			pthread_cond_signal(&thd_data.has_room);
-		}
-		pthread_mutex_unlock(&thd_data.results_m);
-		if (r == NULL) {
-			break;
 		}
+		f[len].path = strdup(fts_ent->fts_path);
+		f[len].size = fts_ent->fts_statp->st_size;
+		f[len].mtime = fts_ent->fts_statp->st_mtime;
+		f[len].inode = fts_ent->fts_statp->st_ino;
+		len++;
+	}
 
-		if (r->retcode != EPKG_OK) {
-			continue;
+	fts_close(fts);
+
+	qsort(f, len, sizeof(struct repo_file), repo_file_cmp);
+	*files = f;
+	*num_files = len;
+
+	return (EPKG_OK);
+}
+
+static bool
+results_full(struct thd_data *d)
+{
+	u_int pos = d->enq_pos;
+
+	return ((int)(atomic_load_acq_int(&d->ring[pos & d->ring_mask].seq) -
+	    pos) < 0);
+}
+
+/*
+ * Called by the workers to hand a result over to the main thread.
+ * Only sleeps when the ring is full.
+ */
+static void
+results_put(struct thd_data *d, struct pkg_result *r)
+{
+	struct result_slot *slot;
+	u_int pos, seq;
+
+	for (;;) {
+		pos = d->enq_pos;
+		slot = &d->ring[pos & d->ring_mask];
+		seq = atomic_load_acq_int(&slot->seq);
+		if (seq == pos) {
+			if (atomic_cmpset_int(&d->enq_pos, pos, pos + 1))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			/* full, wait for the main thread to make room */
+			pthread_mutex_lock(&d->results_m);
+			d->room_waiters++;
+			while (results_full(d))
+				pthread_cond_wait(&d->has_room, &d->results_m);
+			d->room_waiters--;
+			pthread_mutex_unlock(&d->results_m);
 		}
+		/* else another worker took that slot, try the next one */
+	}
 
-		/* do not add if package if already in repodb
-		   (possibly at a different pkg_path) */
+	slot->r = r;
+	atomic_store_rel_int(&slot->seq, pos + 1);
 
-		if (run_prepared_statement(EXISTS, r->cksum) != SQLITE_ROW) {
-			ERROR_SQLITE(sqlite);
-			goto cleanup;
+	/* the main thread may be sleeping if there was nothing pending */
+	if (atomic_fetchadd_int(&d->pending, 1) == 0) {
+		pthread_mutex_lock(&d->results_m);
+		pthread_cond_signal(&d->has_result);
+		pthread_mutex_unlock(&d->results_m);
+	}
+}
+
+/*
+ * Called by the main thread: dequeue up to `max' results at once,
+ * sleeping only if none is available.  Returns 0 once all the workers
+ * are done and everything has been dequeued.
+ */
+static size_t
+results_get(struct thd_data *d, int num_workers, struct pkg_result **batch,
+    size_t max)
+{
+	struct result_slot *slot;
+	size_t n;
+	bool done;
+
+	for (;;) {
+		n = 0;
+		while (n < max) {
+			slot = &d->ring[d->deq_pos & d->ring_mask];
+			if (atomic_load_acq_int(&slot->seq) != d->deq_pos + 1)
+				break;
+			batch[n++] = slot->r;
+			atomic_store_rel_int(&slot->seq,
+			    d->deq_pos + d->ring_mask + 1);
+			d->deq_pos++;
 		}
-		if (sqlite3_column_int(STMT(EXISTS), 0) > 0) {
-			continue;
+
+		if (n > 0) {
+			atomic_subtract_int(&d->pending, n);
+			pthread_mutex_lock(&d->results_m);
+			if (d->room_waiters > 0)
+				pthread_cond_broadcast(&d->has_room);
+			pthread_mutex_unlock(&d->results_m);
+			return (n);
 		}
 
-		if (progress != NULL)
-			progress(r->pkg, data);
-
-		pkg_get(r->pkg, PKG_ORIGIN, &origin, PKG_NAME, &name,
-		    PKG_VERSION, &version, PKG_COMMENT, &comment,
-		    PKG_DESC, &desc, PKG_ARCH, &arch,
-		    PKG_MAINTAINER, &maintainer, PKG_WWW, &www,
-		    PKG_PREFIX, &prefix, PKG_FLATSIZE, &flatsize,
-		    PKG_LICENSE_LOGIC, &licenselogic);
-
-	try_again:
-		if ((ret = run_prepared_statement(PKG, origin, name, version,
-		    comment, desc, arch, maintainer, www, prefix,
-		    r->size, flatsize, (int64_t)licenselogic, r->cksum,
-		    r->path)) != SQLITE_DONE) {
-			if (ret == SQLITE_CONSTRAINT) {
-				switch(maybe_delete_conflicting(origin,
-				    version, r->path)) {
-				case EPKG_FATAL: /* sqlite error */
-					ERROR_SQLITE(sqlite);
-					retcode = EPKG_FATAL;
-					goto cleanup;
-					break;
-				case EPKG_END: /* repo already has newer */
-					continue;
-					break;
-				default: /* conflict cleared, try again */
-					goto try_again;
-					break;
-				}
-			} else {
+		pthread_mutex_lock(&d->results_m);
+		while (atomic_load_acq_int(&d->pending) == 0 &&
+		    d->thd_finished < num_workers)
+			pthread_cond_wait(&d->has_result, &d->results_m);
+		done = (atomic_load_acq_int(&d->pending) == 0);
+		pthread_mutex_unlock(&d->results_m);
+
+		if (done)
+			return (0);
+	}
+}
+
+static int
+add_result(sqlite3 *sqlite, struct pkg_result *r,
+    void (progress)(struct pkg *pkg, void *data), void *data)
+{
+	struct pkg_dep *dep = NULL;
+	struct pkg_category *category = NULL;
+	struct pkg_license *license = NULL;
+	struct pkg_option *option = NULL;
+	struct pkg_shlib *shlib = NULL;
+
+	const char *name, *version, *origin, *comment, *desc;
+	const char *arch, *maintainer, *www, *prefix;
+	int64_t flatsize;
+	lic_t licenselogic;
+
+	int64_t package_id;
+	int ret;
+
+	if (r->retcode != EPKG_OK)
+		return (EPKG_OK);
+
+	/* not read again by the next run, whatever happens to it below */
+	if (run_prepared_statement(STAT, r->path, (int64_t)r->size,
+	    (int64_t)r->mtime, (int64_t)r->inode, r->cksum) != SQLITE_DONE) {
+		ERROR_SQLITE(sqlite);
+		return (EPKG_FATAL);
+	}
+
+	/* do not add if package if already in repodb
+	   (possibly at a different pkg_path) */
+
+	if (run_prepared_statement(EXISTS, r->cksum) != SQLITE_ROW) {
+		ERROR_SQLITE(sqlite);
+		return (EPKG_FATAL);
+	}
+	if (sqlite3_column_int(STMT(EXISTS), 0) > 0)
+		return (EPKG_OK);
+
+	if (progress != NULL)
+		progress(r->pkg, data);
+
+	pkg_get(r->pkg, PKG_ORIGIN, &origin, PKG_NAME, &name,
+	    PKG_VERSION, &version, PKG_COMMENT, &comment,
+	    PKG_DESC, &desc, PKG_ARCH, &arch,
+	    PKG_MAINTAINER, &maintainer, PKG_WWW, &www,
+	    PKG_PREFIX, &prefix, PKG_FLATSIZE, &flatsize,
+	    PKG_LICENSE_LOGIC, &licenselogic);
+
+try_again:
+	if ((ret = run_prepared_statement(PKG, origin, name, version,
+	    comment, desc, arch, maintainer, www, prefix,
+	    r->size, flatsize, (int64_t)licenselogic, r->cksum,
+	    r->path)) != SQLITE_DONE) {
+		if (ret == SQLITE_CONSTRAINT) {
+			switch(maybe_delete_conflicting(origin,
+			    version, r->path)) {
+			case EPKG_FATAL: /* sqlite error */
 				ERROR_SQLITE(sqlite);
-				retcode = EPKG_FATAL;
-				goto cleanup;
+				return (EPKG_FATAL);
+				break;
+			case EPKG_END: /* repo already has newer */
+				return (EPKG_OK);
+				break;
+			default: /* conflict cleared, try again */
+				goto try_again;
+				break;
 			}
+		} else {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
 		}
+	}
 
-		package_id = sqlite3_last_insert_rowid(sqlite);
+	package_id = sqlite3_last_insert_rowid(sqlite);
 
-		dep = NULL;
-		while (pkg_deps(r->pkg, &dep) == EPKG_OK) {
-			if (run_prepared_statement(DEPS,
-			    pkg_dep_origin(dep),
-			    pkg_dep_name(dep),
-			    pkg_dep_version(dep),
-			    package_id) != SQLITE_DONE) {
-				ERROR_SQLITE(sqlite);
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+	if (run_prepared_statement(SERIAL, package_id) != SQLITE_DONE) {
+		ERROR_SQLITE(sqlite);
+		return (EPKG_FATAL);
+	}
+
+	while (pkg_deps(r->pkg, &dep) == EPKG_OK) {
+		if (run_prepared_statement(DEPS,
+		    pkg_dep_origin(dep),
+		    pkg_dep_name(dep),
+		    pkg_dep_version(dep),
+		    package_id) != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
 		}
+	}
 
-		category = NULL;
-		while (pkg_categories(r->pkg, &category) == EPKG_OK) {
-			const char *cat_name = pkg_category_name(category);
+	while (pkg_categories(r->pkg, &category) == EPKG_OK) {
+		const char *cat_name = pkg_category_name(category);
 
-			ret = run_prepared_statement(CAT1, cat_name);
-			if (ret == SQLITE_DONE)
-			    ret = run_prepared_statement(CAT2, package_id,
-			        cat_name);
-			if (ret != SQLITE_DONE)
-			{
-				ERROR_SQLITE(sqlite);
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+		ret = run_prepared_statement(CAT1, cat_name);
+		if (ret == SQLITE_DONE)
+		    ret = run_prepared_statement(CAT2, package_id,
+		        cat_name);
+		if (ret != SQLITE_DONE)
+		{
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
 		}
+	}
 
-		license = NULL;
-		while (pkg_licenses(r->pkg, &license) == EPKG_OK) {
-			const char *lic_name = pkg_license_name(license);
+	while (pkg_licenses(r->pkg, &license) == EPKG_OK) {
+		const char *lic_name = pkg_license_name(license);
 
-			ret = run_prepared_statement(LIC1, lic_name);
-			if (ret == SQLITE_DONE)
-				ret = run_prepared_statement(LIC2, package_id,
-				    lic_name);
-			if (ret != SQLITE_DONE) {
-				ERROR_SQLITE(sqlite);
-				retcode = EPKG_FATAL;
-				goto cleanup;
-			}
+		ret = run_prepared_statement(LIC1, lic_name);
+		if (ret == SQLITE_DONE)
+			ret = run_prepared_statement(LIC2, package_id,
+			    lic_name);
+		if (ret != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
 		}
-		option = NULL;
-		while (pkg_options(r->pkg, &option) == EPKG_OK) {
-			if (run_prepared_statement(OPTS,
-			    pkg_option_opt(option),
-			    pkg_option_value(option),
-			    package_id) != SQLITE_DONE) {
-				ERROR_SQLITE(sqlite);
-				retcode = EPKG_FATAL;
-				goto cleanup;
+	}
+
+	while (pkg_options(r->pkg, &option) == EPKG_OK) {
+		if (run_prepared_statement(OPTS,
+		    pkg_option_opt(option),
+		    pkg_option_value(option),
+		    package_id) != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
+		}
+	}
+
+	while (pkg_shlibs(r->pkg, &shlib) == EPKG_OK) {
+		const char *shlib_name = pkg_shlib_name(shlib);
+
+		ret = run_prepared_statement(SHLIB1, shlib_name);
+		if (ret == SQLITE_DONE)
+		    ret = run_prepared_statement(SHLIB2, package_id,
+		        shlib_name);
+		if (ret != SQLITE_DONE)
+		{
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
+		}
+	}
+
+	return (EPKG_OK);
+}
+
+int
+pkg_create_repo(char *path, bool force,
+    void (progress)(struct pkg *pkg, void *data), void *data)
+{
+	return (pkg_create_repo_timed(path, force, progress, data, NULL));
+}
+
+/* Same as pkg_create_repo(), adding the time spent to `timings' if set. */
+int
+pkg_create_repo_timed(char *path, bool force,
+    void (progress)(struct pkg *pkg, void *data), void *data,
+    struct repo_timings *timings)
+{
+	struct thd_data thd_data;
+	struct repo_stat *stats = NULL;
+	size_t num_stats = 0;
+	int num_workers;
+	int64_t max_workers = 0;
+	int64_t queue_depth = 0;
+	uint64_t t = 0;
+	u_int ring_size;
+	size_t len, n;
+	pthread_t *tids = NULL;
+	struct pkg_result **batch = NULL;
+
+	sqlite3 *sqlite = NULL;
+
+	char *errmsg = NULL;
+	int retcode = EPKG_OK;
+	int ret;
+
+	char repodb[MAXPATHLEN + 1];
+	char repopack[MAXPATHLEN + 1];
+
+	struct archive *a = NULL;
+	struct archive_entry *ae = NULL;
+
+	if (!is_dir(path)) {
+		pkg_emit_error("%s is not a directory", path);
+		return (EPKG_FATAL);
+	}
+
+	thd_data.files = NULL;
+	thd_data.num_files = 0;
+	thd_data.ring = NULL;
+	thd_data.timings = timings;
+
+	pkg_config_int64(PKG_CONFIG_REPO_WORKERS, &max_workers);
+	if (max_workers > 0) {
+		num_workers = max_workers;
+	} else {
+		len = sizeof(num_workers);
+		if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
+			num_workers = 6;
+	}
+
+	snprintf(repodb, sizeof(repodb), "%s/repo.sqlite", path);
+	snprintf(repopack, sizeof(repopack), "%s/repo.txz", path);
+
+	if (access(repopack, F_OK) == 0) {
+		a = archive_read_new();
+		archive_read_support_compression_all(a);
+		archive_read_support_format_tar(a);
+		ret = archive_read_open_filename(a, repopack, 4096);
+		if (ret != ARCHIVE_OK) {
+			/* if we can't unpack it it won't be useful for us */
+			unlink(repopack);
+		} else {
+			while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+				if (!strcmp(archive_entry_pathname(ae),
+				    "repo.sqlite")) {
+					archive_entry_set_pathname(ae, repodb);
+					archive_read_extract(a, ae,
+					    EXTRACT_ARCHIVE_FLAGS);
+					break;
+				}
 			}
 		}
+		if (a != NULL)
+			archive_read_finish(a);
+	}
 
-		shlib = NULL;
-		while (pkg_shlibs(r->pkg, &shlib) == EPKG_OK) {
-			const char *shlib_name = pkg_shlib_name(shlib);
+	if ((retcode = initialize_repo(repodb, force, &sqlite)) != EPKG_OK)
+		goto cleanup;
 
-			ret = run_prepared_statement(SHLIB1, shlib_name);
-			if (ret == SQLITE_DONE)
-			    ret = run_prepared_statement(SHLIB2, package_id,
-			        shlib_name);
-			if (ret != SQLITE_DONE)
-			{
-				ERROR_SQLITE(sqlite);
+	if ((retcode = initialize_prepared_statements(sqlite)) != EPKG_OK)
+		goto cleanup;
+
+	if ((retcode = load_repo_stats(sqlite, &stats, &num_stats)) != EPKG_OK)
+		goto cleanup;
+
+	if (timings != NULL)
+		t = repo_now();
+	if ((retcode = scan_repo(path, stats, num_stats, &thd_data.files,
+	    &thd_data.num_files)) != EPKG_OK)
+		goto cleanup;
+	if (timings != NULL)
+		timings->scan += repo_now() - t;
+
+	/* no point in having idle workers */
+	if ((size_t)num_workers > thd_data.num_files)
+		num_workers = thd_data.num_files;
+
+	/*
+	 * Let the workers run ahead of the main thread: by default the
+	 * ring has room for several results per worker, so that the
+	 * main thread can insert them by batches.
+	 */
+	pkg_config_int64(PKG_CONFIG_REPO_QUEUE_DEPTH, &queue_depth);
+	if (queue_depth <= 0)
+		queue_depth = num_workers * 8;
+	for (ring_size = 2; ring_size < queue_depth && ring_size < (1U << 20);)
+		ring_size <<= 1;
+
+	thd_data.ring = calloc(ring_size, sizeof(struct result_slot));
+	batch = calloc(ring_size, sizeof(struct pkg_result *));
+	if (thd_data.ring == NULL || batch == NULL) {
+		pkg_emit_errno("calloc", "results ring");
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+	for (u_int i = 0; i < ring_size; i++)
+		thd_data.ring[i].seq = i;
+
+	thd_data.root_path = path;
+	thd_data.next_file = 0;
+	thd_data.ring_mask = ring_size - 1;
+	thd_data.enq_pos = 0;
+	thd_data.deq_pos = 0;
+	thd_data.pending = 0;
+	thd_data.room_waiters = 0;
+	thd_data.thd_finished = 0;
+	pthread_mutex_init(&thd_data.results_m, NULL);
+	pthread_cond_init(&thd_data.has_result, NULL);
+	pthread_cond_init(&thd_data.has_room, NULL);
+
+	/* Launch workers */
+	tids = calloc(num_workers, sizeof(pthread_t));
+	for (int i = 0; i < num_workers; i++) {
+		pthread_create(&tids[i], NULL, (void *)&read_pkg_file, &thd_data);
+	}
+
+	/*
+	 * On error keep dequeuing, and freeing, the results until all the
+	 * workers are gone, so that none of them stays stuck on a full
+	 * ring.
+	 */
+	while ((n = results_get(&thd_data, num_workers, batch, ring_size)) > 0) {
+		if (timings != NULL)
+			t = repo_now();
+		for (size_t i = 0; i < n; i++) {
+			if (retcode == EPKG_OK &&
+			    add_result(sqlite, batch[i], progress, data) !=
+			    EPKG_OK) {
 				retcode = EPKG_FATAL;
-				goto cleanup;
+				/* Cancel running threads */
+				atomic_store_rel_int(&thd_data.next_file,
+				    thd_data.num_files);
 			}
+			pkg_free(batch[i]->pkg);
+			free(batch[i]);
 		}
-
-		pkg_free(r->pkg);
-		free(r);
+		if (timings != NULL)
+			timings->insert += repo_now() - t;
 	}
 
+	if (retcode != EPKG_OK)
+		goto cleanup;
+
+	if ((retcode = finish_meta(sqlite)) != EPKG_OK)
+		goto cleanup;
+
+	if (timings != NULL)
+		t = repo_now();
 	if (sqlite3_exec(sqlite, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK) {
 		pkg_emit_error("sqlite: %s", errmsg);
 		retcode = EPKG_FATAL;
 	}
+	if (timings != NULL)
+		timings->commit += repo_now() - t;
 
 	cleanup:
 
 	if (tids != NULL) {
-		// Cancel running threads
-		if (retcode != EPKG_OK) {
-			pthread_mutex_lock(&thd_data.fts_m);
-			thd_data.stop = true;
-			pthread_mutex_unlock(&thd_data.fts_m);
-		}
 		// Join on threads to release thread IDs
 		for (int i = 0; i < num_workers; i++) {
 			pthread_join(tids[i], NULL);
@@ -814,8 +1606,10 @@ pkg_create_repo(char *path, bool force,
 		free(tids);
 	}
 
-	if (fts != NULL)
-		fts_close(fts);
+	free(batch);
+	free(thd_data.ring);
+	free_repo_files(thd_data.files, thd_data.num_files);
+	free_repo_stats(stats, num_stats);
 
 	finalize_prepared_statements();
 
@@ -835,84 +1629,47 @@ read_pkg_file(void *data)
 {
 	struct thd_data *d = (struct thd_data*) data;
 	struct pkg_result *r;
+	struct repo_file *f;
+	u_int i;
+	uint64_t t = 0;
+	uint64_t read_time = 0, read_pkgs = 0, read_bytes = 0;
 
-	FTSENT *fts_ent = NULL;
-	char fts_accpath[MAXPATHLEN + 1];
-	char fts_path[MAXPATHLEN + 1];
-	char fts_name[MAXPATHLEN + 1];
-	off_t st_size;
-	int fts_info;
-
-	char *ext = NULL;
 	char *pkg_path;
 
 	for (;;) {
-		fts_ent = NULL;
-
-		/*
-		 * Get a file to read from.
-		 * Copy the data we need from the fts entry localy because as soon as
-		 * we unlock the fts_m mutex, we can not access it.
-		 */
-		pthread_mutex_lock(&d->fts_m);
-		if (d->stop == false) {
-			fts_ent = fts_read(d->fts);
-		}
-		if (fts_ent != NULL) {
-			strlcpy(fts_accpath, fts_ent->fts_accpath, sizeof(fts_accpath));
-			strlcpy(fts_path, fts_ent->fts_path, sizeof(fts_path));
-			strlcpy(fts_name, fts_ent->fts_name, sizeof(fts_name));
-			st_size = fts_ent->fts_statp->st_size;
-			fts_info = fts_ent->fts_info;
-		}
-		pthread_mutex_unlock(&d->fts_m);
+		/* Claim the next file to read, the biggest ones come first */
+		i = atomic_fetchadd_int(&d->next_file, 1);
 
 		// There is no more jobs, exit the main loop.
-		if (fts_ent == NULL)
+		if (i >= d->num_files)
 			break;
 
-		/* skip everything that is not a file */
-		if (fts_info != FTS_F)
-			continue;
-
-		ext = strrchr(fts_name, '.');
-
-		if (ext == NULL)
-			continue;
-
-		if (strcmp(ext, ".tgz") != 0 &&
-				strcmp(ext, ".tbz") != 0 &&
-				strcmp(ext, ".txz") != 0 &&
-				strcmp(ext, ".tar") != 0)
-			continue;
-
-		if (strcmp(fts_name, "repo.txz") == 0)
-			continue;
+		f = &d->files[i];
 
-		pkg_path = fts_path;
+		pkg_path = f->path;
 		pkg_path += strlen(d->root_path);
 		while (pkg_path[0] == '/')
 			pkg_path++;
 
 		r = calloc(1, sizeof(struct pkg_result));
 		strlcpy(r->path, pkg_path, sizeof(r->path));
-		r->size = st_size;
+		r->size = f->size;
+		r->mtime = f->mtime;
+		r->inode = f->inode;
 
-		sha256_file(fts_accpath, r->cksum);
-
-		if (pkg_open(&r->pkg, fts_accpath) != EPKG_OK) {
+		if (d->timings != NULL)
+			t = repo_now();
+		if (pkg_open_cksum(&r->pkg, f->path, r->cksum) != EPKG_OK) {
 			r->retcode = EPKG_WARN;
 		}
-
-		/* Add result to the FIFO and notify */
-		pthread_mutex_lock(&d->results_m);
-		while (d->num_results >= d->max_results) {
-			pthread_cond_wait(&d->has_room, &d->results_m);
+		if (d->timings != NULL) {
+			read_time += repo_now() - t;
+			read_pkgs++;
+			read_bytes += f->size;
 		}
-		STAILQ_INSERT_TAIL(&d->results, r, next);
-		d->num_results++;
-		pthread_cond_signal(&d->has_result);
-		pthread_mutex_unlock(&d->results_m);
+
+		/* Hand the result over to the main thread */
+		results_put(d, r);
 	}
 
 	/*
@@ -920,19 +1677,231 @@ read_pkg_file(void *data)
 	 * Notify the main thread that we are done.
 	 */
 	pthread_mutex_lock(&d->results_m);
+	if (d->timings != NULL) {
+		d->timings->read += read_time;
+		d->timings->packages += read_pkgs;
+		d->timings->bytes += read_bytes;
+	}
 	d->thd_finished++;
 	pthread_cond_signal(&d->has_result);
 	pthread_mutex_unlock(&d->results_m);
 }
 
+/*
+ * The changeset of serial N, deltas/<epoch>-<N>.txz, holds the rows of
+ * the packages added or changed by the run which bumped the serial to
+ * N, and the origins it removed.  pkg update applies them in order on
+ * top of its copy of the catalogue.
+ */
+static const char delta_sql[] = ""
+	"ATTACH %Q AS delta;"
+	"CREATE TABLE delta.changeset AS "
+		"SELECT epoch, serial AS changeset, schema, packages, digest "
+		"FROM repo_meta;"
+	"CREATE TABLE delta.abi AS SELECT abi FROM repo_abi;"
+	"CREATE TABLE delta.packages AS SELECT * FROM packages "
+		"WHERE id IN (SELECT package_id FROM pkg_serial "
+		"WHERE serial = %lld);"
+	"CREATE TABLE delta.deps AS SELECT * FROM deps "
+		"WHERE package_id IN (SELECT id FROM delta.packages);"
+	"CREATE TABLE delta.options AS SELECT * FROM options "
+		"WHERE package_id IN (SELECT id FROM delta.packages);"
+	"CREATE TABLE delta.categories AS "
+		"SELECT package_id, name FROM pkg_categories, categories "
+		"WHERE category_id = id "
+		"AND package_id IN (SELECT id FROM delta.packages);"
+	"CREATE TABLE delta.licenses AS "
+		"SELECT package_id, name FROM pkg_licenses, licenses "
+		"WHERE license_id = id "
+		"AND package_id IN (SELECT id FROM delta.packages);"
+	"CREATE TABLE delta.shlibs AS "
+		"SELECT package_id, name FROM pkg_shlibs, shlibs "
+		"WHERE shlib_id = id "
+		"AND package_id IN (SELECT id FROM delta.packages);"
+	"CREATE TABLE delta.removed AS "
+		"SELECT origin FROM pkg_removed WHERE serial = %lld;"
+	"DETACH delta;";
+
+static int
+pack_delta(char *path, char *repo_path, pem_password_cb *password_cb,
+    char *rsa_key_path, int64_t keep, int64_t *epoch, int64_t *serial)
+{
+	char delta_path[MAXPATHLEN + 1];
+	char delta_archive[MAXPATHLEN + 1];
+	sqlite3 *sqlite = NULL;
+	sqlite3_stmt *stmt = NULL;
+	struct packing *pack;
+	unsigned char *sigret = NULL;
+	unsigned int siglen = 0;
+	int retcode = EPKG_FATAL;
+	int ret;
+
+	*serial = -1;
+
+	sqlite3_initialize();
+	if (sqlite3_open(repo_path, &sqlite) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		goto cleanup;
+	}
+
+	if (sqlite3_prepare_v2(sqlite, "SELECT epoch, serial FROM repo_meta",
+	    -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		goto cleanup;
+	}
+	ret = sqlite3_step(stmt);
+	if (ret == SQLITE_ROW) {
+		*epoch = sqlite3_column_int64(stmt, 0);
+		*serial = sqlite3_column_int64(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+	if (ret != SQLITE_ROW) {
+		ERROR_SQLITE(sqlite);
+		goto cleanup;
+	}
+
+	/*
+	 * Serial 0 is the whole catalogue, and a run which changed
+	 * nothing keeps the serial of the previous one.
+	 */
+	snprintf(delta_archive, sizeof(delta_archive), "%s/deltas/%lld-%lld.txz",
+	    path, (long long)*epoch, (long long)*serial);
+	if (keep <= 0 || *serial == 0 || access(delta_archive, F_OK) == 0) {
+		retcode = EPKG_OK;
+		goto cleanup;
+	}
+
+	snprintf(delta_path, sizeof(delta_path), "%s/deltas", path);
+	if (mkdirs(delta_path) != EPKG_OK)
+		goto cleanup;
+
+	snprintf(delta_path, sizeof(delta_path), "%s/deltas/delta.sqlite",
+	    path);
+	unlink(delta_path);
+	if (sql_exec(sqlite, delta_sql, delta_path, (long long)*serial,
+	    (long long)*serial) != EPKG_OK)
+		goto cleanup;
+
+	/* packing_init() adds the extension */
+	snprintf(delta_archive, sizeof(delta_archive), "%s/deltas/%lld-%lld",
+	    path, (long long)*epoch, (long long)*serial);
+	if (packing_init(&pack, delta_archive, TXZ) != EPKG_OK)
+		goto cleanup;
+	if (rsa_key_path != NULL) {
+		if (rsa_sign(delta_path, password_cb, rsa_key_path, &sigret,
+		    &siglen) != EPKG_OK) {
+			packing_finish(pack);
+			unlink(delta_path);
+			goto cleanup;
+		}
+		packing_append_buffer(pack, sigret, "signature", siglen + 1);
+		free(sigret);
+	}
+	packing_append_file_attr(pack, delta_path, "delta.sqlite",
+	    "root", "wheel", 0644);
+	unlink(delta_path);
+	packing_finish(pack);
+
+	retcode = EPKG_OK;
+
+	cleanup:
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+	sqlite3_shutdown();
+
+	return (retcode);
+}
+
+/*
+ * deltas/serial tells pkg update the epoch, the current serial and the
+ * first changeset still available, so that it knows at once whether
+ * anything changed.  It is only written once repo.txz is in place, and
+ * the older changesets are removed afterwards.  Without REPO_DELTAS,
+ * whatever an earlier run published is removed.
+ */
+static int
+publish_deltas(char *path, int64_t epoch, int64_t serial, int64_t keep)
+{
+	char dir[MAXPATHLEN + 1];
+	char file[MAXPATHLEN + 1];
+	char tmp[MAXPATHLEN + 1];
+	DIR *d;
+	struct dirent *dp;
+	FILE *fp;
+	long long e, s;
+	int64_t first;
+
+	first = serial - keep + 1;
+	if (first < 1)
+		first = 1;
+
+	snprintf(dir, sizeof(dir), "%s/deltas", path);
+	snprintf(file, sizeof(file), "%s/serial", dir);
+	snprintf(tmp, sizeof(tmp), "%s/serial.new", dir);
+
+	if (keep <= 0) {
+		if ((d = opendir(dir)) == NULL)
+			return (EPKG_OK);
+		while ((dp = readdir(d)) != NULL) {
+			if (strcmp(dp->d_name, "serial") != 0 &&
+			    sscanf(dp->d_name, "%lld-%lld.txz", &e, &s) != 2)
+				continue;
+			snprintf(file, sizeof(file), "%s/%s", dir, dp->d_name);
+			unlink(file);
+		}
+		closedir(d);
+		rmdir(dir);
+		return (EPKG_OK);
+	}
+
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		pkg_emit_errno("fopen", tmp);
+		return (EPKG_FATAL);
+	}
+	fprintf(fp, "%lld %lld %lld\n", (long long)epoch, (long long)serial,
+	    (long long)first);
+	if (fclose(fp) != 0 || rename(tmp, file) != 0) {
+		pkg_emit_errno("rename", file);
+		unlink(tmp);
+		return (EPKG_FATAL);
+	}
+
+	if ((d = opendir(dir)) == NULL) {
+		pkg_emit_errno("opendir", dir);
+		return (EPKG_FATAL);
+	}
+	while ((dp = readdir(d)) != NULL) {
+		if (sscanf(dp->d_name, "%lld-%lld.txz", &e, &s) != 2)
+			continue;
+		if (e == epoch && s >= first)
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", dir, dp->d_name);
+		unlink(file);
+	}
+	closedir(d);
+
+	return (EPKG_OK);
+}
+
 int
 pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path)
+{
+	return (pkg_finish_repo_timed(path, password_cb, rsa_key_path, NULL));
+}
+
+int
+pkg_finish_repo_timed(char *path, pem_password_cb *password_cb,
+    char *rsa_key_path, struct repo_timings *timings)
 {
 	char repo_path[MAXPATHLEN + 1];
 	char repo_archive[MAXPATHLEN + 1];
 	struct packing *pack;
 	unsigned char *sigret = NULL;
 	unsigned int siglen = 0;
+	uint64_t t = 0;
+	int64_t deltas = 0;
+	int64_t epoch = 0;
+	int64_t serial = 0;
 	
 	if (!is_dir(path)) {
 	    pkg_emit_error("%s is not a directory", path);
@@ -942,21 +1911,36 @@ pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path)
 	snprintf(repo_path, sizeof(repo_path), "%s/repo.sqlite", path);
 	snprintf(repo_archive, sizeof(repo_archive), "%s/repo", path);
 
+	pkg_config_int64(PKG_CONFIG_REPO_DELTAS, &deltas);
+	if (deltas < 0)
+		deltas = 0;
+	if (pack_delta(path, repo_path, password_cb, rsa_key_path, deltas,
+	    &epoch, &serial) != EPKG_OK)
+		return (EPKG_FATAL);
+
 	packing_init(&pack, repo_archive, TXZ);
 	if (rsa_key_path != NULL) {
+		if (timings != NULL)
+			t = repo_now();
 		rsa_sign(repo_path, password_cb, rsa_key_path, &sigret,
 				&siglen);
+		if (timings != NULL)
+			timings->sign += repo_now() - t;
 
 		packing_append_buffer(pack, sigret, "signature", siglen + 1);
 
 		free(sigret);
 	}
+	if (timings != NULL)
+		t = repo_now();
 	packing_append_file_attr(pack, repo_path, "repo.sqlite",
 	    "root", "wheel", 0644);
 	unlink(repo_path);
 	packing_finish(pack);
+	if (timings != NULL)
+		timings->compress += repo_now() - t;
 
-	return (EPKG_OK);
+	return (publish_deltas(path, epoch, serial, deltas));
 }
 
 int
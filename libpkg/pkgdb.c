@@ -34,6 +34,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
 #include <grp.h>
 #include <libutil.h>
@@ -41,6 +42,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
 
@@ -51,13 +54,16 @@
 #include "private/utils.h"
 
 #include "private/db_upgrades.h"
-#define DBVERSION 12
+#define DBVERSION 13
 
 #define PKGGT	1<<1
 #define PKGLT	1<<2
 #define PKGEQ	1<<3
 
 static struct pkgdb_it * pkgdb_it_new(struct pkgdb *, sqlite3_stmt *, int);
+static sqlite3_stmt *pkgdb_stmt_get(struct pkgdb *, const char *);
+static void pkgdb_stmt_put(struct pkgdb *, sqlite3_stmt *);
+static void pkgdb_stmt_flush(struct pkgdb *);
 static void pkgdb_regex(sqlite3_context *, int, sqlite3_value **, int);
 static void pkgdb_regex_basic(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_regex_extended(sqlite3_context *, int, sqlite3_value **);
@@ -112,7 +118,7 @@ static struct column_mapping {
 };
 
 static int
-load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags,
+load_val(struct pkgdb *db, struct pkg *pkg, const char *sql, int flags,
     int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
 {
 	sqlite3_stmt *stmt;
@@ -123,10 +129,8 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags,
 	if (pkg->flags & flags)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -134,12 +138,12 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags,
 		pkg_adddata(pkg, sqlite3_column_text(stmt, 0));
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db);
+		ERROR_SQLITE(db->sqlite);
 		return (EPKG_FATAL);
 	}
 
@@ -316,6 +320,86 @@ pkgdb_myarch(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 	sqlite3_result_text(ctx, arch, strlen(arch), NULL);
 }
 
+/*
+ * The files are stored as a name in one of the file_dirs, and their
+ * checksum as a blob.  file_dir() and file_name() split a path, the
+ * directory keeping its trailing /, and sha256_blob() packs a checksum.
+ */
+static void
+pkgdb_file_dir(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *path, *slash;
+
+	if (argc != 1 ||
+	    (path = (const char *)sqlite3_value_text(argv[0])) == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	if ((slash = strrchr(path, '/')) == NULL)
+		sqlite3_result_text(ctx, "", 0, SQLITE_STATIC);
+	else
+		sqlite3_result_text(ctx, path, slash - path + 1,
+		    SQLITE_TRANSIENT);
+}
+
+static void
+pkgdb_file_name(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *path, *slash;
+
+	if (argc != 1 ||
+	    (path = (const char *)sqlite3_value_text(argv[0])) == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	if ((slash = strrchr(path, '/')) != NULL)
+		path = slash + 1;
+	sqlite3_result_text(ctx, path, -1, SQLITE_TRANSIENT);
+}
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+
+	return (-1);
+}
+
+static void
+pkgdb_sha256_blob(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	unsigned char blob[SHA256_DIGEST_LENGTH];
+	const char *sum;
+	int i, hi, lo;
+
+	if (argc != 1 ||
+	    (sum = (const char *)sqlite3_value_text(argv[0])) == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	/* what is not a checksum as sha256_str() writes it is kept as is */
+	if (strlen(sum) != SHA256_DIGEST_LENGTH * 2) {
+		sqlite3_result_value(ctx, argv[0]);
+		return;
+	}
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		if ((hi = hexval(sum[2 * i])) < 0 ||
+		    (lo = hexval(sum[2 * i + 1])) < 0) {
+			sqlite3_result_value(ctx, argv[0]);
+			return;
+		}
+		blob[i] = hi << 4 | lo;
+	}
+
+	sqlite3_result_blob(ctx, blob, sizeof(blob), SQLITE_TRANSIENT);
+}
+
 static void
 pkgdb_pkgcmp(sqlite3_context *ctx, int argc, sqlite3_value **argv, int sign)
 {
@@ -505,12 +589,6 @@ pkgdb_init(sqlite3 *sdb)
 			" ON UPDATE CASCADE,"
 		"PRIMARY KEY (package_id,origin)"
 	");"
-	"CREATE TABLE files ("
-		"path TEXT PRIMARY KEY,"
-		"sha256 TEXT,"
-		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
-			" ON UPDATE CASCADE"
-	");"
 	"CREATE TABLE directories ("
 		"id INTEGER PRIMARY KEY,"
 		"path TEXT NOT NULL UNIQUE"
@@ -523,6 +601,26 @@ pkgdb_init(sqlite3 *sdb)
 		"try INTEGER,"
 		"PRIMARY KEY (package_id, directory_id)"
 	");"
+	"CREATE TABLE file_dirs ("
+		"id INTEGER PRIMARY KEY,"
+		"path TEXT NOT NULL UNIQUE"
+	");"
+	"CREATE TABLE pkg_files ("
+		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
+			" ON UPDATE CASCADE,"
+		"directory_id INTEGER REFERENCES file_dirs(id) ON DELETE RESTRICT"
+			" ON UPDATE RESTRICT,"
+		"name TEXT NOT NULL,"
+		"sha256 BLOB,"
+		"PRIMARY KEY (directory_id, name)"
+	");"
+	"CREATE VIEW files AS "
+		"SELECT d.path || f.name AS path, "
+		"CASE typeof(f.sha256) WHEN 'blob' THEN lower(hex(f.sha256)) "
+			"ELSE f.sha256 END AS sha256, "
+		"f.package_id AS package_id "
+		"FROM pkg_files AS f, file_dirs AS d "
+		"WHERE d.id = f.directory_id;"
 	"CREATE TABLE categories ("
 		"id INTEGER PRIMARY KEY,"
 		"name TEXT NOT NULL UNIQUE"
@@ -585,7 +683,7 @@ pkgdb_init(sqlite3 *sdb)
 	"CREATE INDEX scripts_package_id ON scripts (package_id);"
 	"CREATE INDEX options_package_id ON options (package_id);"
 	"CREATE INDEX deps_package_id ON deps (package_id);"
-	"CREATE INDEX files_package_id ON files (package_id);"
+	"CREATE INDEX pkg_files_package_id ON pkg_files (package_id);"
 	"CREATE INDEX pkg_directories_package_id ON pkg_directories (package_id);"
 	"CREATE INDEX pkg_categories_package_id ON pkg_categories (package_id);"
 	"CREATE INDEX pkg_licenses_package_id ON pkg_licenses (package_id);"
@@ -703,8 +801,117 @@ pkgdb_open_multirepos(const char *dbdir, struct pkgdb *db)
 	return (EPKG_OK);
 }
 
-int
-pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
+/*
+ * The journal and the page cache of the database, as set by DB_WAL,
+ * DB_WAL_CHECKPOINT and DB_CACHE_SIZE.
+ */
+static int
+pkgdb_tune(struct pkgdb *db, bool readonly)
+{
+	sqlite3_stmt *stmt;
+	const char *mode;
+	int64_t cachesize = 0, checkpoint = 1000;
+	bool wal = false, inwal = false;
+
+	pkg_config_int64(PKG_CONFIG_DB_CACHE_SIZE, &cachesize);
+	if (cachesize > 0 && sql_exec(db->sqlite,
+	    "PRAGMA cache_size = -%" PRId64 ";", cachesize) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	/* the journal mode is recorded in the database */
+	if (readonly)
+		return (EPKG_OK);
+
+	if (sqlite3_prepare_v2(db->sqlite, "PRAGMA journal_mode;", -1, &stmt,
+	    NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+	    (mode = (const char *)sqlite3_column_text(stmt, 0)) != NULL)
+		inwal = (strcasecmp(mode, "wal") == 0);
+	sqlite3_finalize(stmt);
+
+	pkg_config_bool(PKG_CONFIG_DB_WAL, &wal);
+	/*
+	 * Leaving the WAL mode fails while the database is read by another
+	 * process: it is then left to the next run.
+	 */
+	if (wal != inwal)
+		sqlite3_exec(db->sqlite, wal ? "PRAGMA journal_mode = WAL;" :
+		    "PRAGMA journal_mode = DELETE;", NULL, NULL, NULL);
+
+	if (wal) {
+		pkg_config_int64(PKG_CONFIG_DB_WAL_CHECKPOINT, &checkpoint);
+		if (sql_exec(db->sqlite, "PRAGMA wal_autocheckpoint = %" PRId64
+		    ";", checkpoint) != EPKG_OK)
+			return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/* whether the header of the database at `path' says it is in WAL mode */
+static bool
+pkgdb_is_wal(const char *path)
+{
+	unsigned char hdr[20];
+	bool wal = false;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (false);
+	if (read(fd, hdr, sizeof(hdr)) == sizeof(hdr))
+		wal = (hdr[18] == 2 && hdr[19] == 2);
+	close(fd);
+
+	return (wal);
+}
+
+/*
+ * Check that the database opened for reading only can be used as is.
+ * EPKG_WARN is returned when it is outdated but may be opened for
+ * writing, to be upgraded.
+ */
+static int
+pkgdb_check_readonly(sqlite3 *s, const char *path, const char *dbdir)
+{
+	sqlite3_stmt *stmt;
+	int64_t version = -1;
+	int ret;
+
+	if ((ret = sqlite3_prepare_v2(s, "PRAGMA user_version;", -1, &stmt,
+	    NULL)) == SQLITE_OK) {
+		if ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+			version = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
+	if (ret != SQLITE_ROW) {
+		/* the sqlite we bundle cannot read a WAL without its -shm */
+		if (pkgdb_is_wal(path) && eaccess(dbdir, W_OK) != 0)
+			pkg_emit_error("%s uses write-ahead logging (DB_WAL) "
+			    "and cannot be read without write access to %s",
+			    path, dbdir);
+		else
+			ERROR_SQLITE(s);
+		return (EPKG_FATAL);
+	}
+
+	if (version >= DBVERSION)
+		return (EPKG_OK);
+
+	if (eaccess(path, W_OK) != 0) {
+		pkg_emit_error("%s is outdated, it is upgraded by the next "
+		    "pkg command run with write access to it", path);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_WARN);
+}
+
+static int
+pkgdb_open2(struct pkgdb **db_p, pkgdb_t type, bool readonly)
 {
 	struct pkgdb *db = NULL;
 	bool reopen = false;
@@ -739,7 +946,7 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 		snprintf(localpath, sizeof(localpath), "%s/local.sqlite", dbdir);
 
 		if (eaccess(localpath, R_OK) != 0) {
-			if (errno != ENOENT) {
+			if (errno != ENOENT || readonly) {
 				pkg_emit_nolocaldb();
 				pkgdb_close(db);
 				return (EPKG_ENODB);
@@ -757,14 +964,35 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 		}
 
 		sqlite3_initialize();
-		if (sqlite3_open(localpath, &db->sqlite) != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			pkgdb_close(db);
-			return (EPKG_FATAL);
-		}
+		for (;;) {
+			if (sqlite3_open_v2(localpath, &db->sqlite, readonly ?
+			    SQLITE_OPEN_READONLY :
+			    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			    NULL) != SQLITE_OK) {
+				ERROR_SQLITE(db->sqlite);
+				pkgdb_close(db);
+				return (EPKG_FATAL);
+			}
+
+			/* Wait up to 5 seconds if database is busy */
+			sqlite3_busy_timeout(db->sqlite, 5000);
+
+			if (!readonly)
+				break;
+			ret = pkgdb_check_readonly(db->sqlite, localpath,
+			    dbdir);
+			if (ret == EPKG_OK)
+				break;
+			if (ret != EPKG_WARN) {
+				pkgdb_close(db);
+				return (EPKG_FATAL);
+			}
 
-		/* Wait up to 5 seconds if database is busy */
-		sqlite3_busy_timeout(db->sqlite, 5000);
+			/* outdated: reopen it for writing to upgrade it */
+			sqlite3_close(db->sqlite);
+			db->sqlite = NULL;
+			readonly = false;
+		}
 
 		/* If the database is missing we have to initialize it */
 		if (create == true)
@@ -776,7 +1004,8 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 		/* Create our functions */
 		sqlcmd_init(db->sqlite, NULL, NULL);
 
-		if (pkgdb_upgrade(db) != EPKG_OK) {
+		if (pkgdb_upgrade(db) != EPKG_OK ||
+		    pkgdb_tune(db, readonly) != EPKG_OK) {
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
@@ -790,6 +1019,13 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
+
+		/* no point in syncing the database if the files are not */
+		if (pkg_sync_policy() == SYNC_NONE && sql_exec(db->sqlite,
+		    "PRAGMA synchronous = OFF;") != EPKG_OK) {
+			pkgdb_close(db);
+			return (EPKG_FATAL);
+		}
 	}
 
 	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
@@ -829,6 +1065,18 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	return (EPKG_OK);
 }
 
+int
+pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
+{
+	return (pkgdb_open2(db_p, type, false));
+}
+
+int
+pkgdb_open_readonly(struct pkgdb **db_p, pkgdb_t type)
+{
+	return (pkgdb_open2(db_p, type, true));
+}
+
 void
 pkgdb_close(struct pkgdb *db)
 {
@@ -838,6 +1086,9 @@ pkgdb_close(struct pkgdb *db)
 	if (db->prstmt_initialized)
 		prstmt_finalize(db);
 
+	pkg_conflicts_free(db->conflicts);
+	pkgdb_stmt_flush(db);
+
 	if (db->sqlite != NULL) {
 		assert(db->lock_count == 0);
 		if (db->type == PKGDB_REMOTE) {
@@ -851,6 +1102,124 @@ pkgdb_close(struct pkgdb *db)
 	free(db);
 }
 
+/*
+ * The statements of the queries are kept prepared, up to STMT_CACHE of
+ * them, keyed by their SQL; the least recently used one is finalized
+ * to make room.  A statement taken with pkgdb_stmt_get() is not handed
+ * out again until it is given back with pkgdb_stmt_put().
+ */
+#define STMT_CACHE 32
+
+struct pkgdb_stmt {
+	char *sql;
+	sqlite3_stmt *stmt;
+	int64_t used;		/* tick of the last use */
+	bool busy;
+};
+
+static sqlite3_stmt *
+pkgdb_stmt_get(struct pkgdb *db, const char *sql)
+{
+	struct pkgdb_stmt *s, *victim = NULL;
+	sqlite3_stmt *stmt;
+	size_t i;
+
+	if (db->stmts == NULL &&
+	    (db->stmts = calloc(STMT_CACHE, sizeof(struct pkgdb_stmt))) ==
+	    NULL) {
+		pkg_emit_errno("calloc", "pkgdb_stmt");
+		return (NULL);
+	}
+
+	for (i = 0; i < STMT_CACHE; i++) {
+		s = &db->stmts[i];
+		if (s->sql == NULL) {
+			if (victim == NULL || victim->sql != NULL)
+				victim = s;
+			continue;
+		}
+		if (s->busy)
+			continue;
+		if (strcmp(s->sql, sql) == 0) {
+			s->busy = true;
+			s->used = ++db->stmt_tick;
+			db->stmt_hits++;
+			return (s->stmt);
+		}
+		if (victim == NULL ||
+		    (victim->sql != NULL && s->used < victim->used))
+			victim = s;
+	}
+
+	db->stmt_misses++;
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (NULL);
+	}
+
+	/* all of them are in use: this one is finalized once given back */
+	if (victim == NULL)
+		return (stmt);
+
+	if (victim->sql != NULL) {
+		sqlite3_finalize(victim->stmt);
+		free(victim->sql);
+	}
+	if ((victim->sql = strdup(sql)) == NULL) {
+		victim->stmt = NULL;
+		return (stmt);
+	}
+	victim->stmt = stmt;
+	victim->busy = true;
+	victim->used = ++db->stmt_tick;
+
+	return (stmt);
+}
+
+static void
+pkgdb_stmt_put(struct pkgdb *db, sqlite3_stmt *stmt)
+{
+	size_t i;
+
+	for (i = 0; db->stmts != NULL && i < STMT_CACHE; i++) {
+		if (db->stmts[i].stmt == stmt && db->stmts[i].busy) {
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			db->stmts[i].busy = false;
+			return;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+static void
+pkgdb_stmt_flush(struct pkgdb *db)
+{
+	size_t i;
+
+	if (db->stmts == NULL)
+		return;
+
+	for (i = 0; i < STMT_CACHE; i++) {
+		if (db->stmts[i].sql == NULL)
+			continue;
+		sqlite3_finalize(db->stmts[i].stmt);
+		free(db->stmts[i].sql);
+	}
+	free(db->stmts);
+	db->stmts = NULL;
+}
+
+void
+pkgdb_stmt_stats(struct pkgdb *db, int64_t *hits, int64_t *misses)
+{
+	assert(db != NULL);
+
+	*hits = db->stmt_hits;
+	*misses = db->stmt_misses;
+}
+
 static struct pkgdb_it *
 pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type)
 {
@@ -860,13 +1229,16 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type)
 
 	if ((it = malloc(sizeof(struct pkgdb_it))) == NULL) {
 		pkg_emit_errno("malloc", "pkgdb_it");
-		sqlite3_finalize(s);
+		pkgdb_stmt_put(db, s);
 		return (NULL);
 	}
 
 	it->db = db;
 	it->stmt = s;
 	it->type = type;
+	it->count = 0;
+	it->all = false;
+	it->bulk = NULL;
 	return (it);
 }
 
@@ -889,10 +1261,253 @@ static struct load_on_flag {
 	{ -1, NULL }
 };
 
+/*
+ * Past BULK_THRESHOLD packages, an iterator over all the installed
+ * packages loads each relation at once, with one query ordered by
+ * package id, instead of one query per package.  The rows are then
+ * stitched into the packages as they are returned.  The iterators
+ * over a selection keep loading them per package: the queries would
+ * read the relations of every package.
+ */
+#define BULK_THRESHOLD 64
+
+static struct bulk_load {
+	int flag;
+	int ncols;	/* after the package id */
+	const char *sql;
+} bulk_load[] = {
+	{ PKG_LOAD_DEPS, 3,
+		"SELECT package_id, name, origin, version "
+		"FROM main.deps ORDER BY package_id;" },
+	{ PKG_LOAD_RDEPS, 3,
+		"SELECT q.id, p.name, p.origin, p.version "
+		"FROM main.packages AS q, main.deps AS d, main.packages AS p "
+		"WHERE d.origin = q.origin AND p.id = d.package_id "
+		"ORDER BY q.id;" },
+	{ PKG_LOAD_FILES, 2,
+		"SELECT f.package_id, d.path || f.name AS path, "
+		"CASE typeof(f.sha256) WHEN 'blob' THEN lower(hex(f.sha256)) "
+			"ELSE f.sha256 END "
+		"FROM main.pkg_files AS f, main.file_dirs AS d "
+		"WHERE d.id = f.directory_id "
+		"ORDER BY f.package_id, path ASC;" },
+	{ PKG_LOAD_DIRS, 2,
+		"SELECT package_id, path, try "
+		"FROM main.pkg_directories, main.directories "
+		"WHERE directory_id = directories.id "
+		"ORDER BY package_id, path DESC;" },
+	{ PKG_LOAD_SCRIPTS, 2,
+		"SELECT package_id, script, type "
+		"FROM main.scripts ORDER BY package_id;" },
+	{ PKG_LOAD_OPTIONS, 2,
+		"SELECT package_id, option, value "
+		"FROM main.options ORDER BY package_id;" },
+	{ PKG_LOAD_CATEGORIES, 1,
+		"SELECT package_id, name "
+		"FROM main.pkg_categories, main.categories AS c "
+		"WHERE category_id = c.id ORDER BY package_id, name DESC;" },
+	{ PKG_LOAD_LICENSES, 1,
+		"SELECT package_id, name "
+		"FROM main.pkg_licenses, main.licenses AS l "
+		"WHERE license_id = l.id ORDER BY package_id, name DESC;" },
+	{ PKG_LOAD_USERS, 1,
+		"SELECT package_id, users.name "
+		"FROM main.pkg_users, main.users "
+		"WHERE user_id = users.id ORDER BY package_id, name DESC;" },
+	{ PKG_LOAD_GROUPS, 1,
+		"SELECT package_id, groups.name "
+		"FROM main.pkg_groups, main.groups "
+		"WHERE group_id = groups.id ORDER BY package_id, name DESC;" },
+	{ PKG_LOAD_SHLIBS, 1,
+		"SELECT package_id, name "
+		"FROM main.pkg_shlibs, main.shlibs AS s "
+		"WHERE shlib_id = s.id ORDER BY package_id, name DESC;" },
+};
+
+#define BULK_LOADS (sizeof(bulk_load) / sizeof(bulk_load[0]))
+
+struct bulk_rows {
+	int64_t *ids;		/* sorted */
+	size_t *vals;		/* offsets in data, (size_t)-1 for NULL */
+	size_t num;
+	size_t cap;
+	struct sbuf *data;	/* NULL until loaded */
+};
+
+static void
+bulk_free(struct bulk_rows *r)
+{
+	free(r->ids);
+	free(r->vals);
+	if (r->data != NULL)
+		sbuf_delete(r->data);
+	memset(r, 0, sizeof(struct bulk_rows));
+}
+
+static int
+bulk_fetch(struct pkgdb *db, struct bulk_load *l, struct bulk_rows *r)
+{
+	sqlite3_stmt *stmt;
+	const char *val;
+	size_t *v;
+	int i, ret;
+
+	if ((stmt = pkgdb_stmt_get(db, l->sql)) == NULL)
+		return (EPKG_FATAL);
+
+	r->data = sbuf_new_auto();
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (r->num >= r->cap) {
+			r->cap |= 1;
+			r->cap *= 2;
+			r->ids = reallocf(r->ids, r->cap * sizeof(int64_t));
+			r->vals = reallocf(r->vals,
+			    r->cap * l->ncols * sizeof(size_t));
+			if (r->ids == NULL || r->vals == NULL) {
+				pkg_emit_errno("realloc", "bulk_rows");
+				pkgdb_stmt_put(db, stmt);
+				bulk_free(r);
+				return (EPKG_FATAL);
+			}
+		}
+		r->ids[r->num] = sqlite3_column_int64(stmt, 0);
+		v = &r->vals[r->num * l->ncols];
+		for (i = 0; i < l->ncols; i++) {
+			val = (const char *)sqlite3_column_text(stmt, i + 1);
+			if (val == NULL) {
+				v[i] = (size_t)-1;
+				continue;
+			}
+			v[i] = sbuf_len(r->data);
+			sbuf_bcat(r->data, val, strlen(val) + 1);
+		}
+		r->num++;
+	}
+	pkgdb_stmt_put(db, stmt);
+
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		bulk_free(r);
+		return (EPKG_FATAL);
+	}
+	sbuf_finish(r->data);
+
+	return (EPKG_OK);
+}
+
+static void
+load_group_gidstr(struct pkg *pkg)
+{
+	struct pkg_group *g = NULL;
+	struct group * grp = NULL;
+
+	while (pkg_groups(pkg, &g) == EPKG_OK) {
+		grp = getgrnam(pkg_group_name(g));
+		if (grp == NULL)
+			continue;
+		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
+	}
+}
+
+static void
+bulk_stitch(struct bulk_load *l, struct bulk_rows *r, struct pkg *pkg)
+{
+	const char *data = sbuf_data(r->data);
+	const char *v[3];
+	size_t lo = 0, hi = r->num, mid, off;
+	int i;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (r->ids[mid] < pkg->rowid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < r->num && r->ids[lo] == pkg->rowid; lo++) {
+		for (i = 0; i < l->ncols; i++) {
+			off = r->vals[lo * l->ncols + i];
+			v[i] = (off == (size_t)-1) ? NULL : data + off;
+		}
+
+		switch (l->flag) {
+		case PKG_LOAD_DEPS:
+			pkg_adddep(pkg, v[0], v[1], v[2]);
+			break;
+		case PKG_LOAD_RDEPS:
+			pkg_addrdep(pkg, v[0], v[1], v[2]);
+			break;
+		case PKG_LOAD_FILES:
+			pkg_addfile(pkg, v[0], v[1], false);
+			break;
+		case PKG_LOAD_DIRS:
+			pkg_adddir(pkg, v[0], v[1] != NULL && atoi(v[1]));
+			break;
+		case PKG_LOAD_SCRIPTS:
+			pkg_addscript(pkg, v[0], v[1] != NULL ? atoi(v[1]) : 0);
+			break;
+		case PKG_LOAD_OPTIONS:
+			pkg_addoption(pkg, v[0], v[1]);
+			break;
+		case PKG_LOAD_CATEGORIES:
+			pkg_addcategory(pkg, v[0]);
+			break;
+		case PKG_LOAD_LICENSES:
+			pkg_addlicense(pkg, v[0]);
+			break;
+		case PKG_LOAD_USERS:
+			pkg_adduser(pkg, v[0]);
+			break;
+		case PKG_LOAD_GROUPS:
+			pkg_addgroup(pkg, v[0]);
+			break;
+		case PKG_LOAD_SHLIBS:
+			pkg_addshlib(pkg, v[0]);
+			break;
+		}
+	}
+
+	if (l->flag == PKG_LOAD_GROUPS)
+		load_group_gidstr(pkg);
+
+	pkg->flags |= l->flag;
+}
+
+/* EPKG_END if the relation `flag' is not loaded in bulk */
+static int
+pkgdb_it_bulk(struct pkgdb_it *it, struct pkg *pkg, int flag)
+{
+	size_t i;
+
+	if (it->bulk == NULL &&
+	    (it->bulk = calloc(BULK_LOADS, sizeof(struct bulk_rows))) == NULL) {
+		pkg_emit_errno("calloc", "bulk_rows");
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < BULK_LOADS; i++) {
+		if (bulk_load[i].flag != flag)
+			continue;
+
+		if (it->bulk[i].data == NULL &&
+		    bulk_fetch(it->db, &bulk_load[i], &it->bulk[i]) != EPKG_OK)
+			return (EPKG_FATAL);
+
+		if ((pkg->flags & flag) == 0)
+			bulk_stitch(&bulk_load[i], &it->bulk[i], pkg);
+
+		return (EPKG_OK);
+	}
+
+	return (EPKG_END);
+}
+
 int
 pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 {
 	struct pkg *pkg;
+	bool bulk;
 	int i;
 	int ret;
 
@@ -908,9 +1523,17 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 
 		populate_pkg(it->stmt, pkg);
 
+		bulk = (it->type == PKG_INSTALLED && it->all &&
+		    ++it->count > BULK_THRESHOLD);
+
 		for (i = 0; load_on_flag[i].load != NULL; i++) {
 			if (flags & load_on_flag[i].flag) {
-				ret = load_on_flag[i].load(it->db, pkg);
+				ret = EPKG_END;
+				if (bulk)
+					ret = pkgdb_it_bulk(it, pkg,
+					    load_on_flag[i].flag);
+				if (ret == EPKG_END)
+					ret = load_on_flag[i].load(it->db, pkg);
 				if (ret != EPKG_OK)
 					return (ret);
 			}
@@ -928,6 +1551,8 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 void
 pkgdb_it_free(struct pkgdb_it *it)
 {
+	size_t i;
+
 	if (it == NULL)
 		return;
 
@@ -937,7 +1562,13 @@ pkgdb_it_free(struct pkgdb_it *it)
 			"DROP TABLE IF EXISTS pkgjobs");
 	}
 
-	sqlite3_finalize(it->stmt);
+	if (it->bulk != NULL) {
+		for (i = 0; i < BULK_LOADS; i++)
+			bulk_free(&it->bulk[i]);
+		free(it->bulk);
+	}
+
+	pkgdb_stmt_put(it->db, it->stmt);
 	free(it);
 }
 
@@ -1025,6 +1656,7 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 {
 	char sql[BUFSIZ];
 	sqlite3_stmt *stmt;
+	struct pkgdb_it *it;
 	const char *comp = NULL;
 
 	assert(db != NULL);
@@ -1040,15 +1672,16 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 			"FROM packages AS p%s "
 			"ORDER BY p.name;", comp);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (NULL);
-	}
 
 	if (match != MATCH_ALL && match != MATCH_CONDITION)
 		sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
 
-	return (pkgdb_it_new(db, stmt, PKG_INSTALLED));
+	if ((it = pkgdb_it_new(db, stmt, PKG_INSTALLED)) != NULL)
+		it->all = (match == MATCH_ALL);
+
+	return (it);
 }
 
 struct pkgdb_it *
@@ -1059,16 +1692,16 @@ pkgdb_query_which(struct pkgdb *db, const char *path)
 		"SELECT p.id, p.origin, p.name, p.version, p.comment, p.desc, "
 			"p.message, p.arch, p.maintainer, p.www, "
 			"p.prefix, p.flatsize, p.time, p.infos "
-			"FROM packages AS p, files AS f "
+			"FROM packages AS p, pkg_files AS f, file_dirs AS d "
 			"WHERE p.id = f.package_id "
-				"AND f.path = ?1;";
+				"AND f.directory_id = d.id "
+				"AND d.path = file_dir(?1) "
+				"AND f.name = file_name(?1);";
 
 	assert(db != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (NULL);
-	}
 
 	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
 
@@ -1090,10 +1723,8 @@ pkgdb_query_shlib(struct pkgdb *db, const char *shlib)
 
 	assert(db != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (NULL);
-	}
 
 	sqlite3_bind_text(stmt, 1, shlib, -1, SQLITE_TRANSIENT);
 
@@ -1112,10 +1743,8 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 
 	assert(db != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_TRANSIENT);
 
@@ -1124,7 +1753,7 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 	if (ret == SQLITE_ROW)
 		*res = sqlite3_column_int64(stmt, 0);
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_ROW) {
 		ERROR_SQLITE(db->sqlite);
@@ -1160,10 +1789,8 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main");
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1171,7 +1798,7 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 		pkg_adddep(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_text(stmt, 1), sqlite3_column_text(stmt, 2));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DEPS);
@@ -1209,10 +1836,8 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ORIGIN, &origin);
 	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
@@ -1221,7 +1846,7 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 		pkg_addrdep(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_text(stmt, 1), sqlite3_column_text(stmt, 2));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_RDEPS);
@@ -1250,10 +1875,8 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_FILES)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1261,7 +1884,7 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 		pkg_addfile(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_text(stmt, 1), false);
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_FILES);
@@ -1291,10 +1914,8 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_DIRS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1303,7 +1924,7 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		    sqlite3_column_int(stmt, 1));
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DIRS);
 		ERROR_SQLITE(db->sqlite);
@@ -1336,7 +1957,7 @@ pkgdb_load_license(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_LICENSES,
+	return (load_val(db, pkg, sql, PKG_LOAD_LICENSES,
 	    pkg_addlicense, PKG_LICENSES));
 }
 
@@ -1361,7 +1982,7 @@ pkgdb_load_category(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CATEGORIES,
+	return (load_val(db, pkg, sql, PKG_LOAD_CATEGORIES,
 	    pkg_addcategory, PKG_CATEGORIES));
 }
 
@@ -1382,7 +2003,7 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_USERS,
+	ret = load_val(db, pkg, sql, PKG_LOAD_USERS,
 	    pkg_adduser, PKG_USERS);
 
 	/* TODO get user uidstr from local database */
@@ -1399,8 +2020,6 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 int
 pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 {
-	struct pkg_group *g = NULL;
-	struct group * grp = NULL;
 	int ret;
 
 	const char sql[] = ""
@@ -1413,15 +2032,10 @@ pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_GROUPS,
+	ret = load_val(db, pkg, sql, PKG_LOAD_GROUPS,
 	    pkg_addgroup, PKG_GROUPS);
 
-	while (pkg_groups(pkg, &g) == EPKG_OK) {
-		grp = getgrnam(pkg_group_name(g));
-		if (grp == NULL)
-			continue;
-		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
-	}
+	load_group_gidstr(pkg);
 
 	return (ret);
 }
@@ -1447,7 +2061,7 @@ pkgdb_load_shlib(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_SHLIBS,
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS,
 	    pkg_addshlib, PKG_SHLIBS));
 }
 
@@ -1467,10 +2081,8 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_SCRIPTS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1478,7 +2090,7 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 		pkg_addscript(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_int(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
@@ -1514,10 +2126,8 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main");
 	}
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1525,7 +2135,7 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		pkg_addoption(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_put(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_OPTIONS);
@@ -1549,7 +2159,7 @@ pkgdb_load_mtree(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
+	return (load_val(db, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
 }
 
 typedef enum _sql_prstmt_index {
@@ -1557,7 +2167,8 @@ typedef enum _sql_prstmt_index {
 	PKG,
 	DEPS_UPDATE,
 	DEPS,
-	FILES,
+	FILES1,
+	FILES2,
 	DIRS1,
 	DIRS2,
 	CATEGORY1,
@@ -1602,10 +2213,17 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		"VALUES (?1, ?2, ?3, ?4)",
 		"TTTI",
 	},
-	[FILES] = {
+	[FILES1] = {
 		NULL,
-		"INSERT INTO files (path, sha256, package_id) "
-		"VALUES (?1, ?2, ?3)",
+		"INSERT OR IGNORE INTO file_dirs(path) VALUES(file_dir(?1))",
+		"T",
+	},
+	[FILES2] = {
+		NULL,
+		"INSERT INTO pkg_files (package_id, directory_id, name, sha256) "
+		"VALUES (?3, "
+		"(SELECT id FROM file_dirs WHERE path = file_dir(?1)), "
+		"file_name(?1), sha256_blob(?2))",
 		"TTI",
 	},
 	[DIRS1] = {
@@ -1871,7 +2489,11 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 		const char *pkg_path = pkg_file_path(file);
 		const char *pkg_sum = pkg_file_cksum(file);
 
-		ret = run_prstmt(FILES, pkg_path, pkg_sum, package_id);
+		if (run_prstmt(FILES1, pkg_path) != SQLITE_DONE) {
+			ERROR_SQLITE(s);
+			goto cleanup;
+		}
+		ret = run_prstmt(FILES2, pkg_path, pkg_sum, package_id);
 		if (ret == SQLITE_DONE)
 			continue;
 		if (ret != SQLITE_CONSTRAINT) {
@@ -2127,6 +2749,8 @@ pkgdb_unregister_pkg(struct pkgdb *db, const char *origin)
 	const char *deletions[] = {
 		"directories WHERE id NOT IN "
 			"(SELECT DISTINCT directory_id FROM pkg_directories)",
+		"file_dirs WHERE id NOT IN "
+			"(SELECT DISTINCT directory_id FROM pkg_files)",
 		"categories WHERE id NOT IN "
 			"(SELECT DISTINCT category_id FROM pkg_categories)",
 		"licenses WHERE id NOT IN "
@@ -2339,6 +2963,79 @@ pkgdb_detach_remotes(sqlite3 *s)
 	sbuf_delete(sql);
 }
 
+/*
+ * The cache index is attached as 'pkgcache' and diffed against the
+ * packages of all the attached repositories in a single query.
+ */
+struct pkgdb_it *
+pkgdb_cache_stale(struct pkgdb *db)
+{
+	sqlite3_stmt *stmt;
+	struct sbuf *paths = NULL;
+	struct sbuf *versions = NULL;
+	struct sbuf *sql = NULL;
+	char path[MAXPATHLEN + 1];
+	int ret;
+
+	assert(db != NULL && db->type == PKGDB_REMOTE);
+
+	if (pkg_cache_sync() != EPKG_OK ||
+	    pkg_cache_path(path, sizeof(path)) != EPKG_OK)
+		return (NULL);
+
+	/* before the index is attached, not to be taken for a repository */
+	paths = sbuf_new_auto();
+	versions = sbuf_new_auto();
+	if (sql_on_all_attached_db(db->sqlite, paths,
+	    "SELECT path FROM '%1$s'.packages", " UNION ALL ") != EPKG_OK ||
+	    sql_on_all_attached_db(db->sqlite, versions,
+	    "SELECT origin, version FROM '%1$s'.packages",
+	    " UNION ALL ") != EPKG_OK)
+		goto cleanup;
+	/* no repository at all */
+	if (sbuf_len(paths) == 0) {
+		sbuf_cat(paths, "SELECT NULL LIMIT 0");
+		sbuf_cat(versions, "SELECT NULL AS origin, NULL AS version LIMIT 0");
+	}
+	sbuf_finish(paths);
+	sbuf_finish(versions);
+
+	if (sql_exec(db->sqlite, "ATTACH '%q' AS 'pkgcache';", path) != EPKG_OK)
+		goto cleanup;
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql,
+	    "SELECT c.origin AS origin, c.repopath AS repopath, "
+		"c.cksum AS cksum, c.size AS pkgsize, "
+		"r.version AS newversion "
+	    "FROM pkgcache.packages AS c "
+	    "LEFT JOIN (%s) AS r ON r.origin = c.origin "
+	    "WHERE c.repopath NOT IN (%s) "
+	    "GROUP BY c.repopath ORDER BY c.repopath;",
+	    sbuf_data(versions), sbuf_data(paths));
+	sbuf_finish(sql);
+
+	ret = sqlite3_prepare_v2(db->sqlite, sbuf_data(sql), -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	sbuf_delete(paths);
+	sbuf_delete(versions);
+	sbuf_delete(sql);
+
+	return (pkgdb_it_new(db, stmt, PKG_REMOTE));
+
+	cleanup:
+	sbuf_delete(paths);
+	sbuf_delete(versions);
+	if (sql != NULL)
+		sbuf_delete(sql);
+
+	return (NULL);
+}
+
 int
 get_pragma(sqlite3 *s, const char *sql, int64_t *res)
 {
@@ -3175,77 +3872,107 @@ pkgdb_search(struct pkgdb *db, const char *pattern, match_t match,
 	return (pkgdb_it_new(db, stmt, PKG_REMOTE));
 }
 
+/*
+ * The files of the installed packages are loaded once, then the paths
+ * of each package to install are checked against them in memory.
+ */
+static int
+integrity_load(struct pkgdb *db)
+{
+	sqlite3_stmt *stmt;
+	struct conflict_owner *owner = NULL;
+	int64_t id;
+	int ret;
+	const char sql[] = ""
+		"SELECT p.id, p.origin, p.name, p.version, f.path "
+		"FROM main.packages AS p, main.files AS f "
+		"WHERE p.id = f.package_id ORDER BY p.id;";
+
+	if ((db->conflicts = pkg_conflicts_new()) == NULL)
+		return (EPKG_FATAL);
+
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		id = sqlite3_column_int64(stmt, 0);
+		if (owner == NULL || owner->id != id) {
+			owner = pkg_conflicts_owner(db->conflicts, id,
+			    (const char *)sqlite3_column_text(stmt, 1),
+			    (const char *)sqlite3_column_text(stmt, 2),
+			    (const char *)sqlite3_column_text(stmt, 3));
+			if (owner == NULL)
+				break;
+		}
+		if (pkg_conflicts_add(db->conflicts,
+		    (const char *)sqlite3_column_text(stmt, 4), owner) == NULL)
+			break;
+	}
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE) {
+		if (ret != SQLITE_ROW)
+			ERROR_SQLITE(db->sqlite);
+		pkg_conflicts_free(db->conflicts);
+		db->conflicts = NULL;
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
 int
 pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 {
 	int ret = EPKG_OK;
-
-	sqlite3_stmt *stmt = NULL;
-	sqlite3_stmt *stmt_conflicts = NULL;
 	struct pkg_file *file = NULL;
+	struct conflict_owner *owner;
+	struct conflict_path *e;
+	struct conflict_ref *r;
 	struct sbuf *conflictmsg = NULL;
-
-	const char sql[] = "INSERT INTO integritycheck (name, origin, version, path)"
-		"values (?1, ?2, ?3, ?4);";
-	const char sql_conflicts[] = "SELECT name, version from integritycheck where path=?1;";
+	const char *name, *origin, *version;
 
 	assert(db != NULL && p != NULL);
 
-	sql_exec(db->sqlite, "CREATE TEMP TABLE IF NOT EXISTS integritycheck ( "
-			"name TEXT, "
-			"origin TEXT, "
-			"version TEXT, "
-			"path TEXT UNIQUE);"
-		);
+	if (db->conflicts == NULL && integrity_load(db) != EPKG_OK)
+		return (EPKG_FATAL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin, PKG_VERSION, &version);
+	owner = pkg_conflicts_owner(db->conflicts, 0, origin, name, version);
+	if (owner == NULL)
 		return (EPKG_FATAL);
-	}
 
 	conflictmsg = sbuf_new_auto();
 
 	while (pkg_files(p, &file) == EPKG_OK) {
-		const char *name, *origin, *version;
 		const char *pkg_path = pkg_file_path(file);
 
-		pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin,
-		    PKG_VERSION, &version);
-		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, origin, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 3, version, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 4, pkg_path, -1, SQLITE_STATIC);
-
-		if (sqlite3_step(stmt) != SQLITE_DONE) {
-			sbuf_clear(conflictmsg);
-			sbuf_printf(conflictmsg,
-			    "WARNING: %s-%s conflict on %s with: \n", name,
-			    version, pkg_path);
-
-			if (sqlite3_prepare_v2(db->sqlite, sql_conflicts,
-			    -1, &stmt_conflicts, NULL) != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite);
-				sqlite3_finalize(stmt);
-				sbuf_delete(conflictmsg);
-				return (EPKG_FATAL);
-			}
-
-			sqlite3_bind_text(stmt_conflicts, 1, pkg_path,
-			    -1, SQLITE_STATIC);
+		if ((e = pkg_conflicts_add(db->conflicts, pkg_path, owner)) ==
+		    NULL) {
+			ret = EPKG_FATAL;
+			break;
+		}
 
-			while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-				sbuf_printf(conflictmsg, "\t- %s-%s\n",
-				    sqlite3_column_text(stmt_conflicts, 0),
-				    sqlite3_column_text(stmt_conflicts, 1));
-			}
-			sqlite3_finalize(stmt_conflicts);
+		/* the installed owners are checked by pkgdb_integrity_check */
+		sbuf_clear(conflictmsg);
+		for (r = e->owners->next; r != NULL; r = r->next) {
+			if (r->owner->id != 0)
+				continue;
+			if (sbuf_len(conflictmsg) == 0)
+				sbuf_printf(conflictmsg,
+				    "WARNING: %s-%s conflict on %s with: \n",
+				    name, version, pkg_path);
+			sbuf_printf(conflictmsg, "\t- %s-%s\n",
+			    r->owner->name, r->owner->version);
+		}
+		if (sbuf_len(conflictmsg) > 0) {
 			sbuf_finish(conflictmsg);
 			pkg_emit_error("%s", sbuf_get(conflictmsg));
 			ret = EPKG_FATAL;
 		}
-		sqlite3_reset(stmt);
 	}
-	sqlite3_finalize(stmt);
 	sbuf_delete(conflictmsg);
 
 	return (ret);
@@ -3254,105 +3981,89 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 int
 pkgdb_integrity_check(struct pkgdb *db)
 {
-	int ret, retcode = EPKG_OK;
-	sqlite3_stmt *stmt;
-	sqlite3_stmt *stmt_conflicts;
+	int retcode = EPKG_OK;
+	struct conflict_path *e;
+	struct conflict_ref *r, *l;
 	struct sbuf *conflictmsg = NULL;
-	assert (db != NULL);
-
-	const char sql_local_conflict[] = "SELECT p.name, p.version FROM packages AS p, files AS f "
-		"WHERE p.id = f.package_id AND f.path = ?1;";
+	size_t i = 0;
+	bool installing;
 
-	const char sql_conflicts[] = "SELECT name, version from integritycheck where path=?1;";
+	assert (db != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite,
-		"SELECT path, COUNT(path) from ("
-		"SELECT path from integritycheck UNION ALL "
-		"SELECT path from files, main.packages AS p where p.id=package_id and p.origin NOT IN (SELECT origin from integritycheck)"
-		") GROUP BY path HAVING (COUNT(path) > 1 );",
-		-1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (EPKG_FATAL);
-	}
+	if (db->conflicts == NULL)
+		return (EPKG_OK);
 
 	conflictmsg = sbuf_new_auto();
 
-	while (sqlite3_step(stmt) != SQLITE_DONE) {
-		sbuf_clear(conflictmsg);
-
-		ret = sqlite3_prepare_v2(db->sqlite, sql_local_conflict, -1,
-		    &stmt_conflicts, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
-			sbuf_delete(conflictmsg);
-			return (EPKG_FATAL);
-		}
-
-		sqlite3_bind_text(stmt_conflicts, 1,
-		    sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
-
-		sqlite3_step(stmt_conflicts);
-
-		sbuf_printf(conflictmsg,
-		    "WARNING: locally installed %s-%s conflicts on %s with:\n",
-		    sqlite3_column_text(stmt_conflicts, 0),
-		    sqlite3_column_text(stmt_conflicts, 1),
-		    sqlite3_column_text(stmt, 0));
-
-		sqlite3_finalize(stmt_conflicts);
-
-		ret = sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1,
-		    &stmt_conflicts, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
-			sbuf_delete(conflictmsg);
-			return (EPKG_FATAL);
-		}
+	while ((e = pkg_conflicts_next(db->conflicts, &i)) != NULL) {
+		installing = false;
+		for (r = e->owners; r != NULL; r = r->next)
+			if (r->owner->id == 0)
+				installing = true;
+		if (!installing)
+			continue;
 
-		sqlite3_bind_text(stmt_conflicts, 1,
-		    sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
+		for (l = e->owners; l != NULL; l = l->next) {
+			/* the packages upgraded do not conflict */
+			if (l->owner->id == 0 || l->owner->replaced)
+				continue;
 
-		while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-			sbuf_printf(conflictmsg, "\t- %s-%s\n",
-			    sqlite3_column_text(stmt_conflicts, 0),
-			    sqlite3_column_text(stmt_conflicts, 1));
+			sbuf_clear(conflictmsg);
+			sbuf_printf(conflictmsg,
+			    "WARNING: locally installed %s-%s conflicts on %s "
+			    "with:\n", l->owner->name, l->owner->version,
+			    e->path);
+			for (r = e->owners; r != NULL; r = r->next)
+				if (r->owner->id == 0)
+					sbuf_printf(conflictmsg, "\t- %s-%s\n",
+					    r->owner->name, r->owner->version);
+			sbuf_finish(conflictmsg);
+			pkg_emit_error("%s", sbuf_get(conflictmsg));
+			retcode = EPKG_FATAL;
 		}
-		sqlite3_finalize(stmt_conflicts);
-		sbuf_finish(conflictmsg);
-		pkg_emit_error("%s", sbuf_get(conflictmsg));
-		retcode = EPKG_FATAL;
 	}
 
-	sqlite3_finalize(stmt);
 	sbuf_delete(conflictmsg);
 
-/*	sql_exec(db->sqlite, "DROP TABLE IF EXISTS integritycheck");*/
-
 	return (retcode);
 }
 
+/*
+ * The installed packages owning files of the package `origin' to
+ * install, as found by pkgdb_integrity_append().
+ */
 struct pkgdb_it *
 pkgdb_integrity_conflict_local(struct pkgdb *db, const char *origin)
 {
 	sqlite3_stmt *stmt;
+	struct conflict_owner *owner = NULL;
+	struct conflict_ref *r;
+	struct sbuf *sql;
 	int ret;
 
 	assert(db != NULL && origin != NULL);
 
-	const char sql_conflicts [] = "SELECT DISTINCT p.id as rowid, p.origin, p.name, p.version, p.prefix "
-		"FROM packages AS p, files AS f, integritycheck AS i "
-		"WHERE p.id = f.package_id AND f.path = i.path AND i.origin = ?1";
+	if (db->conflicts != NULL)
+		owner = pkg_conflicts_get(db->conflicts, origin);
+
+	sql = sbuf_new_auto();
+	sbuf_cat(sql, "SELECT id AS rowid, origin, name, version, prefix "
+	    "FROM packages WHERE id IN (");
+	for (r = owner != NULL ? owner->installed : NULL; r != NULL;
+	    r = r->next)
+		sbuf_printf(sql, "%" PRId64 "%s", r->owner->id,
+		    r->next != NULL ? "," : "");
+	sbuf_cat(sql, ");");
+	sbuf_finish(sql);
 
-	ret = sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1, &stmt, NULL);
+	/* the packages unregistered since then are not found anymore */
+	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
+	sbuf_delete(sql);
 	if (ret != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
 		return (NULL);
 	}
 
-	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_TRANSIENT);
-
 	return (pkgdb_it_new(db, stmt, PKG_INSTALLED));
 }
 
@@ -3449,7 +4160,10 @@ pkgdb_file_set_cksum(struct pkgdb *db, struct pkg_file *file, const char *sha256
 {
 	sqlite3_stmt *stmt = NULL;
 	const char sql_file_update[] = ""
-		"UPDATE files SET sha256=?1 WHERE path=?2";
+		"UPDATE pkg_files SET sha256 = sha256_blob(?1) "
+		"WHERE directory_id = "
+			"(SELECT id FROM file_dirs WHERE path = file_dir(?2)) "
+			"AND name = file_name(?2)";
 	int ret;
 
 	ret = sqlite3_prepare_v2(db->sqlite, sql_file_update, -1, &stmt, NULL);
@@ -3603,6 +4317,12 @@ sqlcmd_init(sqlite3 *db, __unused const char **err, __unused const void *noused)
 		    pkgdb_myarch, NULL, NULL);
 		sqlite3_create_function(db, "myarch", 1, SQLITE_ANY, NULL,
 		    pkgdb_myarch, NULL, NULL);
+		sqlite3_create_function(db, "file_dir", 1, SQLITE_ANY, NULL,
+		    pkgdb_file_dir, NULL, NULL);
+		sqlite3_create_function(db, "file_name", 1, SQLITE_ANY, NULL,
+		    pkgdb_file_name, NULL, NULL);
+		sqlite3_create_function(db, "sha256_blob", 1, SQLITE_ANY, NULL,
+		    pkgdb_sha256_blob, NULL, NULL);
 		sqlite3_create_function(db, "regexp", 2, SQLITE_ANY, NULL,
 		    pkgdb_regex_basic, NULL, NULL);
 		sqlite3_create_function(db, "eregexp", 2, SQLITE_ANY, NULL,
@@ -232,6 +232,37 @@ static struct db_upgrades {
 	"CREATE INDEX pkg_shlibs_package_id ON pkg_shlibs (package_id);"
 	"CREATE INDEX pkg_directories_directory_id ON pkg_directories (directory_id);"
 	},
+	{13,
+	"CREATE TABLE file_dirs ("
+		"id INTEGER PRIMARY KEY,"
+		"path TEXT NOT NULL UNIQUE"
+	");"
+	"CREATE TABLE pkg_files ("
+		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
+			" ON UPDATE CASCADE,"
+		"directory_id INTEGER REFERENCES file_dirs(id) ON DELETE RESTRICT"
+			" ON UPDATE RESTRICT,"
+		"name TEXT NOT NULL,"
+		"sha256 BLOB,"
+		"PRIMARY KEY (directory_id, name)"
+	");"
+	"INSERT INTO file_dirs (path) "
+		"SELECT DISTINCT file_dir(path) FROM files;"
+	"INSERT INTO pkg_files (package_id, directory_id, name, sha256) "
+		"SELECT f.package_id, d.id, file_name(f.path), "
+		"sha256_blob(f.sha256) "
+		"FROM files AS f, file_dirs AS d "
+		"WHERE d.path = file_dir(f.path);"
+	"DROP TABLE files;"
+	"CREATE INDEX pkg_files_package_id ON pkg_files (package_id);"
+	"CREATE VIEW files AS "
+		"SELECT d.path || f.name AS path, "
+		"CASE typeof(f.sha256) WHEN 'blob' THEN lower(hex(f.sha256)) "
+			"ELSE f.sha256 END AS sha256, "
+		"f.package_id AS package_id "
+		"FROM pkg_files AS f, file_dirs AS d "
+		"WHERE d.id = f.directory_id;"
+	},
 
 	/* Mark the end of the array */
 	{ -1, NULL },
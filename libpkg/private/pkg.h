@@ -34,9 +34,11 @@
 #include <sys/types.h>
 
 #include <archive.h>
+#include <fetch.h>
 #include <sqlite3.h>
 #include <openssl/sha.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "private/utils.h"
 
@@ -55,6 +57,12 @@
 	}  \
 	} while (0)
 
+/*
+ * The package in the cache is known to match its checksum.
+ * Don't conflict with PKG_LOAD_* and PKG_CONTAINS_*.
+ */
+#define PKG_CKSUM_VERIFIED (1<<27)
+
 struct pkg {
 	struct sbuf * fields[PKG_NUM_FIELDS];
 	bool automatic;
@@ -117,6 +125,54 @@ struct pkg_dir {
 	STAILQ_ENTRY(pkg_dir) next;
 };
 
+typedef enum {
+	PKG_DELTA_REMOVED,	/* only in the old package */
+	PKG_DELTA_ADDED,	/* only in the new one */
+	PKG_DELTA_CHANGED,	/* in both, with another checksum */
+	PKG_DELTA_UNCHANGED,	/* in both, with the same checksum */
+} pkg_delta_t;
+
+struct pkg_delta_file {
+	struct pkg_file *old;
+	struct pkg_file *new;
+	pkg_delta_t type;
+};
+
+struct pkg_delta_dir {
+	struct pkg_dir *old;
+	struct pkg_dir *new;
+	pkg_delta_t type;
+};
+
+struct pkg_delta {
+	struct pkg_delta_file *files;
+	size_t num_files;
+	struct pkg_delta_dir *dirs;
+	size_t num_dirs;
+};
+
+struct conflict_ref;
+
+struct conflict_owner {
+	int64_t id;		/* of the installed package, 0 if to install */
+	const char *origin;
+	const char *name;
+	const char *version;
+	bool replaced;		/* installed and about to be upgraded */
+	struct conflict_ref *installed;	/* sharing paths with this one */
+};
+
+struct conflict_ref {
+	struct conflict_owner *owner;
+	struct conflict_ref *next;
+};
+
+struct conflict_path {
+	const char *path;
+	struct conflict_ref *owners;	/* the last one added first */
+	struct conflict_path *next;
+};
+
 struct pkg_option {
 	struct sbuf *key;
 	struct sbuf *value;
@@ -188,6 +244,9 @@ int pkg_delete(struct pkg *pkg, struct pkgdb *db, int flags);
 #define PKG_DELETE_UPGRADE (1<<1)
 
 int pkg_repo_fetch(struct pkg *pkg);
+int pkg_repo_fetch2(struct pkg *pkg, volatile off_t *done);
+int pkg_repo_fetch_manifest(struct pkg *pkg, struct pkg **manifest);
+const char *pkg_repo_site(struct pkg *pkg);
 
 int pkg_start_stop_rc_scripts(struct pkg *, pkg_rc_attr attr);
 
@@ -197,6 +256,61 @@ int pkg_add_user_group(struct pkg *pkg);
 int pkg_delete_user_group(struct pkgdb *db, struct pkg *pkg);
 
 int pkg_open2(struct pkg **p, struct archive **a, struct archive_entry **ae, const char *path);
+int pkg_open_cksum(struct pkg **p, const char *path,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1]);
+
+/*
+ * The error of one request: the globals of libfetch are shared by the
+ * threads downloading in parallel.
+ */
+struct fetch_error {
+	int code;
+	char string[MAXERRSTRING];
+};
+
+FILE *http_get(struct url *u, struct url_stat *st, int timeout,
+    struct fetch_error *err);
+void mirror_connect(const char *host, int64_t ms, bool failed);
+void mirror_transfer(const char *host, off_t bytes, int64_t ms, bool failed);
+struct dns_srvinfo *mirror_sort(struct dns_srvinfo *list);
+void mirror_save(void);
+void http_cleanup(void);
+int pkg_cache_path(char *path, size_t size);
+void pkg_cache_add(struct pkg *pkg);
+int pkg_cache_lookup(const char *cksum, const char *repopath, char *path,
+    size_t size);
+int pkg_cache_sync(void);
+
+typedef enum {
+	SYNC_NONE,
+	SYNC_FILE,
+	SYNC_BATCH
+} sync_t;
+
+sync_t pkg_sync_policy(void);
+void pkg_sync_file(const char *path);
+int pkg_sync_commit(void);
+
+int pkg_delta_new(struct pkg_delta **delta, struct pkg *old, struct pkg *new);
+void pkg_delta_free(struct pkg_delta *delta);
+int pkg_add2(struct pkgdb *db, const char *path, int flags,
+    struct pkg_delta *delta);
+
+struct pkg_conflicts;
+struct pkg_conflicts *pkg_conflicts_new(void);
+void pkg_conflicts_free(struct pkg_conflicts *c);
+struct conflict_owner *pkg_conflicts_owner(struct pkg_conflicts *c,
+    int64_t id, const char *origin, const char *name, const char *version);
+struct conflict_path *pkg_conflicts_add(struct pkg_conflicts *c,
+    const char *path, struct conflict_owner *owner);
+struct conflict_path *pkg_conflicts_next(struct pkg_conflicts *c, size_t *i);
+struct conflict_owner *pkg_conflicts_get(struct pkg_conflicts *c,
+    const char *origin);
+int pkg_fetch_open(const char *url, time_t t, off_t *offset, FILE **remote,
+    off_t *size, char host[MAXHOSTNAMELEN]);
+int pkg_fetch_probe(const char *url, FILE **remote, off_t *size);
+int pkg_fetch_file2(const char *url, const char *dest, time_t t, bool resume,
+    volatile off_t *done, char cksum[SHA256_DIGEST_LENGTH * 2 + 1]);
 
 void pkg_list_free(struct pkg *, pkg_list);
 
@@ -252,6 +366,8 @@ int pkg_set_mtree(struct pkg *, const char *mtree);
 
 /* pkg repo related */
 int pkg_check_repo_version(struct pkgdb *db, const char *database);
+int pkg_repo_digest(sqlite3 *sqlite,
+    char digest[SHA256_DIGEST_LENGTH * 2 + 1]);
 
 /* pkgdb commands */
 int sql_exec(sqlite3 *, const char *, ...);
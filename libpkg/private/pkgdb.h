@@ -37,12 +37,20 @@ struct pkgdb {
 	pkgdb_t type;
 	int lock_count;
 	bool prstmt_initialized;
+	struct pkg_conflicts *conflicts;	/* see pkgdb_integrity_append() */
+	struct pkgdb_stmt *stmts;		/* see pkgdb_stmt_get() */
+	int64_t stmt_tick;
+	int64_t stmt_hits;
+	int64_t stmt_misses;
 };
 
 struct pkgdb_it {
 	struct pkgdb *db;
 	sqlite3_stmt *stmt;
 	int type;
+	size_t count;			/* packages returned so far */
+	bool all;			/* over all the installed packages */
+	struct bulk_rows *bulk;		/* see pkgdb_it_next() */
 };
 
 int pkgdb_lock(struct pkgdb *db);
@@ -27,8 +27,8 @@
 #ifndef _PKG_THD_REPO_H
 #define _PKG_THD_REPO_H
 
-#include <sys/queue.h>
 #include <sys/types.h>
+#include <machine/atomic.h>
 #include <pthread.h>
 
 struct pkg_result {
@@ -36,32 +36,106 @@ struct pkg_result {
 	char path[MAXPATHLEN + 1];
 	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
 	off_t size;
+	time_t mtime;
+	ino_t inode;
 	int retcode; /* to pass errors */
-	STAILQ_ENTRY(pkg_result) next;
+};
+
+/*
+ * A slot of the results ring.  `seq' tells who owns the slot: it is
+ * equal to the enqueue position when the slot is free for a producer,
+ * and to the position + 1 once `r' is published for the consumer.
+ */
+struct result_slot {
+	volatile u_int seq;
+	struct pkg_result *r;
+};
+
+/*
+ * What we know about a package file already in the catalogue.
+ * Used to skip files which did not change since the last run.
+ */
+struct repo_stat {
+	char *path;
+	int64_t size;
+	int64_t mtime;
+	int64_t inode;
+};
+
+/*
+ * A package file found while scanning the repository, waiting to be
+ * read by one of the workers.
+ */
+struct repo_file {
+	char *path;
+	off_t size;
+	time_t mtime;
+	ino_t inode;
 };
 
 struct thd_data {
 	char *root_path;
-	unsigned int max_results;
+	struct repo_timings *timings;	/* NULL unless benchmarking */
+
+	/*
+	 * `files' is sorted by decreasing size and read-only once the
+	 * workers are started.  Each worker claims the next entry by
+	 * atomically incrementing `next_file'; setting it past
+	 * `num_files' makes them stop.
+	 */
+	struct repo_file *files;
+	size_t num_files;
+	volatile u_int next_file;
 
 	/*
-	 * `fts_m' protects `fts' and `stop'
+	 * Bounded multi-producer single-consumer ring of results.
+	 * `ring_mask' + 1 is a power of two.  Workers claim slots by
+	 * moving `enq_pos' forward with a compare and set; only the main
+	 * thread uses `deq_pos'.  `pending' counts the results published
+	 * but not yet dequeued, it is used to know when the main thread
+	 * has to be woken up.
 	 */
-	pthread_mutex_t fts_m;
-	FTS *fts;
-	bool stop;
+	struct result_slot *ring;
+	u_int ring_mask;
+	volatile u_int enq_pos;
+	u_int deq_pos;
+	volatile u_int pending;
 
 	/*
-	 * `results_m' protects `results', `thd_finished' and `num_results'
+	 * `results_m' protects `room_waiters' and `thd_finished', it is
+	 * only taken to sleep or to wake someone up: by the main thread
+	 * when the ring is empty, by the workers when it is full.
 	 */
 	pthread_mutex_t results_m;
 	pthread_cond_t has_result;
 	pthread_cond_t has_room;
-	STAILQ_HEAD(results, pkg_result) results;
-	unsigned int num_results;
+	u_int room_waiters;
 	int thd_finished;
 };
 
+/*
+ * Time spent in each phase of pkg repo, in microseconds, filled by the
+ * _timed variants of pkg_create_repo() and pkg_finish_repo() for the
+ * benchmarks (see tests/bench).  `read' is the time spent hashing the
+ * packages and parsing their manifest, summed over all the workers,
+ * and `packages' the number of packages read.
+ */
+struct repo_timings {
+	uint64_t scan;
+	uint64_t read;
+	uint64_t insert;
+	uint64_t commit;
+	uint64_t sign;
+	uint64_t compress;
+	uint64_t packages;
+	uint64_t bytes;
+};
+
+int pkg_create_repo_timed(char *path, bool force,
+    void (*progress)(struct pkg *, void *), void *data,
+    struct repo_timings *timings);
+int pkg_finish_repo_timed(char *path, pem_password_cb *password_cb,
+    char *rsa_key_path, struct repo_timings *timings);
 void read_pkg_file(void *);
 
 #endif
@@ -37,6 +37,9 @@
 
 #define STARTS_WITH(string, needle) (strncasecmp(string, needle, strlen(needle)) == 0)
 
+/* size of the reads done when hashing files */
+#define HASH_BUFSIZ (64 * 1024)
+
 #define ERROR_SQLITE(db) \
 	pkg_emit_error("sqlite: %s (%s:%d)", sqlite3_errmsg(db), __FILE__, __LINE__)
 
@@ -73,11 +76,15 @@ int is_conf_file(const char *path, char *newpath, size_t len);
 
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 void sha256_str(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
+int sha256_fd(int fd, SHA256_CTX *, const char *path);
+void sha256_final(SHA256_CTX *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 
 int rsa_sign(char *path, pem_password_cb *password_cb, char *rsa_key_path,
 		 unsigned char **sigret, unsigned int *siglen);
 int rsa_verify(const char *path, const char *key,
 		unsigned char *sig, unsigned int sig_len);
+int rsa_verify_cksum(const char cksum[SHA256_DIGEST_LENGTH * 2 + 1],
+		const char *key, unsigned char *sig, unsigned int sig_len);
 
 bool is_hardlink(struct hardlinks *hl, struct stat *st);
 
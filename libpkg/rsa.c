@@ -86,12 +86,21 @@ rsa_verify(const char *path, const char *key, unsigned char *sig,
     unsigned int sig_len)
 {
 	char sha256[SHA256_DIGEST_LENGTH *2 +1];
+
+	sha256_file(path, sha256);
+
+	return (rsa_verify_cksum(sha256, key, sig, sig_len));
+}
+
+/* Same as rsa_verify() for a file whose checksum is already known */
+int
+rsa_verify_cksum(const char sha256[SHA256_DIGEST_LENGTH * 2 + 1],
+    const char *key, unsigned char *sig, unsigned int sig_len)
+{
 	char errbuf[1024];
 	RSA *rsa = NULL;
 	int ret;
 
-	sha256_file(path, sha256);
-
 	SSL_load_error_strings();
 	OpenSSL_add_all_algorithms();
 	OpenSSL_add_all_ciphers();
@@ -100,7 +109,8 @@ rsa_verify(const char *path, const char *key, unsigned char *sig,
 	if (rsa == NULL)
 		return(EPKG_FATAL);
 
-	ret = RSA_verify(NID_sha1, sha256, sizeof(sha256), sig, sig_len, rsa);
+	ret = RSA_verify(NID_sha1, sha256, SHA256_DIGEST_LENGTH * 2 + 1, sig,
+	    sig_len, rsa);
 	if (ret == 0) {
 		pkg_emit_error("%s: %s", key,
 		    ERR_error_string(ERR_get_error(), errbuf));
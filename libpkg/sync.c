@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2012 Julien Laffaye <jlaffaye@FreeBSD.org>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Durability of the files installed, as set by INSTALL_SYNC: the files
+ * written since the last commit of the database are synced to disk,
+ * with the directories they are in, right before the next one.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "private/event.h"
+#include "private/pkg.h"
+
+static char **pending = NULL;
+static size_t num_pending = 0;
+static size_t cap_pending = 0;
+static char last_dir[MAXPATHLEN + 1];
+/* the first file which could not be synced, with the errno */
+static char failed[MAXPATHLEN + 1];
+static const char *failed_func = NULL;
+static int failed_errno;
+static pthread_mutex_t sync_m = PTHREAD_MUTEX_INITIALIZER;
+
+sync_t
+pkg_sync_policy(void)
+{
+	const char *policy = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_INSTALL_SYNC, &policy) != EPKG_OK ||
+	    policy == NULL)
+		return (SYNC_BATCH);
+
+	if (strcasecmp(policy, "none") == 0)
+		return (SYNC_NONE);
+	if (strcasecmp(policy, "file") == 0)
+		return (SYNC_FILE);
+
+	return (SYNC_BATCH);
+}
+
+/* Returns the name of the call which failed, NULL on success. */
+static const char *
+sync_path_quiet(const char *path)
+{
+	const char *func = NULL;
+	int fd, saved;
+
+	/* symlinks have nothing to sync but the directory they are in */
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW)) == -1) {
+		if (errno == ELOOP || errno == ENOENT)
+			return (NULL);
+		return ("open");
+	}
+
+	if (fsync(fd) != 0)
+		func = "fsync";
+	saved = errno;
+	close(fd);
+	errno = saved;
+
+	return (func);
+}
+
+static int
+sync_path(const char *path)
+{
+	const char *func;
+
+	if ((func = sync_path_quiet(path)) != NULL) {
+		pkg_emit_errno(func, path);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+static void
+sync_add(const char *path)
+{
+	char *p;
+
+	if (num_pending >= cap_pending) {
+		cap_pending |= 1;
+		cap_pending *= 2;
+		pending = reallocf(pending, cap_pending * sizeof(char *));
+		if (pending == NULL) {
+			num_pending = cap_pending = 0;
+			return;
+		}
+	}
+	if ((p = strdup(path)) != NULL)
+		pending[num_pending++] = p;
+}
+
+/*
+ * Called once a file is extracted, possibly by several threads at
+ * once.
+ */
+void
+pkg_sync_file(const char *path)
+{
+	char dir[MAXPATHLEN + 1];
+	const char *func = NULL;
+	char *p;
+	sync_t policy = pkg_sync_policy();
+	int err = 0;
+
+	if (policy == SYNC_NONE)
+		return;
+
+	/* the failure is reported by the next pkg_sync_commit() */
+	if (policy == SYNC_FILE && (func = sync_path_quiet(path)) != NULL)
+		err = errno;
+
+	pthread_mutex_lock(&sync_m);
+	if (func != NULL && failed_func == NULL) {
+		strlcpy(failed, path, sizeof(failed));
+		failed_func = func;
+		failed_errno = err;
+	}
+	if (policy == SYNC_BATCH)
+		sync_add(path);
+	strlcpy(dir, path, sizeof(dir));
+	if ((p = strrchr(dir, '/')) != NULL) {
+		*p = '\0';
+		/* the files of a directory are usually extracted in a row */
+		if (strcmp(last_dir, dir) != 0) {
+			sync_add(dir[0] != '\0' ? dir : "/");
+			strlcpy(last_dir, dir, sizeof(last_dir));
+		}
+	}
+	pthread_mutex_unlock(&sync_m);
+}
+
+static int
+path_cmp(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/*
+ * Sync what was extracted since the last call.  Must be called before
+ * the packages are committed to the database.
+ */
+int
+pkg_sync_commit(void)
+{
+	size_t i;
+	int ret = EPKG_OK;
+
+	pthread_mutex_lock(&sync_m);
+	if (failed_func != NULL) {
+		errno = failed_errno;
+		pkg_emit_errno(failed_func, failed);
+		failed_func = NULL;
+		ret = EPKG_FATAL;
+	}
+	if (num_pending > 0)
+		qsort(pending, num_pending, sizeof(char *), path_cmp);
+	for (i = 0; i < num_pending; i++) {
+		if (ret == EPKG_OK &&
+		    (i == 0 || strcmp(pending[i], pending[i - 1]) != 0))
+			ret = sync_path(pending[i]);
+		free(pending[i]);
+	}
+	num_pending = 0;
+	last_dir[0] = '\0';
+	pthread_mutex_unlock(&sync_m);
+
+	return (ret);
+}
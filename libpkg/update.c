@@ -27,9 +27,12 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <archive.h>
@@ -37,11 +40,85 @@
 
 #include "pkg.h"
 #include "private/event.h"
+#include "private/pkg.h"
 #include "private/utils.h"
 #include "private/pkgdb.h"
 
 //#define EXTRACT_ARCHIVE_FLAGS  (ARCHIVE_EXTRACT_OWNER |ARCHIVE_EXTRACT_PERM)
 
+/* Tables of a changeset, see pkg_finish_repo() */
+static const char *delta_tables[] = {
+	"changeset",
+	"abi",
+	"packages",
+	"deps",
+	"options",
+	"categories",
+	"licenses",
+	"shlibs",
+	"removed",
+};
+#define NUM_DELTA_TABLES (sizeof(delta_tables) / sizeof(*delta_tables))
+
+/* Applied in order for each changeset, ?1 is its serial */
+static const char *delta_apply[] = {
+	"DELETE FROM packages WHERE origin IN ("
+		"SELECT origin FROM temp.d_removed WHERE serial = ?1 "
+		"UNION SELECT origin FROM temp.d_packages WHERE serial = ?1)",
+	"INSERT INTO packages (origin, name, version, comment, desc, "
+		"osversion, arch, maintainer, www, prefix, pkgsize, flatsize, "
+		"licenselogic, cksum, path, pkg_format_version) "
+		"SELECT origin, name, version, comment, desc, "
+		"osversion, arch, maintainer, www, prefix, pkgsize, flatsize, "
+		"licenselogic, cksum, path, pkg_format_version "
+		"FROM temp.d_packages WHERE serial = ?1",
+	"INSERT INTO deps (origin, name, version, package_id) "
+		"SELECT d.origin, d.name, d.version, p.id "
+		"FROM temp.d_deps AS d, temp.d_packages AS dp, packages AS p "
+		"WHERE d.serial = ?1 AND dp.serial = ?1 "
+		"AND dp.id = d.package_id AND p.origin = dp.origin",
+	"INSERT INTO options (package_id, option, value) "
+		"SELECT p.id, o.option, o.value "
+		"FROM temp.d_options AS o, temp.d_packages AS dp, packages AS p "
+		"WHERE o.serial = ?1 AND dp.serial = ?1 "
+		"AND dp.id = o.package_id AND p.origin = dp.origin",
+	"INSERT OR IGNORE INTO categories (name) "
+		"SELECT name FROM temp.d_categories WHERE serial = ?1",
+	"INSERT INTO pkg_categories (package_id, category_id) "
+		"SELECT p.id, c.id FROM temp.d_categories AS dc, "
+		"temp.d_packages AS dp, packages AS p, categories AS c "
+		"WHERE dc.serial = ?1 AND dp.serial = ?1 "
+		"AND dp.id = dc.package_id AND p.origin = dp.origin "
+		"AND c.name = dc.name",
+	"INSERT OR IGNORE INTO licenses (name) "
+		"SELECT name FROM temp.d_licenses WHERE serial = ?1",
+	"INSERT INTO pkg_licenses (package_id, license_id) "
+		"SELECT p.id, l.id FROM temp.d_licenses AS dl, "
+		"temp.d_packages AS dp, packages AS p, licenses AS l "
+		"WHERE dl.serial = ?1 AND dp.serial = ?1 "
+		"AND dp.id = dl.package_id AND p.origin = dp.origin "
+		"AND l.name = dl.name",
+	"INSERT OR IGNORE INTO shlibs (name) "
+		"SELECT name FROM temp.d_shlibs WHERE serial = ?1",
+	"INSERT INTO pkg_shlibs (package_id, shlib_id) "
+		"SELECT p.id, s.id FROM temp.d_shlibs AS ds, "
+		"temp.d_packages AS dp, packages AS p, shlibs AS s "
+		"WHERE ds.serial = ?1 AND dp.serial = ?1 "
+		"AND dp.id = ds.package_id AND p.origin = dp.origin "
+		"AND s.name = ds.name",
+	"DELETE FROM repo_abi",
+	"INSERT INTO repo_abi (abi) "
+		"SELECT abi FROM temp.d_abi WHERE serial = ?1",
+	"UPDATE repo_meta SET serial = ?1, "
+		"schema = (SELECT schema FROM temp.d_changeset "
+		"WHERE serial = ?1), "
+		"packages = (SELECT packages FROM temp.d_changeset "
+		"WHERE serial = ?1), "
+		"digest = (SELECT digest FROM temp.d_changeset "
+		"WHERE serial = ?1)",
+};
+#define NUM_DELTA_APPLY (sizeof(delta_apply) / sizeof(*delta_apply))
+
 /* Add indexes to the repo */
 static int
 remote_add_indexes(const char *reponame)
@@ -64,83 +141,115 @@ remote_add_indexes(const char *reponame)
 	return (ret);
 }
 
-int
-pkg_update(const char *name, const char *packagesite, bool force)
+struct catalogue_reader {
+	FILE *remote;
+	const char *url;
+	off_t size;
+	off_t done;
+	time_t begin;
+	time_t last;
+	char in[HASH_BUFSIZ];
+	char out[HASH_BUFSIZ];
+};
+
+static ssize_t
+catalogue_read(struct archive *a, void *data, const void **buf)
 {
-	char url[MAXPATHLEN];
+	struct catalogue_reader *r = data;
+	size_t len;
+	time_t now;
+
+	len = fread(r->in, 1, sizeof(r->in), r->remote);
+	if (len == 0 && ferror(r->remote)) {
+		archive_set_error(a, EIO, "read error");
+		return (-1);
+	}
+
+	r->done += len;
+	now = time(NULL);
+	/* Only call the callback every second */
+	if (len > 0 && (now > r->last || r->done == r->size)) {
+		pkg_emit_fetching(r->url, r->size, r->done, (now - r->begin));
+		r->last = now;
+	}
+
+	*buf = r->in;
+	return (len);
+}
+
+/*
+ * Fetch a catalogue archive and extract `entry' from it to `dest' as
+ * it comes off the network.  The entry is hashed while written, for
+ * the signature check.  If `sqlite' is not NULL, the checked entry is
+ * opened there for the caller.
+ */
+static int
+fetch_catalogue(const char *url, time_t t, const char *entry,
+    const char *dest, sqlite3 **sqlite)
+{
+	struct catalogue_reader *r;
 	struct archive *a = NULL;
 	struct archive_entry *ae = NULL;
-	char repofile[MAXPATHLEN];
-	char repofile_unchecked[MAXPATHLEN];
-	char tmp[21];
-	const char *dbdir = NULL;
+	SHA256_CTX ctx;
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
 	const char *repokey;
 	unsigned char *sig = NULL;
 	int siglen = 0;
-	int rc = EPKG_FATAL, ret;
-	struct stat st;
-	time_t t = 0;
-	sqlite3 *sqlite;
-	char *archreq = NULL;
-	const char *myarch;
-	int64_t res;
-
-	snprintf(url, MAXPATHLEN, "%s/repo.txz", packagesite);
+	int fd = -1;
+	bool found = false;
+	ssize_t len;
+	int rc, ret;
 
-	(void)strlcpy(tmp, "/tmp/repo.txz.XXXXXX", sizeof(tmp));
-	if (mktemp(tmp) == NULL) {
-		pkg_emit_error("Could not create temporary file %s, "
-		    "aborting update.\n", tmp);
+	if ((r = calloc(1, sizeof(struct catalogue_reader))) == NULL) {
+		pkg_emit_errno("calloc", "catalogue_reader");
 		return (EPKG_FATAL);
 	}
 
-	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK) {
-		pkg_emit_error("Cant get dbdir config entry");
-		return (EPKG_FATAL);
-	}
-
-	snprintf(repofile, sizeof(repofile), "%s/%s.sqlite", dbdir, name);
-	if (force)
-		t = 0;		/* Always fetch */
-	else {
-		if (stat(repofile, &st) != -1) {
-			t = st.st_mtime;
-			/* add 1 minute to the timestamp because
-			 * repo.sqlite is always newer than repo.txz,
-			 * 1 minute should be enough.
-			 */
-			t += 60;
-		}
-	}
-
-	if ((rc = pkg_fetch_file(url, tmp, t)) != EPKG_OK) {
-		/*
-		 * No need to unlink(tmp) here as it is already
-		 * done in pkg_fetch_file() in case fetch failed.
-		 */
+	if ((rc = pkg_fetch_open(url, t, NULL, &r->remote, &r->size, NULL)) != EPKG_OK) {
+		free(r);
 		return (rc);
 	}
+	r->url = url;
+	r->begin = time(NULL);
+	rc = EPKG_FATAL;
 
 	a = archive_read_new();
 	archive_read_support_compression_all(a);
 	archive_read_support_format_tar(a);
 
-	archive_read_open_filename(a, tmp, 4096);
-
-	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
-		if (strcmp(archive_entry_pathname(ae), "repo.sqlite") == 0) {
-			snprintf(repofile_unchecked, sizeof(repofile_unchecked),
-			    "%s.unchecked", repofile);
-			archive_entry_set_pathname(ae, repofile_unchecked);
+	if (archive_read_open(a, r, NULL, catalogue_read, NULL) !=
+	    ARCHIVE_OK) {
+		pkg_emit_error("%s: %s", url, archive_error_string(a));
+		goto cleanup;
+	}
 
+	while ((ret = archive_read_next_header(a, &ae)) == ARCHIVE_OK) {
+		if (strcmp(archive_entry_pathname(ae), entry) == 0) {
 			/*
 			 * The repo should be owned by root and not writable
 			 */
-			archive_entry_set_uid(ae, 0);
-			archive_entry_set_gid(ae, 0);
-			archive_entry_set_perm(ae, 0644);
+			fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+			if (fd == -1) {
+				pkg_emit_errno("open", dest);
+				goto cleanup;
+			}
+
+			SHA256_Init(&ctx);
+			while ((len = archive_read_data(a, r->out,
+			    sizeof(r->out))) > 0) {
+				SHA256_Update(&ctx, r->out, len);
+				if (write(fd, r->out, len) != len) {
+					pkg_emit_errno("write", dest);
+					goto cleanup;
+				}
+			}
+			if (len < 0)
+				break;
+			sha256_final(&ctx, cksum);
 
-			archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS);
+			close(fd);
+			fd = -1;
+			found = true;
 		}
 		if (strcmp(archive_entry_pathname(ae), "signature") == 0) {
 			siglen = archive_entry_size(ae);
@@ -149,86 +258,346 @@ pkg_update(const char *name, const char *packagesite, bool force)
 		}
 	}
 
-	if (pkg_config_string(PKG_CONFIG_REPOKEY, &repokey) != EPKG_OK) {
-		if (sig != NULL)
-			free(sig);
-		
-		return (EPKG_FATAL);
+	if (ret != ARCHIVE_EOF) {
+		pkg_emit_error("%s: %s", url, archive_error_string(a));
+		goto cleanup;
 	}
 
+	if (!found) {
+		pkg_emit_error("%s: no %s found", url, entry);
+		goto cleanup;
+	}
+
+	if (pkg_config_string(PKG_CONFIG_REPOKEY, &repokey) != EPKG_OK)
+		goto cleanup;
+
 	if (repokey != NULL) {
 		if (sig != NULL) {
-			ret = rsa_verify(repofile_unchecked, repokey,
-			    sig, siglen - 1);
+			ret = rsa_verify_cksum(cksum, repokey, sig, siglen - 1);
 			if (ret != EPKG_OK) {
 				pkg_emit_error("Invalid signature, "
 				    "removing repository.\n");
-				unlink(repofile_unchecked);
-				free(sig);
-				rc = EPKG_FATAL;
 				goto cleanup;
 			}
-			free(sig);
 		} else {
 			pkg_emit_error("No signature found in the repository.  "
 			    "Can not validate against %s key.", repokey);
-			rc = EPKG_FATAL;
-			unlink(repofile_unchecked);
 			goto cleanup;
 		}
 	}
 
-	/* check is the repository is for valid architecture */
-	sqlite3_initialize();
-
-	if (sqlite3_open(repofile_unchecked, &sqlite) != SQLITE_OK) {
-		unlink(repofile_unchecked);
+	if (sqlite != NULL && sqlite3_open(dest, sqlite) != SQLITE_OK) {
+		sqlite3_close(*sqlite);
+		*sqlite = NULL;
 		pkg_emit_error("Corrupted repository");
-		rc = EPKG_FATAL;
 		goto cleanup;
 	}
 
+	rc = EPKG_OK;
+
+	cleanup:
+	if (fd != -1)
+		close(fd);
+	if (rc != EPKG_OK)
+		unlink(dest);
+	free(sig);
+	archive_read_finish(a);
+	fclose(r->remote);
+	free(r);
+
+	return (rc);
+}
+
+/*
+ * check is the repository is for valid architecture: pkg repo records
+ * the ABIs of the catalogue in repo_abi, older catalogues have to be
+ * scanned.
+ */
+static int
+check_arch(sqlite3 *sqlite)
+{
+	char *archreq;
+	const char *myarch;
+	int64_t res;
+	int ret;
+
 	pkg_config_string(PKG_CONFIG_ABI, &myarch);
 
-	archreq = sqlite3_mprintf("select count(arch) from packages "
-	    "where arch not GLOB '%q'", myarch);
-	if (get_pragma(sqlite, archreq, &res) != EPKG_OK) {
-		sqlite3_free(archreq);
+	ret = get_pragma(sqlite, "SELECT count(*) FROM sqlite_master "
+	    "WHERE type = 'table' AND name = 'repo_abi'", &res);
+	if (ret == EPKG_OK && res > 0)
+		archreq = sqlite3_mprintf("select count(*) from repo_abi "
+		    "where abi not GLOB '%q'", myarch);
+	else
+		archreq = sqlite3_mprintf("select count(arch) from packages "
+		    "where arch not GLOB '%q'", myarch);
+	ret = get_pragma(sqlite, archreq, &res);
+	sqlite3_free(archreq);
+	if (ret != EPKG_OK) {
 		pkg_emit_error("Unable to query repository");
-		rc = EPKG_FATAL;
-		sqlite3_close(sqlite);
-		goto cleanup;
+		return (EPKG_FATAL);
 	}
 
 	if (res > 0) {
 		pkg_emit_error("At least one of the packages provided by"
 		    "the repository is not compatible with your abi: %s",
 		    myarch);
-		rc = EPKG_FATAL;
-		sqlite3_close(sqlite);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+stage_delta(sqlite3 *sqlite, const char *delta, int64_t serial, bool first)
+{
+	int ret;
+
+	if (sql_exec(sqlite, "ATTACH %Q AS delta;", delta) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (size_t i = 0; i < NUM_DELTA_TABLES; i++) {
+		ret = sql_exec(sqlite, first ?
+		    "CREATE TEMP TABLE d_%s AS "
+		    "SELECT %lld AS serial, * FROM delta.%s;" :
+		    "INSERT INTO temp.d_%s SELECT %lld, * FROM delta.%s;",
+		    delta_tables[i], (long long)serial, delta_tables[i]);
+		if (ret != EPKG_OK)
+			break;
+	}
+
+	sql_exec(sqlite, "DETACH delta;");
+
+	return (ret);
+}
+
+static int
+apply_delta(sqlite3 *sqlite, sqlite3_stmt **stmts, int64_t serial)
+{
+	for (size_t i = 0; i < NUM_DELTA_APPLY; i++) {
+		sqlite3_reset(stmts[i]);
+		sqlite3_bind_int64(stmts[i], 1, serial);
+		if (sqlite3_step(stmts[i]) != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			return (EPKG_FATAL);
+		}
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Bring the local catalogue up to date with the changesets published
+ * since its serial, applied in order in a single transaction.  Returns
+ * EPKG_UPTODATE at once if the serial did not change.  Anything but
+ * EPKG_OK or EPKG_UPTODATE means a full download is needed.
+ */
+static int
+update_delta(const char *packagesite, const char *repofile)
+{
+	char url[MAXPATHLEN];
+	char delta[MAXPATHLEN];
+	sqlite3 *sqlite = NULL;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *stmts[NUM_DELTA_APPLY];
+	FILE *remote;
+	off_t size;
+	long long epoch, serial, deltas;
+	long long r_epoch, r_serial, r_first;
+	char digest[SHA256_DIGEST_LENGTH * 2 + 1];
+	char *req;
+	int64_t res;
+	bool in_transaction = false;
+	int rc = EPKG_FATAL;
+	int ret;
+
+	memset(stmts, 0, sizeof(stmts));
+
+	sqlite3_initialize();
+	if (sqlite3_open(repofile, &sqlite) != SQLITE_OK)
 		goto cleanup;
+
+	/* catalogue made by an older pkg repo */
+	if (sqlite3_prepare_v2(sqlite, "SELECT epoch, serial, deltas "
+	    "FROM repo_meta", -1, &stmt, NULL) != SQLITE_OK)
+		goto cleanup;
+	ret = sqlite3_step(stmt);
+	if (ret == SQLITE_ROW) {
+		epoch = sqlite3_column_int64(stmt, 0);
+		serial = sqlite3_column_int64(stmt, 1);
+		deltas = sqlite3_column_int64(stmt, 2);
 	}
+	sqlite3_finalize(stmt);
+	if (ret != SQLITE_ROW)
+		goto cleanup;
 
-	sqlite3_close(sqlite);
-	sqlite3_shutdown();
+	/* published without changesets, as of the catalogue we have */
+	if (deltas <= 0)
+		goto cleanup;
+
+	snprintf(url, sizeof(url), "%s/deltas/serial", packagesite);
+	if (pkg_fetch_probe(url, &remote, &size) != EPKG_OK)
+		goto cleanup;
+	ret = fscanf(remote, "%lld %lld %lld", &r_epoch, &r_serial, &r_first);
+	fclose(remote);
+	if (ret != 3)
+		goto cleanup;
 
+	/* rebuilt from scratch, or the changesets we need are gone */
+	if (r_epoch != epoch || r_serial < serial || r_first > serial + 1)
+		goto cleanup;
 
-	if (rename(repofile_unchecked, repofile) != 0) {
-		pkg_emit_errno("rename", "");
-		rc = EPKG_FATAL;
+	if (r_serial == serial) {
+		rc = EPKG_UPTODATE;
 		goto cleanup;
 	}
 
-	if ((rc = remote_add_indexes(name)) != EPKG_OK)
+	/*
+	 * ATTACH is not allowed inside a transaction: copy all the
+	 * changesets into temporary tables first.
+	 */
+	snprintf(delta, sizeof(delta), "%s.delta", repofile);
+	for (long long s = serial + 1; s <= r_serial; s++) {
+		snprintf(url, sizeof(url), "%s/deltas/%lld-%lld.txz",
+		    packagesite, epoch, s);
+		if (fetch_catalogue(url, 0, "delta.sqlite", delta, NULL) !=
+		    EPKG_OK)
+			goto cleanup;
+		ret = stage_delta(sqlite, delta, s, s == serial + 1);
+		unlink(delta);
+		if (ret != EPKG_OK)
+			goto cleanup;
+	}
+
+	req = sqlite3_mprintf("SELECT count(*) FROM temp.d_changeset "
+	    "WHERE epoch = %lld AND changeset = serial", epoch);
+	ret = get_pragma(sqlite, req, &res);
+	sqlite3_free(req);
+	if (ret != EPKG_OK || res != r_serial - serial) {
+		pkg_emit_error("Inconsistent changesets, fetching the whole "
+		    "repository");
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < NUM_DELTA_APPLY; i++) {
+		if (sqlite3_prepare_v2(sqlite, delta_apply[i], -1, &stmts[i],
+		    NULL) != SQLITE_OK) {
+			ERROR_SQLITE(sqlite);
+			goto cleanup;
+		}
+	}
+
+	if (sql_exec(sqlite, "PRAGMA foreign_keys=on;") != EPKG_OK ||
+	    sql_exec(sqlite, "BEGIN;") != EPKG_OK)
+		goto cleanup;
+	in_transaction = true;
+
+	for (long long s = serial + 1; s <= r_serial; s++)
+		if (apply_delta(sqlite, stmts, s) != EPKG_OK)
+			goto cleanup;
+
+	if (sql_exec(sqlite, ""
+	    "DELETE FROM categories WHERE id NOT IN "
+		"(SELECT category_id FROM pkg_categories);"
+	    "DELETE FROM licenses WHERE id NOT IN "
+		"(SELECT license_id FROM pkg_licenses);"
+	    "DELETE FROM shlibs WHERE id NOT IN "
+		"(SELECT shlib_id FROM pkg_shlibs);") != EPKG_OK)
+		goto cleanup;
+
+	if (check_arch(sqlite) != EPKG_OK)
+		goto cleanup;
+
+	/* make sure we ended up with the same catalogue as pkg repo */
+	if (pkg_repo_digest(sqlite, digest) != EPKG_OK)
+		goto cleanup;
+	req = sqlite3_mprintf("SELECT count(*) FROM repo_meta "
+	    "WHERE digest = '%q'", digest);
+	ret = get_pragma(sqlite, req, &res);
+	sqlite3_free(req);
+	if (ret != EPKG_OK || res != 1) {
+		pkg_emit_error("Changesets do not match the repository, "
+		    "fetching the whole repository");
+		goto cleanup;
+	}
+
+	if (sql_exec(sqlite, "COMMIT;") != EPKG_OK)
 		goto cleanup;
+	in_transaction = false;
 
 	rc = EPKG_OK;
 
 	cleanup:
-	if (a != NULL)
-		archive_read_finish(a);
-
-	(void)unlink(tmp);
+	for (size_t i = 0; i < NUM_DELTA_APPLY; i++)
+		if (stmts[i] != NULL)
+			sqlite3_finalize(stmts[i]);
+	if (in_transaction)
+		sql_exec(sqlite, "ROLLBACK;");
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+	sqlite3_shutdown();
 
 	return (rc);
 }
+
+int
+pkg_update(const char *name, const char *packagesite, bool force)
+{
+	char url[MAXPATHLEN];
+	char repofile[MAXPATHLEN];
+	char repofile_unchecked[MAXPATHLEN];
+	const char *dbdir = NULL;
+	int rc = EPKG_FATAL;
+	struct stat st;
+	time_t t = 0;
+	sqlite3 *sqlite = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK) {
+		pkg_emit_error("Cant get dbdir config entry");
+		return (EPKG_FATAL);
+	}
+
+	snprintf(repofile, sizeof(repofile), "%s/%s.sqlite", dbdir, name);
+	if (force)
+		t = 0;		/* Always fetch */
+	else {
+		if (stat(repofile, &st) != -1) {
+			/* try the changesets first, if any */
+			rc = update_delta(packagesite, repofile);
+			if (rc == EPKG_OK || rc == EPKG_UPTODATE)
+				return (rc);
+
+			t = st.st_mtime;
+			/* add 1 minute to the timestamp because
+			 * repo.sqlite is always newer than repo.txz,
+			 * 1 minute should be enough.
+			 */
+			t += 60;
+		}
+	}
+
+	snprintf(url, MAXPATHLEN, "%s/repo.txz", packagesite);
+	snprintf(repofile_unchecked, sizeof(repofile_unchecked),
+	    "%s.unchecked", repofile);
+
+	sqlite3_initialize();
+
+	/* checked on the handle the catalogue was opened with */
+	rc = fetch_catalogue(url, t, "repo.sqlite", repofile_unchecked,
+	    &sqlite);
+	if (rc == EPKG_OK && check_arch(sqlite) != EPKG_OK)
+		rc = EPKG_FATAL;
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+	sqlite3_shutdown();
+	if (rc != EPKG_OK)
+		return (rc);
+
+
+	if (rename(repofile_unchecked, repofile) != 0) {
+		pkg_emit_errno("rename", "");
+		return (EPKG_FATAL);
+	}
+
+	return (remote_add_indexes(name));
+}
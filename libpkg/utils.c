@@ -318,36 +318,64 @@ sha256_str(const char *string, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 	sha256_hash(hash, out);
 }
 
+/*
+ * Hash everything left to read in fd.
+ */
 int
-sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+sha256_fd(int fd, SHA256_CTX *sha256, const char *path)
+{
+	char *buffer;
+	ssize_t r;
+
+	if ((buffer = malloc(HASH_BUFSIZ)) == NULL) {
+		pkg_emit_errno("malloc", "sha256_fd");
+		return (EPKG_FATAL);
+	}
+
+	while ((r = read(fd, buffer, HASH_BUFSIZ)) > 0)
+		SHA256_Update(sha256, buffer, r);
+
+	free(buffer);
+
+	if (r == -1) {
+		pkg_emit_errno("read", path);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+void
+sha256_final(SHA256_CTX *sha256, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
-	FILE *fp;
-	char buffer[BUFSIZ];
 	unsigned char hash[SHA256_DIGEST_LENGTH];
-	size_t r = 0;
+
+	SHA256_Final(hash, sha256);
+	sha256_hash(hash, out);
+}
+
+int
+sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	int fd;
 	SHA256_CTX sha256;
 
-	if ((fp = fopen(path, "rb")) == NULL) {
-		pkg_emit_errno("fopen", path);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", path);
 		return EPKG_FATAL;
 	}
 
 	SHA256_Init(&sha256);
 
-	while ((r = fread(buffer, 1, BUFSIZ, fp)) > 0)
-		SHA256_Update(&sha256, buffer, r);
-
-	if (ferror(fp) != 0) {
-		fclose(fp);
+	if (sha256_fd(fd, &sha256, path) != EPKG_OK) {
+		close(fd);
 		out[0] = '\0';
-		pkg_emit_errno("fread", path);
 		return EPKG_FATAL;
 	}
 
-	fclose(fp);
+	close(fd);
 
-	SHA256_Final(hash, &sha256);
-	sha256_hash(hash, out);
+	sha256_final(&sha256, out);
 
 	return (EPKG_OK);
 }
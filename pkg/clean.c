@@ -24,12 +24,10 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/stat.h>
-
 #include <err.h>
-#include <fts.h>
 #include <pkg.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
@@ -48,14 +46,11 @@ exec_clean(int argc, char **argv)
 {
 	struct pkgdb *db = NULL;
 	struct pkgdb_it *it = NULL;
-	struct pkg *pkg = NULL;
 	struct pkg *p = NULL;
-	FTS *fts = NULL;
-	FTSENT *ent = NULL;
 	const char *cachedir;
-	char *paths[2];
-	char *repopath;
-	bool to_delete;
+	const char *repopath, *newversion;
+	char **stale = NULL;
+	size_t nstale = 0, cap = 0, i;
 	int retcode = EX_SOFTWARE;
 	int ret;
 
@@ -67,75 +62,57 @@ exec_clean(int argc, char **argv)
 		return 1;
 	}
 
-	paths[0] = __DECONST(char*, cachedir);
-	paths[1] = NULL;
+	/* nothing was ever fetched */
+	if (access(cachedir, F_OK) != 0)
+		return (EX_OK);
 
 	if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK) {
 		goto cleanup;
 	}
 
-	if ((fts = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL) {
-		warn("fts_open(%s)", cachedir);
+	if ((it = pkgdb_cache_stale(db)) == NULL)
 		goto cleanup;
-	}
-
-	while ((ent = fts_read(fts)) != NULL) {
-		const char *origin, *pkgrepopath;
-
-		if (ent->fts_info != FTS_F)
-			continue;
-
-		repopath = ent->fts_path + strlen(cachedir);
-		if (repopath[0] == '/')
-			repopath++;
-
-		if (pkg_open(&pkg, ent->fts_path) != EPKG_OK) {
-			warnx("skipping %s", ent->fts_path);
-			continue;
-		}
-
-		pkg_get(pkg, PKG_ORIGIN, &origin);
-		it = pkgdb_search(db, origin, MATCH_EXACT, FIELD_ORIGIN,
-		    FIELD_NONE, NULL);
-
-		if (it == NULL) {
-			warnx("skipping %s", ent->fts_path);
-			continue;
-		}
 
-		if ((ret = pkgdb_it_next(it, &p, PKG_LOAD_BASIC)) ==
-		    EPKG_FATAL) {
-			warnx("skipping %s", ent->fts_path);
-			continue;
-		}
-		to_delete = false;
-		pkg_get(p, PKG_REPOPATH, &pkgrepopath);
-		if (ret == EPKG_END) {
-			to_delete = true;
+	while ((ret = pkgdb_it_next(it, &p, PKG_LOAD_BASIC)) == EPKG_OK) {
+		pkg_get(p, PKG_REPOPATH, &repopath,
+		    PKG_NEWVERSION, &newversion);
+		if (newversion == NULL || newversion[0] == '\0')
 			printf("%s does not exist anymore, deleting it\n",
 			    repopath);
-		} else if (strcmp(repopath, pkgrepopath)) {
+		else
 			printf("%s is out-of-date, deleting it\n", repopath);
-			to_delete = true;
-		}
 
-		if (to_delete == true) {
-			if (unlink(ent->fts_path) != 0)
-				warn("unlink(%s)", ent->fts_path);
+		if (nstale >= cap) {
+			cap |= 1;
+			cap *= 2;
+			if ((stale = reallocf(stale, cap * sizeof(char *))) ==
+			    NULL)
+				err(EX_OSERR, "reallocf");
 		}
-
-		pkgdb_it_free(it);
+		stale[nstale++] = strdup(repopath);
 	}
 
+	if (ret != EPKG_END)
+		goto cleanup;
+
+	/* the index is not updated while it is being read */
+	pkgdb_it_free(it);
+	it = NULL;
+
 	retcode = EX_OK;
+	for (i = 0; i < nstale; i++) {
+		if (pkg_cache_delete(stale[i]) != EPKG_OK)
+			retcode = EX_SOFTWARE;
+	}
 
 	cleanup:
-	if (pkg != NULL)
-		pkg_free(pkg);
+	for (i = 0; i < nstale; i++)
+		free(stale[i]);
+	free(stale);
 	if (p != NULL)
 		pkg_free(p);
-	if (fts != NULL)
-		fts_close(fts);
+	if (it != NULL)
+		pkgdb_it_free(it);
 	if (db != NULL)
 		pkgdb_close(db);
 
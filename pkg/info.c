@@ -189,7 +189,7 @@ exec_info(int argc, char **argv)
 		return (0);
 	}
 
-	ret = pkgdb_open(&db, PKGDB_DEFAULT);
+	ret = pkgdb_open_readonly(&db, PKGDB_DEFAULT);
 	if (ret == EPKG_ENODB) {
 		if (geteuid() == 0)
 			return (EX_IOERR);
@@ -323,6 +323,15 @@ main(int argc, char **argv)
 				fprintf(stderr, "\t%s\n",cmd[i].name);
 	}
 
+	if (debug > 0) {
+		int64_t opened, reused;
+
+		pkg_fetch_connections(&opened, &reused);
+		if (opened > 0)
+			fprintf(stderr, "connections: %jd opened, %jd reused\n",
+			    (intmax_t)opened, (intmax_t)reused);
+	}
+
 	pkg_shutdown();
 	return (ret);
 }
@@ -844,7 +844,7 @@ exec_query(int argc, char **argv)
 		sbuf_finish(sqlcond);
 	}
 
-	ret = pkgdb_open(&db, PKGDB_DEFAULT);
+	ret = pkgdb_open_readonly(&db, PKGDB_DEFAULT);
 	if (ret == EPKG_ENODB) {
 		if (geteuid() == 0)
 			return (EX_IOERR);
@@ -89,7 +89,7 @@ exec_shlib(int argc, char **argv)
 		return (EX_USAGE);
 	}
 
-	if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK) {
+	if (pkgdb_open_readonly(&db, PKGDB_DEFAULT) != EPKG_OK) {
 		pkgdb_close(db);
 		return (EX_IOERR);
 	}
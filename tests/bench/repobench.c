@@ -0,0 +1,393 @@
+/*
+ * Generate a synthetic repository and time pkg repo on it:
+ *
+ *   repobench [-n packages] [-f files] [-s size] [-d deps] [-l shlibs]
+ *             [-o options] [-c categories] [-k rsa-key] [-G] <repo-path>
+ *
+ * The packages are written to <repo-path>/All unless -G is given, in
+ * which case an existing repository is benchmarked as is.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fts.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "private/pkg.h"
+#include "private/thd_repo.h"
+
+static struct {
+	int packages;
+	int files;
+	size_t size;
+	int deps;
+	int shlibs;
+	int options;
+	int categories;
+} conf = { 1000, 10, 16 * 1024, 3, 2, 3, 2 };
+
+struct bench_file {
+	char *path;
+	off_t size;
+};
+
+static struct bench_file *pkgs = NULL;
+static size_t num_pkgs = 0;
+static int64_t total_size = 0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: repobench [-G] [-n packages] [-f files] "
+	    "[-s size] [-d deps] [-l shlibs]\n"
+	    "                 [-o options] [-c categories] [-k rsa-key] "
+	    "<repo-path>\n");
+	exit(1);
+}
+
+static int
+event_callback(void *data, struct pkg_event *ev)
+{
+	(void)data;
+
+	switch (ev->type) {
+	case PKG_EVENT_ERROR:
+		warnx("%s", ev->e_pkg_error.msg);
+		break;
+	case PKG_EVENT_ERRNO:
+		warnx("%s(%s)", ev->e_errno.func, ev->e_errno.arg);
+		break;
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+report(const char *phase, uint64_t usec, uint64_t count, uint64_t bytes)
+{
+	double sec = usec / 1000000.0;
+
+	if (usec == 0) {
+		printf("%-28s %10s\n", phase, "-");
+		return;
+	}
+
+	printf("%-28s %10.3f s %12.1f pkg/s %10.1f MB/s\n", phase, sec,
+	    count / sec, bytes / sec / (1024 * 1024));
+}
+
+/*
+ * Fill a file with content which only depends on the package and file
+ * number, so that the checksum in the manifest can be computed in a
+ * first pass.  A small alphabet keeps it about as compressible as
+ * usual package content.
+ */
+static void
+file_content(char *buf, size_t size, int pkg, int file)
+{
+	uint32_t x = (pkg + 1) * 2654435761U ^ (file + 1) * 40503U;
+
+	for (size_t i = 0; i < size; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = "abcdefghijklmnop\n"[(x >> 16) % 17];
+	}
+}
+
+static void
+file_sum(const char *buf, size_t size, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+
+	SHA256((const unsigned char *)buf, size, hash);
+	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(out + (i * 2), "%02x", hash[i]);
+	out[SHA256_DIGEST_LENGTH * 2] = '\0';
+}
+
+/*
+ * pkg_create_staged() cannot be used here: it rebuilds the shlibs from
+ * the ELF files of the package, so the archives are written directly.
+ */
+static void
+generate(const char *repo)
+{
+	struct packing *pack;
+	struct sbuf *m;
+	char dir[MAXPATHLEN + 1];
+	char path[MAXPATHLEN + 1];
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	const char *abi;
+	char *buf;
+
+	snprintf(dir, sizeof(dir), "%s/All", repo);
+	if (mkdirs(dir) != EPKG_OK)
+		errx(1, "can not create %s", dir);
+
+	pkg_config_string(PKG_CONFIG_ABI, &abi);
+
+	if ((buf = malloc(conf.size)) == NULL)
+		err(1, "malloc");
+
+	m = sbuf_new_auto();
+	for (int i = 0; i < conf.packages; i++) {
+		sbuf_clear(m);
+		sbuf_printf(m,
+		    "name: bench%05d\n"
+		    "version: 1.0\n"
+		    "origin: bench/bench%05d\n"
+		    "comment: synthetic package %d\n"
+		    "desc: synthetic package used by repobench\n"
+		    "arch: %s\n"
+		    "www: http://www.example.org/\n"
+		    "maintainer: bench@example.org\n"
+		    "prefix: /usr/local\n"
+		    "flatsize: %jd\n",
+		    i, i, i, abi, (intmax_t)conf.files * conf.size);
+
+		sbuf_cat(m, "categories: [bench");
+		for (int j = 0; j < conf.categories; j++)
+			sbuf_printf(m, ", cat%d", (i + j) % 64);
+		sbuf_cat(m, "]\n");
+
+		if (conf.deps > 0 && i > 0) {
+			sbuf_cat(m, "deps:\n");
+			for (int j = 1; j <= conf.deps && i - j >= 0; j++)
+				sbuf_printf(m, "  bench%05d: {origin: "
+				    "bench/bench%05d, version: 1.0}\n",
+				    i - j, i - j);
+		}
+
+		if (conf.shlibs > 0) {
+			sbuf_cat(m, "shlibs: [");
+			for (int j = 0; j < conf.shlibs; j++)
+				sbuf_printf(m, "%slibbench%d.so.1",
+				    j == 0 ? "" : ", ", (i + j) % 256);
+			sbuf_cat(m, "]\n");
+		}
+
+		if (conf.options > 0) {
+			sbuf_cat(m, "options:\n");
+			for (int j = 0; j < conf.options; j++)
+				sbuf_printf(m, "  OPT%d: %s\n", j,
+				    (i + j) % 2 ? "on" : "off");
+		}
+
+		if (conf.files > 0) {
+			sbuf_cat(m, "files:\n");
+			for (int j = 0; j < conf.files; j++) {
+				file_content(buf, conf.size, i, j);
+				file_sum(buf, conf.size, sum);
+				sbuf_printf(m, "  /usr/local/share/bench%05d/"
+				    "file%d: %s\n", i, j, sum);
+			}
+		}
+		sbuf_finish(m);
+
+		snprintf(path, sizeof(path), "%s/bench%05d-1.0", dir, i);
+		if (packing_init(&pack, path, TXZ) != EPKG_OK)
+			errx(1, "can not create %s", path);
+		packing_append_buffer(pack, sbuf_data(m), "+MANIFEST",
+		    sbuf_len(m));
+		for (int j = 0; j < conf.files; j++) {
+			file_content(buf, conf.size, i, j);
+			snprintf(path, sizeof(path),
+			    "/usr/local/share/bench%05d/file%d", i, j);
+			packing_append_buffer(pack, buf, path, conf.size);
+		}
+		packing_finish(pack);
+	}
+
+	sbuf_delete(m);
+	free(buf);
+}
+
+static int
+scan(char *repo)
+{
+	FTS *fts;
+	FTSENT *ent;
+	char *paths[2] = { repo, NULL };
+	size_t cap = 0;
+	const char *ext;
+
+	if ((fts = fts_open(paths, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL)
+		err(1, "fts_open(%s)", repo);
+
+	while ((ent = fts_read(fts)) != NULL) {
+		if (ent->fts_info != FTS_F)
+			continue;
+		if ((ext = strrchr(ent->fts_name, '.')) == NULL)
+			continue;
+		if (strcmp(ext, ".tgz") != 0 && strcmp(ext, ".tbz") != 0 &&
+		    strcmp(ext, ".txz") != 0 && strcmp(ext, ".tar") != 0)
+			continue;
+		if (strcmp(ent->fts_name, "repo.txz") == 0)
+			continue;
+
+		if (num_pkgs >= cap) {
+			cap |= 1;
+			cap *= 2;
+			pkgs = reallocf(pkgs, cap * sizeof(struct bench_file));
+			if (pkgs == NULL)
+				err(1, "reallocf");
+		}
+		pkgs[num_pkgs].path = strdup(ent->fts_path);
+		pkgs[num_pkgs].size = ent->fts_statp->st_size;
+		total_size += ent->fts_statp->st_size;
+		num_pkgs++;
+	}
+	fts_close(fts);
+
+	return (0);
+}
+
+static void
+run_repo(char *repo, bool force, char *key, const char *title)
+{
+	struct repo_timings t;
+	uint64_t start, create, finish;
+
+	memset(&t, 0, sizeof(t));
+
+	start = now();
+	if (pkg_create_repo_timed(repo, force, NULL, NULL, &t) != EPKG_OK)
+		errx(1, "pkg_create_repo(%s) failed", repo);
+	create = now() - start;
+
+	start = now();
+	if (pkg_finish_repo_timed(repo, NULL, key, &t) != EPKG_OK)
+		errx(1, "pkg_finish_repo(%s) failed", repo);
+	finish = now() - start;
+
+	printf("\n%s:\n", title);
+	report("  pkg_create_repo", create, num_pkgs, total_size);
+	report("    scan", t.scan, num_pkgs, total_size);
+	report("    hash + manifest (cpu)", t.read, t.packages, t.bytes);
+	report("    sql insert", t.insert, t.packages, t.bytes);
+	report("    commit", t.commit, t.packages, t.bytes);
+	report("  pkg_finish_repo", finish, num_pkgs, total_size);
+	report("    sign", t.sign, num_pkgs, total_size);
+	report("    compress", t.compress, num_pkgs, total_size);
+	report("  total", create + finish, num_pkgs, total_size);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pkg *pkg = NULL;
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char path[MAXPATHLEN + 1];
+	char *key = NULL;
+	bool gen = true;
+	uint64_t start;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "Gc:d:f:k:l:n:o:s:")) != -1) {
+		switch (ch) {
+		case 'G':
+			gen = false;
+			break;
+		case 'c':
+			conf.categories = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			conf.deps = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			conf.files = strtol(optarg, NULL, 10);
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'l':
+			conf.shlibs = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			conf.packages = strtol(optarg, NULL, 10);
+			break;
+		case 'o':
+			conf.options = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			conf.size = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	if (pkg_init(NULL) != EPKG_OK)
+		errx(1, "can not parse configuration file");
+	pkg_event_register(event_callback, NULL);
+
+	if (gen) {
+		start = now();
+		generate(argv[0]);
+		printf("generated %d packages in %.3f s\n", conf.packages,
+		    (now() - start) / 1000000.0);
+	}
+
+	/* start from scratch */
+	snprintf(path, sizeof(path), "%s/repo.txz", argv[0]);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/repo.sqlite", argv[0]);
+	unlink(path);
+
+	start = now();
+	scan(argv[0]);
+	printf("\nsingle threaded phases:\n");
+	report("  scan", now() - start, num_pkgs, total_size);
+
+	start = now();
+	for (size_t i = 0; i < num_pkgs; i++)
+		sha256_file(pkgs[i].path, sum);
+	report("  hash", now() - start, num_pkgs, total_size);
+
+	start = now();
+	for (size_t i = 0; i < num_pkgs; i++)
+		pkg_open(&pkg, pkgs[i].path);
+	report("  manifest parse", now() - start, num_pkgs, total_size);
+
+	start = now();
+	for (size_t i = 0; i < num_pkgs; i++)
+		pkg_open_cksum(&pkg, pkgs[i].path, sum);
+	report("  hash + manifest parse", now() - start, num_pkgs,
+	    total_size);
+	pkg_free(pkg);
+
+	run_repo(argv[0], true, key, "full build");
+	run_repo(argv[0], false, key, "incremental build, nothing changed");
+
+	for (size_t i = 0; i < num_pkgs; i++)
+		free(pkgs[i].path);
+	free(pkgs);
+
+	pkg_shutdown();
+
+	return (0);
+}
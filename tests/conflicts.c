@@ -0,0 +1,183 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <pkg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "private/pkg.h"
+
+#include "tests.h"
+
+/* the paths listed by pkg_conflicts_next(), in the order they came */
+static size_t
+conflicts(struct pkg_conflicts *c, struct conflict_path **list, size_t max)
+{
+	struct conflict_path *e;
+	size_t i = 0, n = 0;
+
+	while ((e = pkg_conflicts_next(c, &i)) != NULL) {
+		if (n < max)
+			list[n] = e;
+		n++;
+	}
+
+	return (n);
+}
+
+static bool
+shares_with(struct conflict_owner *o, struct conflict_owner *installed)
+{
+	struct conflict_ref *r;
+
+	for (r = o->installed; r != NULL; r = r->next)
+		if (r->owner == installed)
+			return (true);
+
+	return (false);
+}
+
+START_TEST(conflicts_upgrade)
+{
+	struct pkg_conflicts *c;
+	struct conflict_owner *old, *new;
+	struct conflict_path *list[2];
+
+	fail_unless((c = pkg_conflicts_new()) != NULL);
+	old = pkg_conflicts_owner(c, 1, "test/foo", "foo", "1.0");
+	fail_unless(old != NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/foo", old) != NULL);
+	fail_unless(!old->replaced);
+
+	new = pkg_conflicts_owner(c, 0, "test/foo", "foo", "2.0");
+	fail_unless(new != NULL);
+	fail_unless(old->replaced);
+	fail_unless(pkg_conflicts_get(c, "test/foo") == new);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/foo", new) != NULL);
+	/* the same path again is not a new conflict */
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/foo", new) != NULL);
+
+	/* listed, but the installed owner is replaced: not a conflict */
+	fail_unless(conflicts(c, list, 2) == 1);
+	fail_unless(strcmp(list[0]->path, "/usr/local/bin/foo") == 0);
+	fail_unless(list[0]->owners->owner == new);
+	fail_unless(list[0]->owners->next->owner == old);
+	fail_unless(list[0]->owners->next->owner->replaced);
+	fail_unless(list[0]->owners->next->next == NULL);
+
+	pkg_conflicts_free(c);
+}
+END_TEST
+
+START_TEST(conflicts_incoming)
+{
+	struct pkg_conflicts *c;
+	struct conflict_owner *bar, *baz;
+	struct conflict_path *list[2];
+
+	fail_unless((c = pkg_conflicts_new()) != NULL);
+	bar = pkg_conflicts_owner(c, 0, "test/bar", "bar", "1.0");
+	baz = pkg_conflicts_owner(c, 0, "test/baz", "baz", "1.0");
+	fail_unless(bar != NULL && baz != NULL);
+
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/bar", bar) != NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/x", bar) != NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/baz", baz) != NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/x", baz) != NULL);
+
+	fail_unless(conflicts(c, list, 2) == 1);
+	fail_unless(strcmp(list[0]->path, "/usr/local/bin/x") == 0);
+	fail_unless(list[0]->owners->owner == baz);
+	fail_unless(list[0]->owners->next->owner == bar);
+	fail_unless(bar->installed == NULL && baz->installed == NULL);
+
+	pkg_conflicts_free(c);
+}
+END_TEST
+
+START_TEST(conflicts_installed)
+{
+	struct pkg_conflicts *c;
+	struct conflict_owner *qux, *quux;
+	struct conflict_path *list[2];
+
+	fail_unless((c = pkg_conflicts_new()) != NULL);
+	qux = pkg_conflicts_owner(c, 2, "test/qux", "qux", "1.0");
+	fail_unless(qux != NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/lib/libq.so", qux) !=
+	    NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/qux", qux) != NULL);
+
+	quux = pkg_conflicts_owner(c, 0, "test/quux", "quux", "1.0");
+	fail_unless(quux != NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/lib/libq.so", quux) !=
+	    NULL);
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/quux", quux) !=
+	    NULL);
+
+	/* another origin: the installed package stays, and conflicts */
+	fail_unless(!qux->replaced);
+	fail_unless(shares_with(quux, qux));
+	fail_unless(quux->installed->next == NULL);
+	fail_unless(conflicts(c, list, 2) == 1);
+	fail_unless(strcmp(list[0]->path, "/usr/local/lib/libq.so") == 0);
+	fail_unless(list[0]->owners->next->owner == qux);
+
+	pkg_conflicts_free(c);
+}
+END_TEST
+
+/* more paths than the initial size of the hash table */
+START_TEST(conflicts_grow)
+{
+	struct pkg_conflicts *c;
+	struct conflict_owner *big, *other;
+	struct conflict_path *list[16];
+	char path[MAXPATHLEN];
+	size_t i;
+
+	fail_unless((c = pkg_conflicts_new()) != NULL);
+	big = pkg_conflicts_owner(c, 3, "test/big", "big", "1.0");
+	fail_unless(big != NULL);
+	for (i = 0; i < 20000; i++) {
+		snprintf(path, sizeof(path), "/usr/local/share/big/%zu", i);
+		fail_unless(pkg_conflicts_add(c, path, big) != NULL);
+	}
+
+	other = pkg_conflicts_owner(c, 0, "test/other", "other", "1.0");
+	fail_unless(other != NULL);
+	for (i = 0; i < 20000; i += 2000) {
+		snprintf(path, sizeof(path), "/usr/local/share/big/%zu", i);
+		fail_unless(pkg_conflicts_add(c, path, other) != NULL);
+	}
+	fail_unless(pkg_conflicts_add(c, "/usr/local/bin/other", other) !=
+	    NULL);
+
+	/* every path moved to the bigger table is still found */
+	fail_unless(conflicts(c, list, 16) == 10);
+	for (i = 0; i < 10; i++) {
+		snprintf(path, sizeof(path), "/usr/local/share/big/%zu",
+		    i * 2000);
+		fail_unless(strcmp(list[i]->path, path) == 0);
+		fail_unless(list[i]->owners->owner == other);
+		fail_unless(list[i]->owners->next->owner == big);
+	}
+	fail_unless(shares_with(other, big));
+	fail_unless(other->installed->next == NULL);
+
+	pkg_conflicts_free(c);
+}
+END_TEST
+
+TCase *
+tcase_conflicts(void)
+{
+	TCase *tc = tcase_create("Conflicts");
+	tcase_add_test(tc, conflicts_upgrade);
+	tcase_add_test(tc, conflicts_incoming);
+	tcase_add_test(tc, conflicts_installed);
+	tcase_add_test(tc, conflicts_grow);
+
+	return (tc);
+}
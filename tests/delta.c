@@ -0,0 +1,109 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <pkg.h>
+#include <string.h>
+
+#include "private/pkg.h"
+
+#include "tests.h"
+
+#define SUM1 "01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b"
+#define SUM2 "2c26b46b68ffc68ff99b453c1d30413413422d706483bfa0f98a5e886266e7ae"
+#define SUM3 "fcde2b2edba56bf408601fb721fe9b5c338d10ee429ea04fae5511b68fbf8fb9"
+
+START_TEST(delta_files_dirs)
+{
+	struct pkg *old = NULL, *new = NULL;
+	struct pkg_delta *delta = NULL;
+	struct pkg_delta_file *df;
+	struct pkg_delta_dir *dd;
+
+	fail_unless(pkg_new(&old, PKG_INSTALLED) == EPKG_OK);
+	fail_unless(pkg_new(&new, PKG_FILE) == EPKG_OK);
+
+	/* added in any order, the delta is sorted by path */
+	pkg_addfile(old, "/usr/local/bin/c", SUM2, false);
+	pkg_addfile(old, "/usr/local/bin/a", SUM1, false);
+	pkg_addfile(old, "/usr/local/bin/d", NULL, false);
+	pkg_addfile(old, "/usr/local/bin/b", SUM1, false);
+	pkg_adddir(old, "/usr/local/share/y/", false);
+	pkg_adddir(old, "/usr/local/share/x/", false);
+
+	pkg_addfile(new, "/usr/local/bin/e", SUM1, false);
+	pkg_addfile(new, "/usr/local/bin/d", NULL, false);
+	pkg_addfile(new, "/usr/local/bin/c", SUM3, false);
+	pkg_addfile(new, "/usr/local/bin/b", SUM1, false);
+	pkg_adddir(new, "/usr/local/share/z/", false);
+	pkg_adddir(new, "/usr/local/share/y/", false);
+
+	fail_unless(pkg_delta_new(&delta, old, new) == EPKG_OK);
+
+	fail_unless(delta->num_files == 5);
+	df = delta->files;
+	fail_unless(strcmp(df[0].old->path, "/usr/local/bin/a") == 0);
+	fail_unless(df[0].new == NULL);
+	fail_unless(df[0].type == PKG_DELTA_REMOVED);
+	fail_unless(strcmp(df[1].new->path, "/usr/local/bin/b") == 0);
+	fail_unless(df[1].type == PKG_DELTA_UNCHANGED);
+	fail_unless(strcmp(df[2].new->path, "/usr/local/bin/c") == 0);
+	fail_unless(df[2].type == PKG_DELTA_CHANGED);
+	/* without a checksum, a file cannot be told unchanged */
+	fail_unless(strcmp(df[3].new->path, "/usr/local/bin/d") == 0);
+	fail_unless(df[3].type == PKG_DELTA_CHANGED);
+	fail_unless(df[4].old == NULL);
+	fail_unless(strcmp(df[4].new->path, "/usr/local/bin/e") == 0);
+	fail_unless(df[4].type == PKG_DELTA_ADDED);
+
+	fail_unless(delta->num_dirs == 3);
+	dd = delta->dirs;
+	fail_unless(strcmp(dd[0].old->path, "/usr/local/share/x/") == 0);
+	fail_unless(dd[0].type == PKG_DELTA_REMOVED);
+	fail_unless(strcmp(dd[1].new->path, "/usr/local/share/y/") == 0);
+	fail_unless(dd[1].old != NULL);
+	fail_unless(dd[1].type == PKG_DELTA_UNCHANGED);
+	fail_unless(strcmp(dd[2].new->path, "/usr/local/share/z/") == 0);
+	fail_unless(dd[2].old == NULL);
+	fail_unless(dd[2].type == PKG_DELTA_ADDED);
+
+	pkg_delta_free(delta);
+	pkg_free(old);
+	pkg_free(new);
+}
+END_TEST
+
+START_TEST(delta_empty)
+{
+	struct pkg *old = NULL, *new = NULL;
+	struct pkg_delta *delta = NULL;
+
+	fail_unless(pkg_new(&old, PKG_INSTALLED) == EPKG_OK);
+	fail_unless(pkg_new(&new, PKG_FILE) == EPKG_OK);
+	pkg_addfile(new, "/usr/local/bin/a", SUM1, false);
+
+	fail_unless(pkg_delta_new(&delta, old, new) == EPKG_OK);
+	fail_unless(delta->num_files == 1);
+	fail_unless(delta->files[0].type == PKG_DELTA_ADDED);
+	fail_unless(delta->num_dirs == 0);
+	pkg_delta_free(delta);
+
+	fail_unless(pkg_delta_new(&delta, new, old) == EPKG_OK);
+	fail_unless(delta->num_files == 1);
+	fail_unless(delta->files[0].type == PKG_DELTA_REMOVED);
+	pkg_delta_free(delta);
+
+	pkg_free(old);
+	pkg_free(new);
+}
+END_TEST
+
+TCase *
+tcase_delta(void)
+{
+	TCase *tc = tcase_create("Delta");
+	tcase_add_test(tc, delta_files_dirs);
+	tcase_add_test(tc, delta_empty);
+
+	return (tc);
+}
@@ -0,0 +1,100 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+#include <pkg.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tests.h"
+
+static const char response[] = ""
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Length: 6\r\n"
+	"\r\n"
+	"hello\n";
+
+/*
+ * Stand-in HTTP server answering every request with `response', on as
+ * many connections as the client opens.
+ */
+static pid_t
+http_server(int *port)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char buf[1024];
+	ssize_t r;
+	pid_t pid;
+	int s, c;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(s != -1);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(bind(s, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	fail_unless(listen(s, 5) == 0);
+	fail_unless(getsockname(s, (struct sockaddr *)&sin, &len) == 0);
+	*port = ntohs(sin.sin_port);
+
+	if ((pid = fork()) != 0) {
+		close(s);
+		return (pid);
+	}
+
+	while ((c = accept(s, NULL, NULL)) != -1) {
+		/* one request per read is enough for pkg */
+		while ((r = read(c, buf, sizeof(buf))) > 0)
+			write(c, response, sizeof(response) - 1);
+		close(c);
+	}
+	_exit(0);
+}
+
+START_TEST(fetch_reuse)
+{
+	char url[64];
+	char dest[] = "/tmp/pkg-fetch-test.XXXXXX";
+	int64_t opened, reused;
+	pid_t pid;
+	int port, fd;
+
+	fail_unless(pkg_init(NULL) == EPKG_OK);
+	pid = http_server(&port);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/foo.txz", port);
+
+	for (int i = 0; i < 3; i++) {
+		fail_unless((fd = mkstemp(dest)) != -1);
+		close(fd);
+		unlink(dest);
+		fail_unless(pkg_fetch_file(url, dest, 0) == EPKG_OK);
+		unlink(dest);
+		strcpy(dest + strlen(dest) - 6, "XXXXXX");
+	}
+
+	pkg_fetch_connections(&opened, &reused);
+	fail_unless(opened == 1);
+	fail_unless(reused == 2);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	pkg_shutdown();
+}
+END_TEST
+
+TCase *
+tcase_fetch(void)
+{
+	TCase *tc = tcase_create("Fetch");
+	tcase_add_test(tc, fetch_reuse);
+
+	return (tc);
+}
@@ -0,0 +1,125 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <check.h>
+#include <pkg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "private/pkg.h"
+#include "private/thd_repo.h"
+
+#include "tests.h"
+
+static const char manifest[] = ""
+	"name: foo\n"
+	"version: %s\n"
+	"origin: test/foo\n"
+	"comment: a test package\n"
+	"desc: a test package\n"
+	"arch: %s\n"
+	"www: http://www.example.org/\n"
+	"maintainer: test@example.org\n"
+	"prefix: /usr/local\n"
+	"flatsize: 0\n";
+
+static void
+repo_add(const char *dir, const char *version)
+{
+	struct packing *pack;
+	char path[MAXPATHLEN + 1];
+	char buf[1024];
+	const char *abi;
+
+	pkg_config_string(PKG_CONFIG_ABI, &abi);
+	snprintf(buf, sizeof(buf), manifest, version, abi);
+	snprintf(path, sizeof(path), "%s/foo-%s", dir, version);
+	fail_unless(packing_init(&pack, path, TXZ) == EPKG_OK);
+	packing_append_buffer(pack, buf, "+MANIFEST", strlen(buf));
+	packing_finish(pack);
+}
+
+/* Number of packages read by an incremental run of pkg repo on `dir'. */
+static uint64_t
+repo_read(char *dir)
+{
+	struct repo_timings t;
+
+	memset(&t, 0, sizeof(t));
+	fail_unless(pkg_create_repo_timed(dir, false, NULL, NULL, &t) ==
+	    EPKG_OK);
+
+	return (t.packages);
+}
+
+START_TEST(repo_incremental)
+{
+	struct timeval tv[2];
+	char dir[] = "/tmp/pkg-repo-test.XXXXXX";
+	char path[MAXPATHLEN + 1];
+
+	fail_unless(pkg_init(NULL) == EPKG_OK);
+	fail_unless(mkdtemp(dir) != NULL);
+	repo_add(dir, "1.0");
+
+	fail_unless(repo_read(dir) == 1);
+	fail_unless(repo_read(dir) == 0);
+
+	/* touched but not changed: read once more, then skipped again */
+	snprintf(path, sizeof(path), "%s/foo-1.0.txz", dir);
+	gettimeofday(&tv[0], NULL);
+	tv[0].tv_sec -= 3600;
+	tv[1] = tv[0];
+	fail_unless(utimes(path, tv) == 0);
+	fail_unless(repo_read(dir) == 1);
+	fail_unless(repo_read(dir) == 0);
+
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/repo.sqlite", dir);
+	unlink(path);
+	rmdir(dir);
+	pkg_shutdown();
+}
+END_TEST
+
+START_TEST(repo_superseded)
+{
+	char dir[] = "/tmp/pkg-repo-test.XXXXXX";
+	char path[MAXPATHLEN + 1];
+
+	fail_unless(pkg_init(NULL) == EPKG_OK);
+	fail_unless(mkdtemp(dir) != NULL);
+	repo_add(dir, "0.9");
+	repo_add(dir, "1.0");
+
+	/* the older version is left out, and not read again either */
+	fail_unless(repo_read(dir) == 2);
+	fail_unless(repo_read(dir) == 0);
+
+	/* until the newer one is gone */
+	snprintf(path, sizeof(path), "%s/foo-1.0.txz", dir);
+	unlink(path);
+	fail_unless(repo_read(dir) == 1);
+	fail_unless(repo_read(dir) == 0);
+
+	snprintf(path, sizeof(path), "%s/foo-0.9.txz", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/repo.sqlite", dir);
+	unlink(path);
+	rmdir(dir);
+	pkg_shutdown();
+}
+END_TEST
+
+TCase *
+tcase_repo(void)
+{
+	TCase *tc = tcase_create("Repo");
+	tcase_add_test(tc, repo_incremental);
+	tcase_add_test(tc, repo_superseded);
+
+	return (tc);
+}
@@ -8,8 +8,12 @@ main()
 	int nfailed = 0;
 	Suite *s = suite_create("pkgng");
 
+	suite_add_tcase(s, tcase_conflicts());
+	suite_add_tcase(s, tcase_delta());
+	suite_add_tcase(s, tcase_fetch());
 	suite_add_tcase(s, tcase_manifest());
 	suite_add_tcase(s, tcase_pkg());
+	suite_add_tcase(s, tcase_repo());
 
 	/* Run the tests ...*/
 	SRunner *sr = srunner_create(s);
@@ -1,4 +1,8 @@
 #include <check.h>
 
+TCase * tcase_conflicts(void);
+TCase * tcase_delta(void);
+TCase * tcase_fetch(void);
 TCase * tcase_manifest(void);
 TCase * tcase_pkg(void);
+TCase * tcase_repo(void);